@@ -96,6 +96,25 @@
 */
 #define IDLE_SEND_TIMELIMIT 300
 
+/* CONFIGURE: How many seconds to wait for the next request on a persistent
+** (keep-alive) connection before closing it.  Zero turns keep-alives off.
+** This can also be set in the runtime config file.
+*/
+#define IDLE_KEEPALIVE_TIMELIMIT 15
+
+/* CONFIGURE: Maximum number of requests to serve on one persistent
+** connection before closing it, or zero for no limit.  This can also be
+** set in the runtime config file.
+*/
+#define KEEPALIVE_MAX_REQUESTS 100
+
+/* CONFIGURE: How many bytes of responses with no body (HEAD, 304 and the
+** like) can be held for a pipelining client before they get sent.  No
+** more of that connection's requests are answered until they've gone out,
+** so a client that doesn't read can't make the server hold more than this.
+*/
+#define MAX_HELD_RESPONSE 16384
+
 /* CONFIGURE: The syslog facility to use.  Using this you can set up your
 ** syslog.conf so that all thttpd messages go into a separate file.  Note
 ** that even if you use the -l command line flag to send logging to a
@@ -293,22 +312,66 @@
 */
 #define STATS_TIME 3600
 
-/* CONFIGURE: The mmap cache tries to keep the total number of mapped
-** files below this number, so you don't run out of kernel file descriptors.
+/* CONFIGURE: The mmap cache keeps the total number of mapped files at
+** or below this number, so you don't run out of kernel file descriptors.
 ** If you have reconfigured your kernel to have more descriptors, you can
-** raise this and thttpd will keep more maps cached.  However it's not
-** a hard limit, thttpd will go over it if you really are accessing
-** a whole lot of files.
+** raise this and thttpd will keep more maps cached.  Files that are
+** in use don't count against the limit, so thttpd will go over it if
+** you really are sending a whole lot of files at once; otherwise the
+** least recently used ones get dropped.
 */
 #define DESIRED_MAX_MAPPED_FILES 1000
 
-/* CONFIGURE: The mmap cache also tries to keep the total mapped bytes
+/* CONFIGURE: The mmap cache also keeps the total mapped bytes at or
 ** below this number, so you don't run out of address space.  Again
-** it's not a hard limit, thttpd will go over it if you really are
-** accessing a bunch of large files.
+** files in use can push it over.
 */
 #define DESIRED_MAX_MAPPED_BYTES 1000000000
 
+/* CONFIGURE: Files up to this size get read into memory instead of
+** mapped, and keep a ready-made copy of their response headers.
+*/
+#define SMALL_FILE_SIZE 16384
+
+/* CONFIGURE: Files bigger than this never get mapped whole.  They are
+** sent through a sliding window of FILE_WINDOW_SIZE bytes instead, so
+** each download of a huge file only ties up that much address space.
+** The window size must be a multiple of the page size.
+*/
+#define LARGE_FILE_SIZE 33554432
+#define FILE_WINDOW_SIZE 4194304
+
+/* CONFIGURE: Small files are read into one cache of this many bytes in
+** shared memory, used by all the thttpd processes on the host that serve
+** the same document root - -workers processes, or separate servers -
+** so they don't each keep their own copies.  Undefine this to give each
+** process a private cache.
+*/
+#define SHARED_CACHE_SIZE 67108864
+
+/* CONFIGURE: How many seconds to trust remembered stat() results and
+** symlink expansions.  With the stat cache, requests for popular files
+** don't need any filesystem calls at all before the send, but changes
+** to the tree can take this long to show up.  If this is undefined
+** then every request goes to the filesystem.
+*/
+#define STAT_CACHE_TIME 2
+
+/* CONFIGURE: On systems with inotify, the stat cache watches the
+** directories it has entries for and every directory above them, and
+** throws everything out whenever something in them changes.  Entries can
+** then be kept this much longer - except for paths that go through
+** symlinks, since changes along the link targets wouldn't be seen.
+** A file in the tree that gets written all the time, like a log file,
+** keeps emptying the cache, so keep those somewhere else.
+*/
+#define STAT_CACHE_WATCH_TIME 60
+
+/* CONFIGURE: Number of entries in the stat cache.  Each thread gets its
+** own cache of this size.
+*/
+#define STAT_CACHE_SIZE 4096
+
 
 /* You almost certainly don't want to change anything below here. */
 
@@ -338,6 +401,14 @@
 */
 #define GENERATE_INDEXES
 
+/* CONFIGURE: If this is defined then thttpd will look for precompressed
+** versions of files and send one instead, to clients whose Accept-Encoding
+** allows it.  For foo.css it tries foo.css.br, foo.css.zst, and then
+** foo.css.gz, using the first one that exists and is at least as new
+** as foo.css.
+*/
+#define PRECOMPRESSED_FILES
+
 /* CONFIGURE: Whether to log unknown request headers.  Most sites will not
 ** want to log them, which will save them a bit of CPU time.
 */
@@ -346,10 +417,37 @@
 #endif
 
 /* CONFIGURE: Whether to fflush() the log file after each request.  If
-** this is turned off there's a slight savings in CPU cycles.
+** this is turned off there's a slight savings in CPU cycles.  This has
+** no effect when the log ring below is in use, since the writer thread
+** already writes each batch out as soon as it's formatted.
 */
 #define FLUSH_LOG_EVERY_TIME
 
+/* CONFIGURE: In a threaded build, log file lines can be handed off to a
+** writer thread instead of being written from the main loop, so a slow
+** disk doesn't hold up every connection.  Each server gets a ring of this
+** many lines (of about 1KB each) between its main loop and its writer.
+** Comment this out to write the log synchronously.
+*/
+#define LOG_RING_SIZE 1024
+
+/* CONFIGURE: What to do when the log ring is full.  Normally the line is
+** dropped, and counted in the stats syslog.  Define this to make the main
+** loop wait for the writer instead, so no lines are lost.
+*/
+#ifdef notdef
+#define LOG_RING_BLOCK
+#endif
+
+/* CONFIGURE: Whether to watch connection sockets in edge-triggered mode,
+** on systems where fdwatch can do that (epoll and kqueue).  Reads and
+** writes then keep going until the socket is drained or full, instead of
+** doing one read() or write() per trip through fdwatch().
+*/
+#ifdef notdef
+#define USE_EDGE_TRIGGERED
+#endif
+
 /* CONFIGURE: Time between updates of the throttle table's rolling averages. */
 #define THROTTLE_TIME 2
 
@@ -367,6 +465,22 @@
 */
 #define MAXTHROTTLENUMS 10
 
+/* CONFIGURE: Maximum number of byte ranges honored in one request.  A
+** Range header asking for more gets the whole file instead, so a
+** pathological header can't turn into an enormous multipart response.
+*/
+#define MAX_BYTE_RANGES 16
+
+/* CONFIGURE: How many read and response buffers to keep for reuse.
+** Connections only hold buffers while they have something to read or
+** send, and give them back to a pool while they wait for their next
+** request.  Read and response buffers have separate pools of this many.
+** Buffers given back when the pool is full get freed, and so do ones that
+** have grown past BUFFER_POOL_MAX_BUF bytes.
+*/
+#define BUFFER_POOL_SIZE 256
+#define BUFFER_POOL_MAX_BUF 4096
+
 /* CONFIGURE: Number of file descriptors to reserve for uses other than
 ** connections.  Currently this is 10, representing one for the listen fd,
 ** one for dup()ing at connection startup time, one for reading the file,
@@ -380,6 +494,12 @@
 */
 #define LINGER_TIME 500
 
+/* CONFIGURE: In -workers mode, a worker process that dies less than this
+** many seconds after it was started gets restarted only after the rest of
+** this time has passed, so that one that crashes right away doesn't spin.
+*/
+#define WORKER_RESTART_TIME 5
+
 /* CONFIGURE: Maximum number of symbolic links to follow before
 ** assuming there's a loop.
 */
@@ -389,4 +509,14 @@
 */
 #define MIN_WOULDBLOCK_DELAY 100L
 
+/* In a threaded build each thread runs its own main loop, so the statics
+** the loop uses - connections, timers, watched descriptors, scratch
+** buffers - are declared THREAD_LOCAL to give every thread its own.
+*/
+#ifdef HAVE_LIBPTHREAD
+#define THREAD_LOCAL __thread
+#else /* HAVE_LIBPTHREAD */
+#define THREAD_LOCAL
+#endif /* HAVE_LIBPTHREAD */
+
 #endif /* _CONFIG_H_ */
@@ -0,0 +1,534 @@
+/* connscan.c - cache-miss benchmark for the connecttab layout in thttpd.c
+**
+** Builds a table of connections (50000 by default) four ways: with the
+** field order connecttab had before; with the hot fields moved to the
+** front; with the hot fields in front plus each entry padded and the
+** table aligned to a cache line; and split into a dense array of just
+** the hot fields, one cache line per slot, with the rest in a second
+** array, which is what thttpd.c does now.  Every connection also gets an
+** httpd_conn of its own, allocated separately in slot order - with
+** malloc()'s alignment, except that the split layout puts them on cache
+** line boundaries too, like thttpd.c.  Then it visits the connections in
+** random order, the way fdwatch hands back ready sockets, reading and
+** updating the fields an unthrottled handle_send() uses in both structs.
+** On Linux the L1 data cache and last-level cache read misses come from
+** perf_event_open(2); elsewhere, or if the kernel won't allow it (see
+** /proc/sys/kernel/perf_event_paranoid), only the time is reported.
+** Either way it also prints how many distinct cache lines a visit
+** touches, in the table and in all, averaged over the connections, which
+** is the number of misses per visit once they're too big for the cache.
+** The structs are copied from thttpd.c and libhttpd.h; keep them in step.
+**
+** Build and run:
+**     cc -O2 -o connscan connscan.c && ./connscan [connections [passes]]
+*/
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define USE_PERF_EVENTS
+#endif /* __linux__ */
+
+
+#define MAXTHROTTLENUMS 10
+#define CNST_SENDING 2
+
+typedef struct TimerStruct Timer;
+
+/* The front of httpd_conn, where the fields handle_send() uses are, and
+** the rest of it as filler.  It's 1232 bytes in all on LP64 Linux.
+*/
+#define HTTPD_CONN_SIZE 1232
+typedef struct {
+    int conn_fd;
+    int file_fd;
+    char* file_address;
+    char* window_address;
+    off_t window_start;
+    size_t window_len;
+    char* response;
+    size_t responselen;
+    off_t bytes_sent;
+    int nranges;
+    char rest[HTTPD_CONN_SIZE - 72];
+    } httpd_conn;
+
+/* connecttab before the hot fields were grouped. */
+typedef struct OldStruct {
+    int conn_state;
+    int next_free_connect;
+    struct OldStruct* state_prev;
+    struct OldStruct* state_next;
+    httpd_conn* hc;
+    int tnums[MAXTHROTTLENUMS];
+    int numtnums;
+    int num_requests;
+    long max_limit, min_limit;
+    time_t started_at, active_at;
+    Timer* wakeup_timer;
+    Timer* linger_timer;
+    long wouldblock_delay;
+    off_t bytes;
+    off_t end_byte_index;
+    off_t next_byte_index;
+    } old_connecttab;
+
+/* connecttab with the hot fields grouped, before the split. */
+#define NEW_FIELDS(tag) \
+    int conn_state; \
+    int numtnums; \
+    httpd_conn* hc; \
+    off_t next_byte_index; \
+    off_t end_byte_index; \
+    long max_limit; \
+    long wouldblock_delay; \
+    time_t active_at; \
+    struct tag* state_prev; \
+    struct tag* state_next; \
+    int tnums[MAXTHROTTLENUMS]; \
+    time_t started_at; \
+    long min_limit; \
+    off_t bytes; \
+    Timer* wakeup_timer; \
+    Timer* linger_timer; \
+    int num_requests; \
+    int held_only; \
+    int next_free_connect;
+
+typedef struct GroupedStruct {
+    NEW_FIELDS(GroupedStruct)
+    } grouped_connecttab;
+
+/* The same, padded and aligned to a cache line. */
+#define CONNECT_ALIGN 64
+#ifdef __GNUC__
+#define CONNECT_ALIGNED __attribute__((aligned(CONNECT_ALIGN)))
+#else /* __GNUC__ */
+#define CONNECT_ALIGNED
+#endif /* __GNUC__ */
+
+typedef struct AlignedStruct {
+    NEW_FIELDS(AlignedStruct)
+    } CONNECT_ALIGNED aligned_connecttab;
+
+/* connecttab and connectcold as they are now: the same hot fields plus a
+** pointer to the rest, 64 bytes, in a dense array with one entry per
+** cache line, and everything else in a parallel array.
+*/
+typedef struct {
+    int conn_state;
+    int numtnums;
+    httpd_conn* hc;
+    off_t next_byte_index;
+    off_t end_byte_index;
+    long max_limit;
+    long wouldblock_delay;
+    time_t active_at;
+    struct SplitColdStruct* cold;
+    } CONNECT_ALIGNED split_hot;
+
+typedef struct SplitColdStruct {
+    split_hot* state_prev;
+    split_hot* state_next;
+    int tnums[MAXTHROTTLENUMS];
+    time_t started_at;
+    long min_limit;
+    off_t bytes;
+    Timer* wakeup_timer;
+    Timer* linger_timer;
+    int num_requests;
+    int held_only;
+    int next_free_connect;
+    char* hc_mem;
+    } split_cold;
+
+
+static int nconns, passes;
+static int* order;
+static long visits;
+static long sink;
+
+
+/* One handle_send() pass over a connection that sends a little and
+** keeps going.  The same code for every layout.
+*/
+#define VISIT(c) \
+    do { \
+	httpd_conn* hc = (c)->hc; \
+	if ( (c)->conn_state == CNST_SENDING && hc != (httpd_conn*) 0 ) \
+	    { \
+	    if ( (c)->max_limit == -1 && (c)->wouldblock_delay == 0 && \
+		 (c)->numtnums == 0 && \
+		 (c)->next_byte_index < (c)->end_byte_index ) \
+		{ \
+		sink += hc->conn_fd + hc->responselen + \
+		    ( hc->file_address != (char*) 0 ); \
+		hc->bytes_sent += 1; \
+		(c)->next_byte_index += 1; \
+		} \
+	    else \
+		(c)->next_byte_index = 0; \
+	    (c)->active_at = now_sec; \
+	    ++visits; \
+	    } \
+    } while ( 0 )
+
+#define INIT(c, cold, i, align) \
+    do { \
+	(void) memset( (void*) (c), 0, sizeof(*(c)) ); \
+	(void) memset( (void*) (cold), 0, sizeof(*(cold)) ); \
+	(c)->conn_state = CNST_SENDING; \
+	(c)->hc = new_conn( i, align ); \
+	(c)->max_limit = -1; \
+	(cold)->min_limit = -1; \
+	(c)->end_byte_index = 1000000000; \
+	(cold)->next_free_connect = -1; \
+    } while ( 0 )
+
+static void* alloc_table( size_t size, size_t align );
+
+/* Like thttpd.c, one malloc per connection, in slot order. */
+static httpd_conn*
+new_conn( int i, size_t align )
+    {
+    httpd_conn* hc;
+
+    hc = (httpd_conn*) alloc_table( sizeof(httpd_conn), align );
+    (void) memset( (void*) hc, 0, sizeof(*hc) );
+    hc->conn_fd = i;
+    hc->file_fd = -1;
+    hc->file_address = (char*) hc;
+    hc->responselen = 0;
+    return hc;
+    }
+
+static time_t now_sec;
+
+static void
+scan_old( old_connecttab* connects )
+    {
+    int p, i;
+
+    for ( p = 0; p < passes; ++p )
+	for ( i = 0; i < nconns; ++i )
+	    VISIT( &connects[order[i]] );
+    }
+
+static void
+scan_grouped( grouped_connecttab* connects )
+    {
+    int p, i;
+
+    for ( p = 0; p < passes; ++p )
+	for ( i = 0; i < nconns; ++i )
+	    VISIT( &connects[order[i]] );
+    }
+
+static void
+scan_aligned( aligned_connecttab* connects )
+    {
+    int p, i;
+
+    for ( p = 0; p < passes; ++p )
+	for ( i = 0; i < nconns; ++i )
+	    VISIT( &connects[order[i]] );
+    }
+
+static void
+scan_split( split_hot* connects )
+    {
+    int p, i;
+
+    for ( p = 0; p < passes; ++p )
+	for ( i = 0; i < nconns; ++i )
+	    VISIT( &connects[order[i]] );
+    }
+
+
+#ifdef USE_PERF_EVENTS
+static int
+perf_open( unsigned long long config )
+    {
+    struct perf_event_attr pe;
+
+    (void) memset( (void*) &pe, 0, sizeof(pe) );
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = config;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall( __NR_perf_event_open, &pe, 0, -1, -1, 0 );
+    }
+
+#define CACHE_READ_MISS(cache) \
+    ( (cache) | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | \
+      ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) )
+#endif /* USE_PERF_EVENTS */
+
+static int l1_fd = -1, llc_fd = -1;
+
+static void
+counters_start( void )
+    {
+#ifdef USE_PERF_EVENTS
+    if ( l1_fd != -1 )
+	{
+	(void) ioctl( l1_fd, PERF_EVENT_IOC_RESET, 0 );
+	(void) ioctl( l1_fd, PERF_EVENT_IOC_ENABLE, 0 );
+	}
+    if ( llc_fd != -1 )
+	{
+	(void) ioctl( llc_fd, PERF_EVENT_IOC_RESET, 0 );
+	(void) ioctl( llc_fd, PERF_EVENT_IOC_ENABLE, 0 );
+	}
+#endif /* USE_PERF_EVENTS */
+    }
+
+static long long
+counter_stop( int fd )
+    {
+    long long count;
+
+    if ( fd == -1 )
+	return -1;
+#ifdef USE_PERF_EVENTS
+    (void) ioctl( fd, PERF_EVENT_IOC_DISABLE, 0 );
+#endif /* USE_PERF_EVENTS */
+    if ( read( fd, &count, sizeof(count) ) != sizeof(count) )
+	return -1;
+    return count;
+    }
+
+
+/* The average number of distinct cache lines VISIT() touches in a table
+** of entries of the given size, given the offsets of the fields it uses,
+** and in the httpd_conns the entries point to.
+*/
+#define CACHE_LINE 64
+#define HOT_FIELDS(type) { \
+    offsetof(type, conn_state), offsetof(type, numtnums), \
+    offsetof(type, hc), offsetof(type, next_byte_index), \
+    offsetof(type, end_byte_index), offsetof(type, max_limit), \
+    offsetof(type, wouldblock_delay), offsetof(type, active_at) }
+#define N_HOT_FIELDS 8
+#define CONN_FIELDS { \
+    offsetof(httpd_conn, conn_fd), offsetof(httpd_conn, file_address), \
+    offsetof(httpd_conn, responselen), offsetof(httpd_conn, bytes_sent) }
+#define N_CONN_FIELDS 4
+
+static int
+distinct_lines( char* base, size_t* offsets, int n )
+    {
+    int f, g, lines;
+    unsigned long line;
+
+    lines = 0;
+    for ( f = 0; f < n; ++f )
+	{
+	line = (unsigned long) ( base + offsets[f] ) / CACHE_LINE;
+	for ( g = 0; g < f; ++g )
+	    if ( (unsigned long) ( base + offsets[g] ) / CACHE_LINE == line )
+		break;
+	if ( g == f )
+	    ++lines;
+	}
+    return lines;
+    }
+
+static void
+lines_touched( char* table, size_t size, size_t* offsets, size_t hc_offset, double* tableP, double* allP )
+    {
+    int i;
+    long table_total, conn_total;
+    size_t conn_fields[] = CONN_FIELDS;
+
+    table_total = conn_total = 0;
+    for ( i = 0; i < nconns; ++i )
+	{
+	table_total += distinct_lines( table + i * size, offsets, N_HOT_FIELDS );
+	conn_total += distinct_lines(
+	    *(char**) ( table + i * size + hc_offset ), conn_fields,
+	    N_CONN_FIELDS );
+	}
+    *tableP = (double) table_total / nconns;
+    *allP = (double) ( table_total + conn_total ) / nconns;
+    }
+
+
+static double
+now( void )
+    {
+    struct timeval tv;
+
+    (void) gettimeofday( &tv, (struct timezone*) 0 );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+    }
+
+
+static void
+report( char* name, size_t size, double table_lines, double all_lines, double start )
+    {
+    double elapsed;
+    long long l1, llc;
+
+    elapsed = now() - start;
+    l1 = counter_stop( l1_fd );
+    llc = counter_stop( llc_fd );
+    (void) printf(
+	"%-9s %3lu bytes  %4.2f table + %4.2f conn lines/visit  %6.2f ns/visit",
+	name, (unsigned long) size, table_lines, all_lines - table_lines,
+	elapsed * 1e9 / visits );
+    if ( l1 >= 0 )
+	(void) printf( "  L1D misses %5.2f/visit", (double) l1 / visits );
+    if ( llc >= 0 )
+	(void) printf( "  LLC misses %5.2f/visit", (double) llc / visits );
+    (void) printf( "\n" );
+    }
+
+
+/* Allocates the way thttpd.c does: extra room, rounded up to the boundary. */
+static void*
+alloc_table( size_t size, size_t align )
+    {
+    char* mem;
+
+    mem = malloc( size + align - 1 );
+    if ( mem == (char*) 0 )
+	{
+	perror( "malloc" );
+	exit( 1 );
+	}
+    return mem + ( align - (unsigned long) mem % align ) % align;
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    int i, j, t;
+    old_connecttab* old;
+    grouped_connecttab* grouped;
+    aligned_connecttab* aligned;
+    split_hot* hot;
+    split_cold* cold;
+    double start, table_lines, all_lines;
+    size_t old_hot[] = HOT_FIELDS(old_connecttab);
+    size_t grouped_hot[] = HOT_FIELDS(grouped_connecttab);
+    size_t aligned_hot[] = HOT_FIELDS(aligned_connecttab);
+    size_t split_hot_fields[] = HOT_FIELDS(split_hot);
+
+    nconns = 50000;
+    passes = 100;
+    if ( argc > 1 )
+	nconns = atoi( argv[1] );
+    if ( argc > 2 )
+	passes = atoi( argv[2] );
+    if ( nconns <= 0 || passes <= 0 )
+	{
+	(void) fprintf( stderr, "usage: %s [connections [passes]]\n", argv[0] );
+	exit( 1 );
+	}
+    now_sec = time( (time_t*) 0 );
+
+    /* malloc only promises 16-byte alignment, which is what the old
+    ** table got; the aligned and split tables get the cache-line boundary.
+    */
+    old = (old_connecttab*) alloc_table( nconns * sizeof(*old), 16 );
+    grouped = (grouped_connecttab*) alloc_table( nconns * sizeof(*grouped), 16 );
+    aligned = (aligned_connecttab*) alloc_table( nconns * sizeof(*aligned), CONNECT_ALIGN );
+    hot = (split_hot*) alloc_table( nconns * sizeof(*hot), CONNECT_ALIGN );
+    cold = (split_cold*) alloc_table( nconns * sizeof(*cold), 16 );
+    for ( i = 0; i < nconns; ++i )
+	INIT( &old[i], &old[i], i, 16 );
+    for ( i = 0; i < nconns; ++i )
+	INIT( &grouped[i], &grouped[i], i, 16 );
+    for ( i = 0; i < nconns; ++i )
+	INIT( &aligned[i], &aligned[i], i, 16 );
+    for ( i = 0; i < nconns; ++i )
+	{
+	INIT( &hot[i], &cold[i], i, CONNECT_ALIGN );
+	hot[i].cold = &cold[i];
+	}
+
+    /* A fixed shuffle, so every layout sees the same order. */
+    order = (int*) malloc( nconns * sizeof(*order) );
+    if ( order == (int*) 0 )
+	{
+	perror( "malloc" );
+	exit( 1 );
+	}
+    for ( i = 0; i < nconns; ++i )
+	order[i] = i;
+    srandom( 1 );
+    for ( i = nconns - 1; i > 0; --i )
+	{
+	j = random() % ( i + 1 );
+	t = order[i];
+	order[i] = order[j];
+	order[j] = t;
+	}
+
+#ifdef USE_PERF_EVENTS
+    l1_fd = perf_open( CACHE_READ_MISS( PERF_COUNT_HW_CACHE_L1D ) );
+    llc_fd = perf_open( CACHE_READ_MISS( PERF_COUNT_HW_CACHE_LL ) );
+#endif /* USE_PERF_EVENTS */
+    if ( l1_fd == -1 || llc_fd == -1 )
+	(void) fprintf(
+	    stderr, "cache miss counters not available, timing only\n" );
+
+    (void) printf(
+	"%d connections, %d passes in random order, %d-byte httpd_conns\n",
+	nconns, passes, HTTPD_CONN_SIZE );
+
+    lines_touched(
+	(char*) old, sizeof(*old), old_hot, offsetof(old_connecttab, hc),
+	&table_lines, &all_lines );
+    visits = 0;
+    counters_start();
+    start = now();
+    scan_old( old );
+    report( "old", sizeof(*old), table_lines, all_lines, start );
+
+    lines_touched(
+	(char*) grouped, sizeof(*grouped), grouped_hot,
+	offsetof(grouped_connecttab, hc), &table_lines, &all_lines );
+    visits = 0;
+    counters_start();
+    start = now();
+    scan_grouped( grouped );
+    report( "grouped", sizeof(*grouped), table_lines, all_lines, start );
+
+    lines_touched(
+	(char*) aligned, sizeof(*aligned), aligned_hot,
+	offsetof(aligned_connecttab, hc), &table_lines, &all_lines );
+    visits = 0;
+    counters_start();
+    start = now();
+    scan_aligned( aligned );
+    report( "aligned", sizeof(*aligned), table_lines, all_lines, start );
+
+    lines_touched(
+	(char*) hot, sizeof(*hot), split_hot_fields, offsetof(split_hot, hc),
+	&table_lines, &all_lines );
+    visits = 0;
+    counters_start();
+    start = now();
+    scan_split( hot );
+    report( "split", sizeof(*hot), table_lines, all_lines, start );
+
+    if ( sink == 0 )
+	(void) printf( "\n" );	/* keeps the httpd_conn reads honest */
+    exit( 0 );
+    }
@@ -0,0 +1,219 @@
+/* eolscan.c - benchmark for the CR/LF scan in libhttpd.c
+**
+** Splits a few typical requests into lines over and over, three ways:
+** with the byte-at-a-time loop bufgets() used to have, with the byte
+** loop scan_eol() falls back to, and with scan_eol()'s SSE2 loop.  The
+** two scan_eol() versions are copied from libhttpd.c; keep them in step.
+**
+** Build and run:
+**     cc -O2 -o eolscan eolscan.c && ./eolscan [iterations]
+*/
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define USE_SSE2_SCAN
+#endif
+
+
+static char* requests[] = {
+    /* A short one, like a script or a health check would send. */
+    "GET /index.html HTTP/1.1\015\012"
+    "Host: www.example.com\015\012"
+    "User-Agent: curl/7.88.1\015\012"
+    "Accept: */*\015\012"
+    "\015\012",
+    /* What a browser sends. */
+    "GET /images/logo.png HTTP/1.1\015\012"
+    "Host: www.example.com\015\012"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\015\012"
+    "Accept: image/avif,image/webp,*/*\015\012"
+    "Accept-Language: en-US,en;q=0.5\015\012"
+    "Accept-Encoding: gzip, deflate, br\015\012"
+    "Referer: https://www.example.com/products/widgets/index.html\015\012"
+    "Connection: keep-alive\015\012"
+    "If-Modified-Since: Tue, 14 Mar 2023 18:02:11 GMT\015\012"
+    "If-None-Match: \"5f2a1c-3e8-5f6d3a2b\"\015\012"
+    "Sec-Fetch-Dest: image\015\012"
+    "Sec-Fetch-Mode: no-cors\015\012"
+    "Sec-Fetch-Site: same-origin\015\012"
+    "\015\012",
+    /* A browser with a pile of cookies; filled in by main(). */
+    (char*) 0,
+    };
+#define N_REQUESTS ( sizeof(requests) / sizeof(*requests) )
+
+
+/* The loop bufgets() had before scan_eol(). */
+static size_t
+old_eol( char* buf, size_t start, size_t end )
+    {
+    size_t i;
+    char c;
+
+    for ( i = start; i < end; ++i )
+	{
+	c = buf[i];
+	if ( c == '\012' || c == '\015' )
+	    break;
+	}
+    return i;
+    }
+
+
+/* scan_eol() without SSE2. */
+static size_t
+byte_eol( char* buf, size_t start, size_t end )
+    {
+    size_t i;
+
+    for ( i = start; i < end; ++i )
+	if ( buf[i] == '\012' || buf[i] == '\015' )
+	    break;
+    return i;
+    }
+
+
+#ifdef USE_SSE2_SCAN
+/* scan_eol() with SSE2. */
+static size_t
+sse2_eol( char* buf, size_t start, size_t end )
+    {
+    size_t i;
+    __m128i cr, lf, v;
+    int mask;
+
+    cr = _mm_set1_epi8( '\015' );
+    lf = _mm_set1_epi8( '\012' );
+    for ( i = start; i + 16 <= end; i += 16 )
+	{
+	v = _mm_loadu_si128( (__m128i*) &buf[i] );
+	mask = _mm_movemask_epi8( _mm_or_si128(
+	    _mm_cmpeq_epi8( v, cr ), _mm_cmpeq_epi8( v, lf ) ) );
+	if ( mask != 0 )
+	    return i + __builtin_ctz( mask );
+	}
+    for ( ; i < end; ++i )
+	if ( buf[i] == '\012' || buf[i] == '\015' )
+	    break;
+    return i;
+    }
+#endif /* USE_SSE2_SCAN */
+
+
+/* Splits buf into lines the way bufgets() does, without writing the
+** NULs, and returns the number of lines so the work can't be skipped.
+*/
+static size_t
+split( size_t (*eol)( char*, size_t, size_t ), char* buf, size_t len )
+    {
+    size_t i, lines;
+
+    lines = 0;
+    for ( i = 0; i < len; ++i )
+	{
+	i = eol( buf, i, len );
+	if ( i == len )
+	    break;
+	if ( buf[i] == '\015' && i + 1 < len && buf[i + 1] == '\012' )
+	    ++i;
+	++lines;
+	}
+    return lines;
+    }
+
+
+static double
+now( void )
+    {
+    struct timeval tv;
+
+    (void) gettimeofday( &tv, (struct timezone*) 0 );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+    }
+
+
+static void
+run( char* name, size_t (*eol)( char*, size_t, size_t ), char* buf, size_t len, long iters )
+    {
+    long n;
+    size_t lines;
+    double start, elapsed;
+
+    lines = 0;
+    start = now();
+    for ( n = 0; n < iters; ++n )
+	lines += split( eol, buf, len );
+    elapsed = now() - start;
+    (void) printf(
+	"    %-10s %8.1f ns/request %8.0f MB/s   (%lu lines)\n", name,
+	elapsed * 1e9 / iters, len * (double) iters / elapsed / 1e6,
+	(unsigned long) ( lines / iters ) );
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    long iters;
+    int i;
+    char* cookies;
+    char* buf;
+    size_t len;
+
+    iters = 1000000;
+    if ( argc > 1 )
+	iters = atol( argv[1] );
+    if ( iters <= 0 )
+	{
+	(void) fprintf( stderr, "usage: %s [iterations]\n", argv[0] );
+	exit( 1 );
+	}
+
+    /* Cookie headers are where requests get long. */
+    cookies = malloc( 4096 );
+    if ( cookies == (char*) 0 )
+	{
+	perror( "malloc" );
+	exit( 1 );
+	}
+    (void) strcpy( cookies, requests[1] );
+    cookies[strlen( cookies ) - 2] = '\0';
+    (void) strcat( cookies, "Cookie: " );
+    for ( i = 0; i < 24; ++i )
+	(void) sprintf(
+	    &cookies[strlen( cookies )], "%ssession_%02d=%032x",
+	    i == 0 ? "" : "; ", i, i * 2654435761U );
+    (void) strcat( cookies, "\015\012\015\012" );
+    requests[2] = cookies;
+
+    for ( i = 0; i < N_REQUESTS; ++i )
+	{
+	len = strlen( requests[i] );
+	/* Scan a copy that ends right at the request, like read_buf does. */
+	buf = malloc( len );
+	if ( buf == (char*) 0 )
+	    {
+	    perror( "malloc" );
+	    exit( 1 );
+	    }
+	(void) memcpy( buf, requests[i], len );
+	(void) printf( "request %d, %lu bytes:\n", i + 1, (unsigned long) len );
+	run( "old", old_eol, buf, len, iters );
+	run( "byte", byte_eol, buf, len, iters );
+#ifdef USE_SSE2_SCAN
+	run( "sse2", sse2_eol, buf, len, iters );
+#else /* USE_SSE2_SCAN */
+	(void) printf( "    sse2       not available in this build\n" );
+#endif /* USE_SSE2_SCAN */
+	free( (void*) buf );
+	}
+
+    exit( 0 );
+    }
@@ -0,0 +1,329 @@
+/* loadgen.c - keep-alive HTTP load generator
+**
+** Keeps a number of connections to a server busy with GETs of one URL
+** path for some seconds, and reports the requests per second it got
+** through.  Each connection sends its next request as soon as the
+** previous response is in, so the server, not the client, sets the
+** pace as long as the client has a CPU to itself.  Responses need a
+** Content-Length; a connection the server closes gets reopened.
+** scaling.sh uses this to measure thttpd against its thread count.
+**
+** Build and run:
+**     cc -O2 -o loadgen loadgen.c
+**     ./loadgen [-c connections] [-t seconds] [-p procs] host port path
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+
+typedef struct {
+    int fd;
+    char buf[16384];
+    size_t len;		/* bytes in buf */
+    long need;		/* bytes still to come for this response, or -1 */
+    } Conn;
+
+static struct sockaddr_in sa;
+static char request[1024];
+static size_t request_len;
+static long requests, errors;
+
+
+static double
+now( void )
+    {
+    struct timeval tv;
+
+    (void) gettimeofday( &tv, (struct timezone*) 0 );
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+    }
+
+
+/* Opens a connection and sends the first request.  Returns -1 on errors. */
+static int
+start( Conn* c )
+    {
+    int on = 1;
+
+    c->fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if ( c->fd < 0 )
+	return -1;
+    (void) setsockopt(
+	c->fd, IPPROTO_TCP, TCP_NODELAY, (void*) &on, sizeof(on) );
+    if ( connect( c->fd, (struct sockaddr*) &sa, sizeof(sa) ) < 0 ||
+	 write( c->fd, request, request_len ) != request_len )
+	{
+	(void) close( c->fd );
+	c->fd = -1;
+	return -1;
+	}
+    c->len = 0;
+    c->need = -1;
+    return 0;
+    }
+
+
+/* Finds the end of the headers and the Content-Length.  Returns the
+** total size of the response, 0 if the headers aren't all in yet, or -1
+** if there's no Content-Length.
+*/
+static long
+response_size( Conn* c )
+    {
+    char* eoh;
+    char* cl;
+    size_t hlen;
+
+    c->buf[c->len] = '\0';
+    eoh = strstr( c->buf, "\015\012\015\012" );
+    if ( eoh == (char*) 0 )
+	return 0;
+    hlen = eoh + 4 - c->buf;
+    for ( cl = c->buf; ( cl = strchr( cl, '\012' ) ) != (char*) 0 && cl < eoh; )
+	{
+	++cl;
+	if ( strncasecmp( cl, "Content-Length:", 15 ) == 0 )
+	    return hlen + atol( &cl[15] );
+	}
+    return -1;
+    }
+
+
+/* Reads what's there on a connection, and sends the next request
+** whenever a response is complete.
+*/
+static void
+handle( Conn* c )
+    {
+    ssize_t r;
+    long size;
+
+    r = read( c->fd, &c->buf[c->len], sizeof(c->buf) - 1 - c->len );
+    if ( r <= 0 )
+	{
+	if ( r < 0 && errno == EINTR )
+	    return;
+	/* Closed on us; count it only if a response was cut off. */
+	if ( c->len > 0 || c->need > 0 )
+	    ++errors;
+	(void) close( c->fd );
+	if ( start( c ) < 0 )
+	    ++errors;
+	return;
+	}
+    if ( c->need > 0 )
+	{
+	/* In the middle of a body, which we don't keep. */
+	c->need -= r;
+	if ( c->need > 0 )
+	    return;
+	}
+    else
+	{
+	c->len += r;
+	size = response_size( c );
+	if ( size == 0 )
+	    {
+	    if ( c->len >= sizeof(c->buf) - 1 )
+		{
+		++errors;	/* headers too big */
+		c->len = 0;
+		}
+	    return;
+	    }
+	if ( size < 0 )
+	    {
+	    ++errors;
+	    (void) close( c->fd );
+	    (void) start( c );
+	    return;
+	    }
+	if ( size > (long) c->len )
+	    {
+	    c->need = size - c->len;
+	    c->len = 0;
+	    return;
+	    }
+	/* Pipelining isn't used, so nothing should follow the response. */
+	}
+    ++requests;
+    c->len = 0;
+    c->need = -1;
+    if ( write( c->fd, request, request_len ) != request_len )
+	{
+	++errors;
+	(void) close( c->fd );
+	(void) start( c );
+	}
+    }
+
+
+/* One load process: runs its connections for the given time and writes
+** its request and error counts to the pipe.
+*/
+static void
+run( int nconns, double seconds, int out )
+    {
+    Conn* conns;
+    struct pollfd* pfds;
+    int i, n;
+    double end;
+    long counts[2];
+
+    conns = (Conn*) malloc( nconns * sizeof(Conn) );
+    pfds = (struct pollfd*) malloc( nconns * sizeof(struct pollfd) );
+    if ( conns == (Conn*) 0 || pfds == (struct pollfd*) 0 )
+	{
+	perror( "malloc" );
+	exit( 1 );
+	}
+    for ( i = 0; i < nconns; ++i )
+	if ( start( &conns[i] ) < 0 )
+	    {
+	    perror( "connect" );
+	    exit( 1 );
+	    }
+
+    end = now() + seconds;
+    while ( now() < end )
+	{
+	for ( i = 0; i < nconns; ++i )
+	    {
+	    pfds[i].fd = conns[i].fd;
+	    pfds[i].events = POLLIN;
+	    }
+	n = poll( pfds, nconns, 100 );
+	if ( n < 0 )
+	    {
+	    if ( errno == EINTR )
+		continue;
+	    perror( "poll" );
+	    exit( 1 );
+	    }
+	for ( i = 0; i < nconns; ++i )
+	    {
+	    if ( conns[i].fd == -1 )
+		{
+		if ( start( &conns[i] ) < 0 )
+		    ++errors;
+		}
+	    else if ( pfds[i].revents != 0 )
+		handle( &conns[i] );
+	    }
+	}
+
+    counts[0] = requests;
+    counts[1] = errors;
+    if ( write( out, counts, sizeof(counts) ) != sizeof(counts) )
+	exit( 1 );
+    exit( 0 );
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    int argn, nconns, nprocs, p, per;
+    double seconds, t0, elapsed;
+    int pipefds[2];
+    long counts[2];
+    long total, total_errors;
+
+    nconns = 64;
+    seconds = 10.0;
+    nprocs = 1;
+    for ( argn = 1; argn < argc && argv[argn][0] == '-'; ++argn )
+	{
+	if ( strcmp( argv[argn], "-c" ) == 0 && argn + 1 < argc )
+	    nconns = atoi( argv[++argn] );
+	else if ( strcmp( argv[argn], "-t" ) == 0 && argn + 1 < argc )
+	    seconds = atof( argv[++argn] );
+	else if ( strcmp( argv[argn], "-p" ) == 0 && argn + 1 < argc )
+	    nprocs = atoi( argv[++argn] );
+	else
+	    break;
+	}
+    if ( argn + 3 != argc || nconns <= 0 || seconds <= 0.0 || nprocs <= 0 ||
+	 nconns < nprocs )
+	{
+	(void) fprintf(
+	    stderr,
+	    "usage: %s [-c connections] [-t seconds] [-p procs] host port path\n",
+	    argv[0] );
+	exit( 1 );
+	}
+
+    (void) memset( (void*) &sa, 0, sizeof(sa) );
+    sa.sin_family = AF_INET;
+    if ( inet_pton( AF_INET, argv[argn], &sa.sin_addr ) != 1 )
+	{
+	(void) fprintf( stderr, "%s: bad address %s\n", argv[0], argv[argn] );
+	exit( 1 );
+	}
+    sa.sin_port = htons( atoi( argv[argn + 1] ) );
+    request_len = snprintf(
+	request, sizeof(request),
+	"GET %s HTTP/1.1\015\012Host: %s\015\012\015\012",
+	argv[argn + 2], argv[argn] );
+    if ( request_len >= sizeof(request) )
+	{
+	(void) fprintf( stderr, "%s: path too long\n", argv[0] );
+	exit( 1 );
+	}
+
+    /* One process per client CPU, splitting the connections between them. */
+    if ( pipe( pipefds ) < 0 )
+	{
+	perror( "pipe" );
+	exit( 1 );
+	}
+    t0 = now();
+    for ( p = 0; p < nprocs; ++p )
+	{
+	per = nconns / nprocs + ( p < nconns % nprocs ? 1 : 0 );
+	switch ( fork() )
+	    {
+	    case -1:
+	    perror( "fork" );
+	    exit( 1 );
+	    case 0:
+	    (void) close( pipefds[0] );
+	    run( per, seconds, pipefds[1] );
+	    }
+	}
+    (void) close( pipefds[1] );
+    total = total_errors = 0;
+    for ( p = 0; p < nprocs; ++p )
+	{
+	if ( read( pipefds[0], counts, sizeof(counts) ) != sizeof(counts) )
+	    {
+	    (void) fprintf( stderr, "%s: a load process died\n", argv[0] );
+	    exit( 1 );
+	    }
+	total += counts[0];
+	total_errors += counts[1];
+	}
+    while ( wait( (int*) 0 ) > 0 )
+	continue;
+    elapsed = now() - t0;
+
+    (void) printf(
+	"%ld requests in %.2f s, %.0f requests/s, %ld errors\n",
+	total, elapsed, total / elapsed, total_errors );
+    exit( 0 );
+    }
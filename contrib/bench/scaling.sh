@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# scaling.sh - measure thttpd throughput against its -threads count
+#
+# Usage:
+#   scaling.sh thttpd-binary [threads ...]
+#
+# Starts the given thttpd on a scratch document root once per thread
+# count (1 2 4 8 16 by default), loads it with loadgen for a while with
+# keep-alive GETs of a small file, and prints requests per second for
+# each count.  loadgen gets built next to this script if it isn't there.
+#
+# The load generator needs CPUs of its own or it will be what gets
+# measured.  On a machine with enough cores, pin the two apart with the
+# SERVER_CPUS and CLIENT_CPUS variables, which are passed to taskset -c,
+# for example:
+#   SERVER_CPUS=0-15 CLIENT_CPUS=16-31 LOAD_PROCS=16 ./scaling.sh ../../thttpd
+#
+# Other variables: PORT (8099), SECONDS_PER_RUN (10), CONNECTIONS (256),
+# LOAD_PROCS (4), FILE_SIZE in bytes (1024).
+
+if [ $# -lt 1 ] ; then
+	echo "usage: $0 thttpd-binary [threads ...]" >&2
+	exit 1
+fi
+thttpd="$1"
+shift
+counts="${*:-1 2 4 8 16}"
+
+port="${PORT:-8099}"
+seconds="${SECONDS_PER_RUN:-10}"
+connections="${CONNECTIONS:-256}"
+procs="${LOAD_PROCS:-4}"
+size="${FILE_SIZE:-1024}"
+bench=`dirname "$0"`
+
+if [ ! -x "$bench/loadgen" ] ; then
+	${CC:-cc} -O2 -o "$bench/loadgen" "$bench/loadgen.c" || exit 1
+fi
+
+server_pin=""
+client_pin=""
+if [ -n "$SERVER_CPUS" ] ; then
+	server_pin="taskset -c $SERVER_CPUS"
+fi
+if [ -n "$CLIENT_CPUS" ] ; then
+	client_pin="taskset -c $CLIENT_CPUS"
+fi
+
+root=`mktemp -d /tmp/scalingXXXXXX` || exit 1
+trap 'rm -rf "$root"' 0
+chmod 755 "$root"
+head -c "$size" /dev/zero | tr '\0' x > "$root/file.txt"
+
+echo "$size byte file, $connections connections from $procs processes, $seconds s per run"
+for threads in $counts ; do
+	$server_pin "$thttpd" -D -p "$port" -d "$root" -l /dev/null -threads "$threads" &
+	pid=$!
+	sleep 1
+	printf "%3d threads: " "$threads"
+	$client_pin "$bench/loadgen" -c "$connections" -t "$seconds" -p "$procs" \
+		127.0.0.1 "$port" /file.txt
+	kill "$pid"
+	wait "$pid" 2>/dev/null
+done
+exit 0
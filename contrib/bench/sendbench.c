@@ -0,0 +1,337 @@
+/* sendbench.c - benchmark for sending big files, sendfile() against mmap()
+**
+** Sends one big file (512MB by default, made up in /tmp if you don't name
+** one) over a loopback TCP connection to a child process that throws it
+** away, the two ways thttpd can:
+**
+**     window    what handle_send() does without -sendfile for files over
+**               LARGE_FILE_SIZE: map FILE_WINDOW_SIZE bytes at a time
+**               with MADV_SEQUENTIAL and write() from the mapping
+**     sendfile  what send_file() does with -sendfile
+**
+** Each method gets the given number of rounds and the best one is
+** reported, with the sender's CPU time.  With -cold the file is dropped
+** from the page cache before each round, with POSIX_FADV_DONTNEED, so
+** the disk gets measured too.  The window size is copied from config.h;
+** keep it in step.
+**
+** Build and run:
+**     cc -O2 -o sendbench sendbench.c && ./sendbench [-cold] [-mb size] [-rounds n] [file]
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define FILE_WINDOW_SIZE 4194304
+
+
+static int send_window( int s, int fd, off_t size );
+static int send_sendfile( int s, int fd, off_t size );
+static void warm( int fd );
+static double secs( struct timeval* tvP );
+
+static struct {
+    char* name;
+    int (*send)( int s, int fd, off_t size );
+    } methods[] = {
+    { "window", send_window },
+    { "sendfile", send_sendfile },
+    };
+#define N_METHODS ( sizeof(methods) / sizeof(*methods) )
+
+
+static int
+send_window( int s, int fd, off_t size )
+    {
+    off_t start;
+    size_t len, off;
+    char* addr;
+    ssize_t w;
+
+    for ( start = 0; start < size; start += len )
+	{
+	len = size - start < FILE_WINDOW_SIZE ?
+	    (size_t) ( size - start ) : FILE_WINDOW_SIZE;
+	addr = (char*) mmap( 0, len, PROT_READ, MAP_PRIVATE, fd, start );
+	if ( addr == (char*) -1 )
+	    {
+	    perror( "mmap" );
+	    return -1;
+	    }
+#ifdef MADV_SEQUENTIAL
+	(void) madvise( addr, len, MADV_SEQUENTIAL );
+#endif /* MADV_SEQUENTIAL */
+	for ( off = 0; off < len; off += w )
+	    {
+	    w = write( s, &addr[off], len - off );
+	    if ( w < 0 )
+		{
+		if ( errno == EINTR )
+		    {
+		    w = 0;
+		    continue;
+		    }
+		perror( "write" );
+		(void) munmap( addr, len );
+		return -1;
+		}
+	    }
+	(void) munmap( addr, len );
+	}
+    return 0;
+    }
+
+
+static int
+send_sendfile( int s, int fd, off_t size )
+    {
+    off_t offset;
+    ssize_t w;
+
+    offset = 0;
+    while ( offset < size )
+	{
+	w = sendfile( s, fd, &offset, size - offset );
+	if ( w < 0 )
+	    {
+	    if ( errno == EINTR )
+		continue;
+	    perror( "sendfile" );
+	    return -1;
+	    }
+	if ( w == 0 )
+	    break;
+	}
+    return 0;
+    }
+
+
+/* The child: accepts connections and reads them dry, until killed. */
+static void
+sink( int ls )
+    {
+    int s;
+    static char buf[262144];
+
+    for (;;)
+	{
+	s = accept( ls, (struct sockaddr*) 0, (socklen_t*) 0 );
+	if ( s < 0 )
+	    {
+	    if ( errno == EINTR )
+		continue;
+	    perror( "accept" );
+	    exit( 1 );
+	    }
+	while ( read( s, buf, sizeof(buf) ) > 0 )
+	    continue;
+	(void) close( s );
+	}
+    }
+
+
+/* Reads the file through, so it's all in the page cache. */
+static void
+warm( int fd )
+    {
+    static char buf[262144];
+    off_t offset;
+    ssize_t r;
+
+    for ( offset = 0;
+	  ( r = pread( fd, buf, sizeof(buf), offset ) ) > 0;
+	  offset += r )
+	continue;
+    }
+
+
+static double
+secs( struct timeval* tvP )
+    {
+    return tvP->tv_sec + tvP->tv_usec / 1000000.0;
+    }
+
+
+static char*
+make_file( long mb )
+    {
+    static char name[] = "/tmp/sendbenchXXXXXX";
+    int fd;
+    long i;
+    char* buf;
+
+    fd = mkstemp( name );
+    if ( fd < 0 )
+	{
+	perror( "mkstemp" );
+	exit( 1 );
+	}
+    buf = (char*) malloc( 1048576 );
+    if ( buf == (char*) 0 )
+	{
+	perror( "malloc" );
+	exit( 1 );
+	}
+    for ( i = 0; i < 1048576; ++i )
+	buf[i] = (char) ( i * 7 );
+    for ( i = 0; i < mb; ++i )
+	if ( write( fd, buf, 1048576 ) != 1048576 )
+	    {
+	    perror( "write" );
+	    (void) unlink( name );
+	    exit( 1 );
+	    }
+    free( (void*) buf );
+    (void) close( fd );
+    return name;
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    int argn, cold, rounds, made, ls, s, fd, m, r;
+    long mb;
+    char* filename;
+    struct sockaddr_in sa;
+    socklen_t salen;
+    struct stat sb;
+    pid_t pid;
+    struct timeval t0, t1;
+    struct rusage ru0, ru1;
+    double elapsed, cpu, best, best_cpu;
+
+    cold = 0;
+    rounds = 3;
+    mb = 512;
+    filename = (char*) 0;
+    for ( argn = 1; argn < argc; ++argn )
+	{
+	if ( strcmp( argv[argn], "-cold" ) == 0 )
+	    cold = 1;
+	else if ( strcmp( argv[argn], "-mb" ) == 0 && argn + 1 < argc )
+	    mb = atol( argv[++argn] );
+	else if ( strcmp( argv[argn], "-rounds" ) == 0 && argn + 1 < argc )
+	    rounds = atoi( argv[++argn] );
+	else if ( argv[argn][0] != '-' && filename == (char*) 0 )
+	    filename = argv[argn];
+	else
+	    break;
+	}
+    if ( argn < argc || mb <= 0 || rounds <= 0 )
+	{
+	(void) fprintf(
+	    stderr, "usage: %s [-cold] [-mb size] [-rounds n] [file]\n",
+	    argv[0] );
+	exit( 1 );
+	}
+    made = 0;
+    if ( filename == (char*) 0 )
+	{
+	filename = make_file( mb );
+	made = 1;
+	}
+    fd = open( filename, O_RDONLY );
+    if ( fd < 0 || fstat( fd, &sb ) < 0 )
+	{
+	perror( filename );
+	exit( 1 );
+	}
+
+    /* The receiving end. */
+    ls = socket( AF_INET, SOCK_STREAM, 0 );
+    if ( ls < 0 )
+	{
+	perror( "socket" );
+	exit( 1 );
+	}
+    (void) memset( (void*) &sa, 0, sizeof(sa) );
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    sa.sin_port = 0;
+    salen = sizeof(sa);
+    if ( bind( ls, (struct sockaddr*) &sa, sizeof(sa) ) < 0 ||
+	 listen( ls, 8 ) < 0 ||
+	 getsockname( ls, (struct sockaddr*) &sa, &salen ) < 0 )
+	{
+	perror( "bind" );
+	exit( 1 );
+	}
+    pid = fork();
+    if ( pid < 0 )
+	{
+	perror( "fork" );
+	exit( 1 );
+	}
+    if ( pid == 0 )
+	sink( ls );
+    (void) close( ls );
+
+    (void) printf(
+	"%lld MB file, %s page cache, best of %d rounds\n",
+	(long long) ( sb.st_size / 1048576 ), cold ? "cold" : "warm", rounds );
+    for ( m = 0; m < N_METHODS; ++m )
+	{
+	best = best_cpu = 0.0;
+	for ( r = 0; r < rounds; ++r )
+	    {
+	    if ( cold )
+		(void) posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+	    else
+		warm( fd );
+	    s = socket( AF_INET, SOCK_STREAM, 0 );
+	    if ( s < 0 ||
+		 connect( s, (struct sockaddr*) &sa, sizeof(sa) ) < 0 )
+		{
+		perror( "connect" );
+		(void) kill( pid, SIGTERM );
+		exit( 1 );
+		}
+	    (void) getrusage( RUSAGE_SELF, &ru0 );
+	    (void) gettimeofday( &t0, (struct timezone*) 0 );
+	    if ( methods[m].send( s, fd, sb.st_size ) < 0 )
+		{
+		(void) kill( pid, SIGTERM );
+		exit( 1 );
+		}
+	    (void) close( s );
+	    (void) gettimeofday( &t1, (struct timezone*) 0 );
+	    (void) getrusage( RUSAGE_SELF, &ru1 );
+	    elapsed = secs( &t1 ) - secs( &t0 );
+	    cpu = secs( &ru1.ru_utime ) - secs( &ru0.ru_utime ) +
+		secs( &ru1.ru_stime ) - secs( &ru0.ru_stime );
+	    if ( r == 0 || elapsed < best )
+		{
+		best = elapsed;
+		best_cpu = cpu;
+		}
+	    }
+	(void) printf(
+	    "%-9s %7.3f s  %7.0f MB/s  sender CPU %6.3f s\n", methods[m].name,
+	    best, sb.st_size / 1048576.0 / best, best_cpu );
+	}
+
+    (void) kill( pid, SIGTERM );
+    (void) waitpid( pid, (int*) 0, 0 );
+    (void) close( fd );
+    if ( made )
+	(void) unlink( filename );
+    exit( 0 );
+    }
@@ -0,0 +1,856 @@
+/* timerchurn.c - benchmark for the timer package in timers.c
+**
+** Runs the same stream of timer operations (a million by default)
+** through the hashed sorted lists timers.c used to have and through the
+** timing wheel it has now.  The stream is what a busy server does: a
+** steady population of connection timers that keep getting reset,
+** cancelled and replaced, plus a few periodic ones, with the clock
+** moving ahead a millisecond at a time and tmr_mstimeout() and tmr_run()
+** called after every tick the way the main loop does.  Every create,
+** reset, cancel and run counts as one operation.  Both packages are
+** copied from timers.c, trimmed of their statistics and cleanup
+** functions and with their names prefixed; keep them in step.
+**
+** Build and run:
+**     cc -O2 -o timerchurn timerchurn.c && ./timerchurn [operations [timers]]
+*/
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef INFTIM
+#define INFTIM -1
+#endif /* INFTIM */
+
+
+typedef union {
+    void* p;
+    int i;
+    long l;
+    } ClientData;
+
+typedef void TimerProc( ClientData client_data, struct timeval* nowP );
+
+
+/* The hashed sorted lists from before the wheel. */
+
+typedef struct HTimerStruct {
+    TimerProc* timer_proc;
+    ClientData client_data;
+    long msecs;
+    int periodic;
+    struct timeval time;
+    struct HTimerStruct* prev;
+    struct HTimerStruct* next;
+    int hash;
+    } HTimer;
+
+#define HASH_SIZE 67
+static HTimer* h_timers[HASH_SIZE];
+static HTimer* h_free_timers;
+
+
+static unsigned int
+h_hash( HTimer* t )
+    {
+    return (
+	(unsigned int) t->time.tv_sec ^
+	(unsigned int) t->time.tv_usec ) % HASH_SIZE;
+    }
+
+
+static void
+h_l_add( HTimer* t )
+    {
+    int h = t->hash;
+    HTimer* t2;
+    HTimer* t2prev;
+
+    t2 = h_timers[h];
+    if ( t2 == (HTimer*) 0 )
+	{
+	h_timers[h] = t;
+	t->prev = t->next = (HTimer*) 0;
+	}
+    else
+	{
+	if ( t->time.tv_sec < t2->time.tv_sec ||
+	     ( t->time.tv_sec == t2->time.tv_sec &&
+	       t->time.tv_usec <= t2->time.tv_usec ) )
+	    {
+	    h_timers[h] = t;
+	    t->prev = (HTimer*) 0;
+	    t->next = t2;
+	    t2->prev = t;
+	    }
+	else
+	    {
+	    for ( t2prev = t2, t2 = t2->next; t2 != (HTimer*) 0;
+		  t2prev = t2, t2 = t2->next )
+		{
+		if ( t->time.tv_sec < t2->time.tv_sec ||
+		     ( t->time.tv_sec == t2->time.tv_sec &&
+		       t->time.tv_usec <= t2->time.tv_usec ) )
+		    {
+		    t2prev->next = t;
+		    t->prev = t2prev;
+		    t->next = t2;
+		    t2->prev = t;
+		    return;
+		    }
+		}
+	    t2prev->next = t;
+	    t->prev = t2prev;
+	    t->next = (HTimer*) 0;
+	    }
+	}
+    }
+
+
+static void
+h_l_remove( HTimer* t )
+    {
+    int h = t->hash;
+
+    if ( t->prev == (HTimer*) 0 )
+	h_timers[h] = t->next;
+    else
+	t->prev->next = t->next;
+    if ( t->next != (HTimer*) 0 )
+	t->next->prev = t->prev;
+    }
+
+
+static void
+h_l_resort( HTimer* t )
+    {
+    h_l_remove( t );
+    t->hash = h_hash( t );
+    h_l_add( t );
+    }
+
+
+static void
+h_init( void )
+    {
+    int h;
+
+    for ( h = 0; h < HASH_SIZE; ++h )
+	h_timers[h] = (HTimer*) 0;
+    h_free_timers = (HTimer*) 0;
+    }
+
+
+static HTimer*
+h_create(
+    struct timeval* nowP, TimerProc* timer_proc, ClientData client_data,
+    long msecs, int periodic )
+    {
+    HTimer* t;
+
+    if ( h_free_timers != (HTimer*) 0 )
+	{
+	t = h_free_timers;
+	h_free_timers = t->next;
+	}
+    else
+	{
+	t = (HTimer*) malloc( sizeof(HTimer) );
+	if ( t == (HTimer*) 0 )
+	    return (HTimer*) 0;
+	}
+
+    t->timer_proc = timer_proc;
+    t->client_data = client_data;
+    t->msecs = msecs;
+    t->periodic = periodic;
+    t->time = *nowP;
+    t->time.tv_sec += msecs / 1000L;
+    t->time.tv_usec += ( msecs % 1000L ) * 1000L;
+    if ( t->time.tv_usec >= 1000000L )
+	{
+	t->time.tv_sec += t->time.tv_usec / 1000000L;
+	t->time.tv_usec %= 1000000L;
+	}
+    t->hash = h_hash( t );
+    h_l_add( t );
+
+    return t;
+    }
+
+
+static long
+h_mstimeout( struct timeval* nowP )
+    {
+    int h;
+    int gotone;
+    long msecs, m;
+    HTimer* t;
+
+    gotone = 0;
+    msecs = 0;
+    for ( h = 0; h < HASH_SIZE; ++h )
+	{
+	t = h_timers[h];
+	if ( t != (HTimer*) 0 )
+	    {
+	    m = ( t->time.tv_sec - nowP->tv_sec ) * 1000L +
+		( t->time.tv_usec - nowP->tv_usec ) / 1000L;
+	    if ( ! gotone )
+		{
+		msecs = m;
+		gotone = 1;
+		}
+	    else if ( m < msecs )
+		msecs = m;
+	    }
+	}
+    if ( ! gotone )
+	return INFTIM;
+    if ( msecs <= 0 )
+	msecs = 0;
+    return msecs;
+    }
+
+
+static void h_cancel( HTimer* t );
+
+static void
+h_run( struct timeval* nowP )
+    {
+    int h;
+    HTimer* t;
+    HTimer* next;
+
+    for ( h = 0; h < HASH_SIZE; ++h )
+	for ( t = h_timers[h]; t != (HTimer*) 0; t = next )
+	    {
+	    next = t->next;
+	    if ( t->time.tv_sec > nowP->tv_sec ||
+		 ( t->time.tv_sec == nowP->tv_sec &&
+		   t->time.tv_usec > nowP->tv_usec ) )
+		break;
+	    (t->timer_proc)( t->client_data, nowP );
+	    if ( t->periodic )
+		{
+		t->time.tv_sec += t->msecs / 1000L;
+		t->time.tv_usec += ( t->msecs % 1000L ) * 1000L;
+		if ( t->time.tv_usec >= 1000000L )
+		    {
+		    t->time.tv_sec += t->time.tv_usec / 1000000L;
+		    t->time.tv_usec %= 1000000L;
+		    }
+		h_l_resort( t );
+		}
+	    else
+		h_cancel( t );
+	    }
+    }
+
+
+static void
+h_reset( struct timeval* nowP, HTimer* t )
+    {
+    t->time = *nowP;
+    t->time.tv_sec += t->msecs / 1000L;
+    t->time.tv_usec += ( t->msecs % 1000L ) * 1000L;
+    if ( t->time.tv_usec >= 1000000L )
+	{
+	t->time.tv_sec += t->time.tv_usec / 1000000L;
+	t->time.tv_usec %= 1000000L;
+	}
+    h_l_resort( t );
+    }
+
+
+static void
+h_cancel( HTimer* t )
+    {
+    h_l_remove( t );
+    t->next = h_free_timers;
+    h_free_timers = t;
+    t->prev = (HTimer*) 0;
+    }
+
+
+/* The timing wheel timers.c has now. */
+
+typedef struct WTimerStruct {
+    TimerProc* timer_proc;
+    ClientData client_data;
+    long msecs;
+    int periodic;
+    struct timeval time;
+    struct WTimerStruct* prev;
+    struct WTimerStruct* next;
+    unsigned long expires;
+    int bucket;
+    } WTimer;
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE ( 1 << WHEEL_BITS )
+#define WHEEL_MASK ( WHEEL_SIZE - 1 )
+#define WHEEL_LEVELS 5
+#define MAX_DELTA ( 1L << ( WHEEL_BITS * WHEEL_LEVELS ) )
+#define RUN_BUCKET -1
+
+static WTimer* wheel[WHEEL_LEVELS * WHEEL_SIZE];
+static int level_count[WHEEL_LEVELS];
+static WTimer* run_list;
+static unsigned long wheel_now;
+static struct timeval base_time;
+static WTimer* w_free_timers;
+
+
+static unsigned long
+to_ticks( struct timeval* tvP, int round_up )
+    {
+    long secs, usecs;
+
+    secs = tvP->tv_sec - base_time.tv_sec;
+    usecs = tvP->tv_usec - base_time.tv_usec;
+    if ( usecs < 0 )
+	{
+	--secs;
+	usecs += 1000000L;
+	}
+    if ( secs < 0 )
+	return 0;
+    if ( round_up )
+	usecs += 999L;
+    return (unsigned long) secs * 1000L + usecs / 1000L;
+    }
+
+
+static void
+set_expires( WTimer* t )
+    {
+    t->expires = to_ticks( &t->time, 1 );
+    }
+
+
+static WTimer**
+l_head( int bucket )
+    {
+    if ( bucket == RUN_BUCKET )
+	return &run_list;
+    return &wheel[bucket];
+    }
+
+
+static void
+w_l_add( WTimer* t )
+    {
+    long delta;
+    unsigned long when;
+    int level;
+    WTimer** headP;
+
+    delta = (long) ( t->expires - wheel_now );
+    if ( delta < 0 )
+	delta = 0;
+    else if ( delta >= MAX_DELTA )
+	delta = MAX_DELTA - 1;
+    when = wheel_now + delta;
+
+    for ( level = 0;
+	  level < WHEEL_LEVELS - 1 &&
+	      delta >= ( 1L << ( ( level + 1 ) * WHEEL_BITS ) );
+	  ++level )
+	continue;
+    t->bucket =
+	level * WHEEL_SIZE +
+	(int) ( ( when >> ( level * WHEEL_BITS ) ) & WHEEL_MASK );
+    ++level_count[level];
+
+    headP = l_head( t->bucket );
+    t->prev = (WTimer*) 0;
+    t->next = *headP;
+    if ( *headP != (WTimer*) 0 )
+	(*headP)->prev = t;
+    *headP = t;
+    }
+
+
+static void
+w_l_remove( WTimer* t )
+    {
+    if ( t->prev == (WTimer*) 0 )
+	*l_head( t->bucket ) = t->next;
+    else
+	t->prev->next = t->next;
+    if ( t->next != (WTimer*) 0 )
+	t->next->prev = t->prev;
+    if ( t->bucket != RUN_BUCKET )
+	--level_count[t->bucket / WHEEL_SIZE];
+    }
+
+
+static void
+w_l_resort( WTimer* t )
+    {
+    w_l_remove( t );
+    set_expires( t );
+    w_l_add( t );
+    }
+
+
+static void
+cascade( int level, int slot )
+    {
+    WTimer* t;
+    WTimer* next;
+    int bucket = level * WHEEL_SIZE + slot;
+
+    t = wheel[bucket];
+    wheel[bucket] = (WTimer*) 0;
+    for ( ; t != (WTimer*) 0; t = next )
+	{
+	next = t->next;
+	--level_count[level];
+	w_l_add( t );
+	}
+    }
+
+
+static void
+w_init( struct timeval* nowP )
+    {
+    int b, level;
+
+    for ( b = 0; b < WHEEL_LEVELS * WHEEL_SIZE; ++b )
+	wheel[b] = (WTimer*) 0;
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
+	level_count[level] = 0;
+    run_list = (WTimer*) 0;
+    base_time = *nowP;
+    wheel_now = 0;
+    w_free_timers = (WTimer*) 0;
+    }
+
+
+static WTimer*
+w_create(
+    struct timeval* nowP, TimerProc* timer_proc, ClientData client_data,
+    long msecs, int periodic )
+    {
+    WTimer* t;
+
+    if ( w_free_timers != (WTimer*) 0 )
+	{
+	t = w_free_timers;
+	w_free_timers = t->next;
+	}
+    else
+	{
+	t = (WTimer*) malloc( sizeof(WTimer) );
+	if ( t == (WTimer*) 0 )
+	    return (WTimer*) 0;
+	}
+
+    t->timer_proc = timer_proc;
+    t->client_data = client_data;
+    t->msecs = msecs;
+    t->periodic = periodic;
+    t->time = *nowP;
+    t->time.tv_sec += msecs / 1000L;
+    t->time.tv_usec += ( msecs % 1000L ) * 1000L;
+    if ( t->time.tv_usec >= 1000000L )
+	{
+	t->time.tv_sec += t->time.tv_usec / 1000000L;
+	t->time.tv_usec %= 1000000L;
+	}
+    set_expires( t );
+    w_l_add( t );
+
+    return t;
+    }
+
+
+static long
+w_mstimeout( struct timeval* nowP )
+    {
+    int level, i, first, cur;
+    int gotone;
+    unsigned long soonest, when;
+    long msecs;
+    WTimer* t;
+
+    gotone = 0;
+    soonest = 0;
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
+	{
+	if ( level_count[level] == 0 )
+	    continue;
+	cur = (int) ( ( wheel_now >> ( level * WHEEL_BITS ) ) & WHEEL_MASK );
+	if ( ( wheel_now & ( ( 1UL << ( level * WHEEL_BITS ) ) - 1 ) ) == 0 )
+	    first = 0;
+	else
+	    first = 1;
+	for ( i = first; i < first + WHEEL_SIZE; ++i )
+	    {
+	    t = wheel[level * WHEEL_SIZE + ( ( cur + i ) & WHEEL_MASK )];
+	    if ( t == (WTimer*) 0 )
+		continue;
+	    for ( ; t != (WTimer*) 0; t = t->next )
+		{
+		when = t->expires;
+		if ( (long) ( when - wheel_now ) < 0 )
+		    when = wheel_now;
+		if ( ! gotone || (long) ( when - soonest ) < 0 )
+		    {
+		    soonest = when;
+		    gotone = 1;
+		    }
+		}
+	    break;
+	    }
+	}
+    if ( ! gotone )
+	return INFTIM;
+    msecs = (long) ( soonest - to_ticks( nowP, 0 ) );
+    if ( msecs <= 0 )
+	msecs = 0;
+    return msecs;
+    }
+
+
+static void w_cancel( WTimer* t );
+
+static void
+w_run( struct timeval* nowP )
+    {
+    unsigned long target, tick, boundary;
+    int level, slot;
+    WTimer* t;
+
+    target = to_ticks( nowP, 0 );
+    while ( (long) ( target - wheel_now ) >= 0 )
+	{
+	tick = wheel_now;
+	slot = (int) ( tick & WHEEL_MASK );
+	if ( slot == 0 )
+	    {
+	    for ( level = 1; level < WHEEL_LEVELS; ++level )
+		{
+		slot = (int) ( ( tick >> ( level * WHEEL_BITS ) ) & WHEEL_MASK );
+		cascade( level, slot );
+		if ( slot != 0 )
+		    break;
+		}
+	    slot = 0;
+	    }
+	else if ( level_count[0] == 0 )
+	    {
+	    boundary = ( tick | WHEEL_MASK ) + 1;
+	    if ( (long) ( boundary - target ) > 0 )
+		{
+		wheel_now = target + 1;
+		break;
+		}
+	    wheel_now = boundary;
+	    continue;
+	    }
+
+	run_list = wheel[slot];
+	wheel[slot] = (WTimer*) 0;
+	for ( t = run_list; t != (WTimer*) 0; t = t->next )
+	    {
+	    t->bucket = RUN_BUCKET;
+	    --level_count[0];
+	    }
+	wheel_now = tick + 1;
+
+	while ( ( t = run_list ) != (WTimer*) 0 )
+	    {
+	    if ( (long) ( t->expires - tick ) > 0 )
+		{
+		w_l_resort( t );
+		continue;
+		}
+	    (t->timer_proc)( t->client_data, nowP );
+	    if ( t->periodic )
+		{
+		t->time.tv_sec += t->msecs / 1000L;
+		t->time.tv_usec += ( t->msecs % 1000L ) * 1000L;
+		if ( t->time.tv_usec >= 1000000L )
+		    {
+		    t->time.tv_sec += t->time.tv_usec / 1000000L;
+		    t->time.tv_usec %= 1000000L;
+		    }
+		w_l_resort( t );
+		}
+	    else
+		w_cancel( t );
+	    }
+	}
+    }
+
+
+static void
+w_reset( struct timeval* nowP, WTimer* t )
+    {
+    t->time = *nowP;
+    t->time.tv_sec += t->msecs / 1000L;
+    t->time.tv_usec += ( t->msecs % 1000L ) * 1000L;
+    if ( t->time.tv_usec >= 1000000L )
+	{
+	t->time.tv_sec += t->time.tv_usec / 1000000L;
+	t->time.tv_usec %= 1000000L;
+	}
+    w_l_resort( t );
+    }
+
+
+static void
+w_cancel( WTimer* t )
+    {
+    w_l_remove( t );
+    t->next = w_free_timers;
+    w_free_timers = t;
+    t->prev = (WTimer*) 0;
+    }
+
+
+/* The driver.  It runs one package at a time through the same
+** pseudo-random stream, by way of this table.
+*/
+
+typedef struct {
+    char* name;
+    void (*init)( struct timeval* nowP );
+    void* (*create)( struct timeval* nowP, TimerProc* timer_proc, ClientData client_data, long msecs, int periodic );
+    void (*reset)( struct timeval* nowP, void* t );
+    void (*cancel)( void* t );
+    void (*run)( struct timeval* nowP );
+    long (*mstimeout)( struct timeval* nowP );
+    } Package;
+
+static void
+h_init_p( struct timeval* nowP )
+    {
+    h_init();
+    }
+
+static void*
+h_create_p( struct timeval* nowP, TimerProc* timer_proc, ClientData client_data, long msecs, int periodic )
+    {
+    return (void*) h_create( nowP, timer_proc, client_data, msecs, periodic );
+    }
+
+static void
+h_reset_p( struct timeval* nowP, void* t )
+    {
+    h_reset( nowP, (HTimer*) t );
+    }
+
+static void
+h_cancel_p( void* t )
+    {
+    h_cancel( (HTimer*) t );
+    }
+
+static void*
+w_create_p( struct timeval* nowP, TimerProc* timer_proc, ClientData client_data, long msecs, int periodic )
+    {
+    return (void*) w_create( nowP, timer_proc, client_data, msecs, periodic );
+    }
+
+static void
+w_reset_p( struct timeval* nowP, void* t )
+    {
+    w_reset( nowP, (WTimer*) t );
+    }
+
+static void
+w_cancel_p( void* t )
+    {
+    w_cancel( (WTimer*) t );
+    }
+
+static Package packages[] = {
+    { "hash lists", h_init_p, h_create_p, h_reset_p, h_cancel_p, h_run, h_mstimeout },
+    { "wheel", w_init, w_create_p, w_reset_p, w_cancel_p, w_run, w_mstimeout },
+    };
+#define N_PACKAGES ( sizeof(packages) / sizeof(*packages) )
+
+static void** pool;		/* the connection timers, one per slot */
+static int npool;
+static long fired;
+
+
+/* One-shot timers that go off just free up their slot. */
+static void
+conn_proc( ClientData client_data, struct timeval* nowP )
+    {
+    pool[client_data.i] = (void*) 0;
+    ++fired;
+    }
+
+static void
+periodic_proc( ClientData client_data, struct timeval* nowP )
+    {
+    ++fired;
+    }
+
+
+/* Connection timers are mostly short lingers and wakeups, with some
+** long idle ones.
+*/
+static long
+conn_msecs( void )
+    {
+    int r = random() % 10;
+
+    if ( r < 4 )
+	return 500;			/* linger */
+    if ( r < 8 )
+	return 1 + random() % 2000;	/* throttle wakeup */
+    return 60000;			/* idle */
+    }
+
+
+static void
+advance( struct timeval* nowP, long msecs )
+    {
+    nowP->tv_usec += msecs * 1000L;
+    nowP->tv_sec += nowP->tv_usec / 1000000L;
+    nowP->tv_usec %= 1000000L;
+    }
+
+
+static double
+timeval_secs( struct timeval* tvP )
+    {
+    return tvP->tv_sec + tvP->tv_usec / 1000000.0;
+    }
+
+
+static double
+churn( Package* pk, long nops, struct timeval* startP, long* timeout_sumP )
+    {
+    struct timeval now, t0, t1;
+    ClientData cd;
+    long ops, timeout_sum;
+    int i, r;
+
+    srandom( 1 );
+    now = *startP;
+    fired = 0;
+    timeout_sum = 0;
+    ops = 0;
+    pk->init( &now );
+
+    (void) gettimeofday( &t0, (struct timezone*) 0 );
+
+    /* A few periodic timers, like the ones thttpd keeps. */
+    cd.i = 0;
+    (void) pk->create( &now, periodic_proc, cd, 5000, 1 );
+    (void) pk->create( &now, periodic_proc, cd, 60000, 1 );
+    (void) pk->create( &now, periodic_proc, cd, 1000, 1 );
+
+    for ( i = 0; i < npool; ++i )
+	{
+	cd.i = i;
+	pool[i] = pk->create( &now, conn_proc, cd, conn_msecs(), 0 );
+	++ops;
+	}
+
+    while ( ops < nops )
+	{
+	/* A tick's worth of events. */
+	for ( r = 0; r < 50 && ops < nops; ++r )
+	    {
+	    i = random() % npool;
+	    if ( pool[i] == (void*) 0 )
+		{
+		/* A new connection in a slot whose timer went off. */
+		cd.i = i;
+		pool[i] = pk->create( &now, conn_proc, cd, conn_msecs(), 0 );
+		}
+	    else if ( random() % 3 != 0 )
+		/* Some traffic on the connection. */
+		pk->reset( &now, pool[i] );
+	    else
+		{
+		/* The connection closed. */
+		pk->cancel( pool[i] );
+		pool[i] = (void*) 0;
+		}
+	    ++ops;
+	    }
+	advance( &now, 1 );
+	timeout_sum += pk->mstimeout( &now );
+	pk->run( &now );
+	++ops;
+	}
+
+    (void) gettimeofday( &t1, (struct timezone*) 0 );
+
+    /* Empty the pool so the next package starts from nothing. */
+    for ( i = 0; i < npool; ++i )
+	if ( pool[i] != (void*) 0 )
+	    {
+	    pk->cancel( pool[i] );
+	    pool[i] = (void*) 0;
+	    }
+
+    *timeout_sumP = timeout_sum;
+    return ( timeval_secs( &t1 ) - timeval_secs( &t0 ) ) * 1e9 / ops;
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    long nops, sum, first_sum, first_fired;
+    int p;
+    double ns;
+    struct timeval start;
+
+    nops = 1000000;
+    npool = 10000;
+    if ( argc > 1 )
+	nops = atol( argv[1] );
+    if ( argc > 2 )
+	npool = atoi( argv[2] );
+    if ( nops <= 0 || npool <= 0 )
+	{
+	(void) fprintf( stderr, "usage: %s [operations [timers]]\n", argv[0] );
+	exit( 1 );
+	}
+    pool = (void**) malloc( npool * sizeof(void*) );
+    if ( pool == (void**) 0 )
+	{
+	perror( "malloc" );
+	exit( 1 );
+	}
+
+    /* Start on a millisecond, so both packages fire on the same ticks. */
+    (void) gettimeofday( &start, (struct timezone*) 0 );
+    start.tv_usec -= start.tv_usec % 1000;
+
+    (void) printf(
+	"%ld operations, %d connection timers\n", nops, npool );
+    first_sum = first_fired = 0;
+    for ( p = 0; p < N_PACKAGES; ++p )
+	{
+	ns = churn( &packages[p], nops, &start, &sum );
+	(void) printf(
+	    "%-11s %8.1f ns/op  (%ld fired)\n", packages[p].name, ns, fired );
+	if ( p == 0 )
+	    {
+	    first_sum = sum;
+	    first_fired = fired;
+	    }
+	else if ( sum != first_sum || fired != first_fired )
+	    (void) printf( "    disagrees with %s on when timers are due!\n",
+		packages[0].name );
+	}
+
+    exit( 0 );
+    }
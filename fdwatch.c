@@ -1,4 +1,5 @@
-/* fdwatch.c - fd watcher routines, either select() or poll()
+/* fdwatch.c - fd watcher routines, either select(), poll(), /dev/poll,
+** kqueue() or epoll()
 **
 ** Copyright  1999,2000 by Jef Poskanzer <jef@mail.acme.com>.
 ** All rights reserved.
@@ -25,6 +26,8 @@
 ** SUCH DAMAGE.
 */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -57,6 +60,13 @@
 #include <sys/event.h>
 #endif /* HAVE_SYS_EVENT_H */
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#ifndef HAVE_EPOLL
+#define HAVE_EPOLL
+#endif /* !HAVE_EPOLL */
+#endif /* HAVE_SYS_EPOLL_H */
+
 #include "fdwatch.h"
 
 #ifdef HAVE_SELECT
@@ -70,11 +80,13 @@
 #endif /* !FD_SET */
 #endif /* HAVE_SELECT */
 
-static int nfiles;
-static long nwatches;
-static int* fd_rw;
-static void** fd_data;
-static int nreturned, next_ridx;
+static THREAD_LOCAL int nfiles;
+static THREAD_LOCAL long nwatches;
+static THREAD_LOCAL int* fd_rw;
+static THREAD_LOCAL void** fd_data;
+static THREAD_LOCAL int nreturned, next_ridx;
+static THREAD_LOCAL long nevents;
+static THREAD_LOCAL int max_nreturned;
 
 #ifdef HAVE_KQUEUE
 
@@ -98,7 +110,7 @@ static int kqueue_get_fd( int ridx );
 
 #define WHICH                  "devpoll"
 #define INIT( nf )         devpoll_init( nf )
-#define ADD_FD( fd, rw )       devpoll_add_fd( fd, rw )
+#define ADD_FD( fd, rw )       devpoll_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )           devpoll_del_fd( fd )
 #define WATCH( timeout_msecs ) devpoll_watch( timeout_msecs )
 #define CHECK_FD( fd )         devpoll_check_fd( fd )
@@ -112,11 +124,29 @@ static int devpoll_check_fd( int fd );
 static int devpoll_get_fd( int ridx );
 
 # else /* HAVE_DEVPOLL */
-#  ifdef HAVE_POLL
+#  ifdef HAVE_EPOLL
+
+#define WHICH                  "epoll"
+#define INIT( nf )         epoll_init( nf )
+#define ADD_FD( fd, rw )       epoll_add_fd( fd, rw )
+#define DEL_FD( fd )           epoll_del_fd( fd )
+#define WATCH( timeout_msecs ) epoll_watch( timeout_msecs )
+#define CHECK_FD( fd )         epoll_check_fd( fd )
+#define GET_FD( ridx )         epoll_get_fd( ridx )
+
+static int epoll_init( int nf );
+static void epoll_add_fd( int fd, int rw );
+static void epoll_del_fd( int fd );
+static int epoll_watch( long timeout_msecs );
+static int epoll_check_fd( int fd );
+static int epoll_get_fd( int ridx );
+
+#  else /* HAVE_EPOLL */
+#   ifdef HAVE_POLL
 
 #define WHICH                  "poll"
 #define INIT( nf )         poll_init( nf )
-#define ADD_FD( fd, rw )       poll_add_fd( fd, rw )
+#define ADD_FD( fd, rw )       poll_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )           poll_del_fd( fd )
 #define WATCH( timeout_msecs ) poll_watch( timeout_msecs )
 #define CHECK_FD( fd )         poll_check_fd( fd )
@@ -129,12 +159,12 @@ static int poll_watch( long timeout_msecs );
 static int poll_check_fd( int fd );
 static int poll_get_fd( int ridx );
 
-#  else /* HAVE_POLL */
-#   ifdef HAVE_SELECT
+#   else /* HAVE_POLL */
+#    ifdef HAVE_SELECT
 
 #define WHICH                  "select"
 #define INIT( nf )         select_init( nf )
-#define ADD_FD( fd, rw )       select_add_fd( fd, rw )
+#define ADD_FD( fd, rw )       select_add_fd( fd, (rw) & ~FDW_EDGE )
 #define DEL_FD( fd )           select_del_fd( fd )
 #define WATCH( timeout_msecs ) select_watch( timeout_msecs )
 #define CHECK_FD( fd )         select_check_fd( fd )
@@ -147,8 +177,9 @@ static int select_watch( long timeout_msecs );
 static int select_check_fd( int fd );
 static int select_get_fd( int ridx );
 
-#   endif /* HAVE_SELECT */
-#  endif /* HAVE_POLL */
+#    endif /* HAVE_SELECT */
+#   endif /* HAVE_POLL */
+#  endif /* HAVE_EPOLL */
 # endif /* HAVE_DEVPOLL */
 #endif /* HAVE_KQUEUE */
 
@@ -182,13 +213,15 @@ fdwatch_get_nfiles( void )
 	}
 #endif /* RLIMIT_NOFILE */
 
-#if defined(HAVE_SELECT) && ! ( defined(HAVE_POLL) || defined(HAVE_DEVPOLL) || defined(HAVE_KQUEUE) )
+#if defined(HAVE_SELECT) && ! ( defined(HAVE_POLL) || defined(HAVE_DEVPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_EPOLL) )
     /* If we use select(), then we must limit ourselves to FD_SETSIZE. */
     nfiles = MIN( nfiles, FD_SETSIZE );
-#endif /* HAVE_SELECT && ! ( HAVE_POLL || HAVE_DEVPOLL || HAVE_KQUEUE ) */
+#endif /* HAVE_SELECT && ! ( HAVE_POLL || HAVE_DEVPOLL || HAVE_KQUEUE || HAVE_EPOLL ) */
 
     /* Initialize the fdwatch data structures. */
     nwatches = 0;
+    nevents = 0;
+    max_nreturned = 0;
     fd_rw = (int*) malloc( sizeof(int) * nfiles );
     fd_data = (void**) malloc( sizeof(void*) * nfiles );
     if ( fd_rw == (int*) 0 || fd_data == (void**) 0 )
@@ -202,7 +235,9 @@ fdwatch_get_nfiles( void )
     }
 
 
-/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE.  */
+/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE,
+** optionally or'd with FDW_EDGE.
+*/
 void
 fdwatch_add_fd( int fd, void* client_data, int rw )
     {
@@ -212,7 +247,7 @@ fdwatch_add_fd( int fd, void* client_data, int rw )
 	return;
 	}
     ADD_FD( fd, rw );
-    fd_rw[fd] = rw;
+    fd_rw[fd] = rw & ~FDW_EDGE;
     fd_data[fd] = client_data;
     }
 
@@ -241,6 +276,12 @@ fdwatch( long timeout_msecs )
     ++nwatches;
     nreturned = WATCH( timeout_msecs );
     next_ridx = 0;
+    if ( nreturned > 0 )
+	{
+	nevents += nreturned;
+	if ( nreturned > max_nreturned )
+	    max_nreturned = nreturned;
+	}
     return nreturned;
     }
 
@@ -278,20 +319,24 @@ fdwatch_logstats( long secs )
     {
     if ( secs > 0 )
 	syslog(
-	    LOG_NOTICE, "  fdwatch - %ld %ss (%g/sec)",
-	    nwatches, WHICH, (float) nwatches / secs );
+	    LOG_NOTICE, "  fdwatch - %ld %ss (%g/sec), %ld events (%g/%s, max %d)",
+	    nwatches, WHICH, (float) nwatches / secs, nevents,
+	    nwatches > 0 ? (float) nevents / nwatches : 0.0, WHICH,
+	    max_nreturned );
     nwatches = 0;
+    nevents = 0;
+    max_nreturned = 0;
     }
 
 
 #ifdef HAVE_KQUEUE
 
-static int maxkqevents;
-static struct kevent* kqevents;
-static int nkqevents;
-static struct kevent* kqrevents;
-static int* kqrfdidx;
-static int kq;
+static THREAD_LOCAL int maxkqevents;
+static THREAD_LOCAL struct kevent* kqevents;
+static THREAD_LOCAL int nkqevents;
+static THREAD_LOCAL struct kevent* kqrevents;
+static THREAD_LOCAL int* kqrfdidx;
+static THREAD_LOCAL int kq;
 
 
 static int
@@ -323,7 +368,9 @@ kqueue_add_fd( int fd, int rw )
 	}
     kqevents[nkqevents].ident = fd;
     kqevents[nkqevents].flags = EV_ADD;
-    switch ( rw )
+    if ( rw & FDW_EDGE )
+	kqevents[nkqevents].flags |= EV_CLEAR;
+    switch ( rw & ~FDW_EDGE )
 	{
 	case FDW_READ: kqevents[nkqevents].filter = EVFILT_READ; break;
 	case FDW_WRITE: kqevents[nkqevents].filter = EVFILT_WRITE; break;
@@ -419,12 +466,12 @@ kqueue_get_fd( int ridx )
 
 # ifdef HAVE_DEVPOLL
 
-static int maxdpevents;
-static struct pollfd* dpevents;
-static int ndpevents;
-static struct pollfd* dprevents;
-static int* dp_rfdidx;
-static int dp;
+static THREAD_LOCAL int maxdpevents;
+static THREAD_LOCAL struct pollfd* dpevents;
+static THREAD_LOCAL int ndpevents;
+static THREAD_LOCAL struct pollfd* dprevents;
+static THREAD_LOCAL int* dp_rfdidx;
+static THREAD_LOCAL int dp;
 
 
 static int
@@ -545,12 +592,122 @@ devpoll_get_fd( int ridx )
 # else /* HAVE_DEVPOLL */
 
 
-#  ifdef HAVE_POLL
+#  ifdef HAVE_EPOLL
+
+static THREAD_LOCAL struct epoll_event* eprevents;
+static THREAD_LOCAL int* ep_rfdidx;
+static THREAD_LOCAL int ep;
+
+
+static int
+epoll_init( int nf )
+    {
+    ep = epoll_create( nf );
+    if ( ep == -1 )
+	return -1;
+    (void) fcntl( ep, F_SETFD, 1 );
+    eprevents = (struct epoll_event*) malloc( sizeof(struct epoll_event) * nf );
+    ep_rfdidx = (int*) malloc( sizeof(int) * nf );
+    if ( eprevents == (struct epoll_event*) 0 || ep_rfdidx == (int*) 0 )
+	return -1;
+    (void) memset( ep_rfdidx, 0, sizeof(int) * nf );
+    return 0;
+    }
+
+
+static void
+epoll_add_fd( int fd, int rw )
+    {
+    struct epoll_event ev;
+
+    (void) memset( &ev, 0, sizeof(ev) );
+    ev.data.fd = fd;
+    switch ( rw & ~FDW_EDGE )
+	{
+	case FDW_READ: ev.events = EPOLLIN; break;
+	case FDW_WRITE: ev.events = EPOLLOUT; break;
+	default: break;
+	}
+    if ( rw & FDW_EDGE )
+	ev.events |= EPOLLET;
+    if ( epoll_ctl( ep, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+	syslog( LOG_ERR, "epoll_ctl add fd %d - %m", fd );
+    }
+
+
+static void
+epoll_del_fd( int fd )
+    {
+    struct epoll_event ev;	/* old kernels insist on a non-null event */
 
-static struct pollfd* pollfds;
-static int npoll_fds;
-static int* poll_fdidx;
-static int* poll_rfdidx;
+    (void) memset( &ev, 0, sizeof(ev) );
+    if ( epoll_ctl( ep, EPOLL_CTL_DEL, fd, &ev ) < 0 )
+	syslog( LOG_ERR, "epoll_ctl del fd %d - %m", fd );
+    }
+
+
+static int
+epoll_watch( long timeout_msecs )
+    {
+    int i, r;
+
+    r = epoll_wait( ep, eprevents, nfiles, (int) timeout_msecs );
+    if ( r == -1 )
+	return -1;
+
+    for ( i = 0; i < r; ++i )
+	ep_rfdidx[eprevents[i].data.fd] = i;
+
+    return r;
+    }
+
+
+static int
+epoll_check_fd( int fd )
+    {
+    int ridx = ep_rfdidx[fd];
+
+    if ( ridx < 0 || ridx >= nfiles )
+	{
+	syslog( LOG_ERR, "bad ridx (%d) in epoll_check_fd!", ridx );
+	return 0;
+	}
+    if ( ridx >= nreturned )
+	return 0;
+    if ( eprevents[ridx].data.fd != fd )
+	return 0;
+    if ( eprevents[ridx].events & EPOLLERR )
+	return 0;
+    switch ( fd_rw[fd] )
+	{
+	case FDW_READ: return eprevents[ridx].events & ( EPOLLIN | EPOLLHUP );
+	case FDW_WRITE: return eprevents[ridx].events & ( EPOLLOUT | EPOLLHUP );
+	default: return 0;
+	}
+    }
+
+
+static int
+epoll_get_fd( int ridx )
+    {
+    if ( ridx < 0 || ridx >= nfiles )
+	{
+	syslog( LOG_ERR, "bad ridx (%d) in epoll_get_fd!", ridx );
+	return -1;
+	}
+    return eprevents[ridx].data.fd;
+    }
+
+
+#  else /* HAVE_EPOLL */
+
+
+#   ifdef HAVE_POLL
+
+static THREAD_LOCAL struct pollfd* pollfds;
+static THREAD_LOCAL int npoll_fds;
+static THREAD_LOCAL int* poll_fdidx;
+static THREAD_LOCAL int* poll_rfdidx;
 
 
 static int
@@ -663,21 +820,21 @@ poll_get_fd( int ridx )
     return poll_rfdidx[ridx];
     }
 
-#  else /* HAVE_POLL */
+#   else /* HAVE_POLL */
 
 
-#   ifdef HAVE_SELECT
+#    ifdef HAVE_SELECT
 
-static fd_set master_rfdset;
-static fd_set master_wfdset;
-static fd_set working_rfdset;
-static fd_set working_wfdset;
-static int* select_fds;
-static int* select_fdidx;
-static int* select_rfdidx;
-static int nselect_fds;
-static int maxfd;
-static int maxfd_changed;
+static THREAD_LOCAL fd_set master_rfdset;
+static THREAD_LOCAL fd_set master_wfdset;
+static THREAD_LOCAL fd_set working_rfdset;
+static THREAD_LOCAL fd_set working_wfdset;
+static THREAD_LOCAL int* select_fds;
+static THREAD_LOCAL int* select_fdidx;
+static THREAD_LOCAL int* select_rfdidx;
+static THREAD_LOCAL int nselect_fds;
+static THREAD_LOCAL int maxfd;
+static THREAD_LOCAL int maxfd_changed;
 
 
 static int
@@ -825,9 +982,11 @@ select_get_fd( int ridx )
     return select_rfdidx[ridx];
     }
 
-#   endif /* HAVE_SELECT */
+#    endif /* HAVE_SELECT */
+
+#   endif /* HAVE_POLL */
 
-#  endif /* HAVE_POLL */
+#  endif /* HAVE_EPOLL */
 
 # endif /* HAVE_DEVPOLL */
 
@@ -1,6 +1,6 @@
 /* fdwatch.h - header file for fdwatch package
 **
-** This package abstracts the use of the select()/poll()/kqueue()
+** This package abstracts the use of the select()/poll()/kqueue()/epoll()
 ** system calls.  The basic function of these calls is to watch a set
 ** of file descriptors for activity.  select() originated in the BSD world,
 ** while poll() came from SysV land, and their interfaces are somewhat
@@ -50,6 +50,15 @@
 #define FDW_READ 0
 #define FDW_WRITE 1
 
+/* Or this into the rw argument of fdwatch_add_fd() to ask for
+** edge-triggered notification.  The descriptor is then only reported
+** when it becomes ready again, so the caller must keep reading or writing
+** until the socket is drained or full.  Backends that can't do this
+** (everything but epoll and kqueue) just ignore it, which is harmless for
+** a caller that follows that rule.
+*/
+#define FDW_EDGE 2
+
 #ifndef INFTIM
 #define INFTIM -1
 #endif /* INFTIM */
@@ -59,7 +68,9 @@
 */
 int fdwatch_get_nfiles( void );
 
-/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE.  */
+/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE,
+** optionally or'd with FDW_EDGE.
+*/
 void fdwatch_add_fd( int fd, void* client_data, int rw );
 
 /* Delete a descriptor from the watch list. */
@@ -79,7 +90,9 @@ int fdwatch_check_fd( int fd );
 */
 void* fdwatch_get_next_client_data( void );
 
-/* Generate debugging statistics syslog message. */
+/* Generate debugging statistics syslog message.  Besides the number of
+** watches, this reports how many events each wakeup returned.
+*/
 void fdwatch_logstats( long secs );
 
 #endif /* _FDWATCH_H_ */
@@ -38,6 +38,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -59,6 +60,16 @@
 #include <osreldate.h>
 #endif /* HAVE_OSRELDATE_H */
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define USE_SSE2_SCAN
+#endif
+
+#if defined(LOG_RING_SIZE) && defined(HAVE_LIBPTHREAD) && defined(__GNUC__)
+#include <pthread.h>
+#define USE_LOG_RING
+#endif
+
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
 # define NAMLEN(dirent) strlen((dirent)->d_name)
@@ -78,6 +89,7 @@
 
 #include "libhttpd.h"
 #include "mmc.h"
+#include "stc.h"
 #include "timers.h"
 #include "match.h"
 #include "tdate_parse.h"
@@ -108,6 +120,17 @@ typedef int socklen_t;
 #define timezone  _timezone
 #endif
 
+/* The plain versions of these return a static struct, which would get
+** stomped on by other threads.
+*/
+#ifdef HAVE_LIBPTHREAD
+#define GMTIME(tP, tmP) gmtime_r( tP, tmP )
+#define LOCALTIME(tP, tmP) localtime_r( tP, tmP )
+#else /* HAVE_LIBPTHREAD */
+#define GMTIME(tP, tmP) gmtime( tP )
+#define LOCALTIME(tP, tmP) localtime( tP )
+#endif /* HAVE_LIBPTHREAD */
+
 #ifndef MAX
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #endif
@@ -115,13 +138,95 @@ typedef int socklen_t;
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifdef USE_LOG_RING
+/* A log file line waiting for the writer thread, with each field already
+** cut down to the length it gets logged at.
+*/
+typedef struct {
+    time_t now;
+    int status;
+    char* method;	/* from httpd_method_str(), not copied */
+    char client[81];
+    char ru[81];
+    char url[305];
+    char protocol[81];
+    char bytes[40];
+    char referrer[201];
+    char useragent[201];
+    } log_rec;
+
+/* The ring between a server's main loop and its writer thread.  The main
+** loop only ever advances tail and the writer only ever advances head, so
+** handing off a line takes no lock.  The mutex and conditions are just for
+** the writer to sleep on when the ring is empty, and for the main loop to
+** sleep on when it's full and LOG_RING_BLOCK is set, and for telling the
+** writer to finish up and stop.
+*/
+typedef struct {
+    log_rec recs[LOG_RING_SIZE];
+    unsigned long head;		/* next line to write */
+    unsigned long tail;		/* next free slot */
+    FILE* fp;		/* the stream the writer is using */
+    FILE* new_fp;	/* replacement from httpd_set_logfp(), or 0 */
+    int stopping;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t nonempty;
+    pthread_cond_t room;
+    } log_ring;
+
+/* The indexes are read and written from both sides.  Sequentially
+** consistent accesses make sure that when the writer decides to sleep,
+** the main loop either sees that it has caught up and wakes it, or the
+** writer sees the new line.
+*/
+#define RING_LOAD(p) __atomic_load_n( p, __ATOMIC_SEQ_CST )
+#define RING_STORE(p, v) __atomic_store_n( p, v, __ATOMIC_SEQ_CST )
+
+/* The writer formats lines into a buffer this big, and writes it out
+** when a batch is done or it's nearly full.
+*/
+#define LOG_BATCH_SIZE 65536
+#endif /* USE_LOG_RING */
+
+#define LOG_FILE_FORMAT "%.80s - %.80s [%s] \"%.80s %.300s %.80s\" %d %s \"%.200s\" \"%.200s\"\n"
+
+
+/* The pools of read and response buffers.  They're kept apart since
+** the two kinds run to different sizes.  Free buffers are linked through
+** their own first bytes, since they're always much bigger than the link.
+*/
+typedef struct pool_buf {
+    struct pool_buf* next;
+    size_t size;
+    } pool_buf;
+
+typedef struct {
+    pool_buf* free;
+    int count;
+    size_t size;
+    int lent;
+    } buf_pool;
+
+static THREAD_LOCAL buf_pool read_pool, response_pool;
+
 
 /* Forwards. */
 static void check_options( void );
 static void free_httpd_server( httpd_server* hs );
-static int initialize_listen_socket( httpd_sockaddr* saP );
+static void add_child( httpd_server* hs, pid_t pid );
+static int initialize_listen_socket( httpd_sockaddr* saP, int reuse_port );
 static void add_response( httpd_conn* hc, char* str );
+static void borrow_str( buf_pool* bp, char** strP, size_t* maxsizeP, size_t size );
+static void return_str( buf_pool* bp, char** strP, size_t* maxsizeP );
 static void send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extraheads, char* type, off_t length, time_t mod );
+static void rfc1123_date( time_t t, char* buf );
+static void make_etag( httpd_conn* hc );
+static void parse_ranges( httpd_conn* hc, char* cp );
+static void resolve_ranges( httpd_conn* hc );
+static off_t make_parts( httpd_conn* hc, char* type, off_t size, char* boundary );
+static int etag_match( char* list, char* etag );
+static char* date_header( time_t now );
 static void send_response( httpd_conn* hc, int status, char* title, char* extraheads, char* form, char* arg );
 static void send_response_tail( httpd_conn* hc );
 static void defang( char* str, char* dfstr, int dfsize );
@@ -148,10 +253,22 @@ static int tilde_map_2( httpd_conn* hc );
 #endif /* TILDE_MAP_2 */
 static int vhost_map( httpd_conn* hc );
 static char* expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped );
+static char* really_expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped );
+static void init_request( httpd_conn* hc );
+static char* arena_alloc( httpd_conn* hc, size_t size );
+static char* arena_strdup( httpd_conn* hc, char* str );
+static char* join_list( httpd_conn* hc, char* list, char* item );
+static void arena_reset( httpd_conn* hc );
+static void init_headers( void );
+static int header_id( char* name, size_t len );
+static size_t scan_eol( char* buf, size_t start, size_t end );
 static char* bufgets( httpd_conn* hc );
 static void de_dotdot( char* file );
-static void init_mime( void );
 static void figure_mime( httpd_conn* hc );
+#ifdef PRECOMPRESSED_FILES
+static int precompressed( httpd_conn* hc );
+static int accepts_coding( char* accepte, char* coding );
+#endif /* PRECOMPRESSED_FILES */
 #ifdef CGI_TIMELIMIT
 static void cgi_kill2( ClientData client_data, struct timeval* nowP );
 static void cgi_kill( ClientData client_data, struct timeval* nowP );
@@ -171,7 +288,14 @@ static void cgi_interpose_output( httpd_conn* hc, int rfd );
 static void cgi_child( httpd_conn* hc );
 static int cgi( httpd_conn* hc );
 static int really_start_request( httpd_conn* hc, struct timeval* nowP );
+static char* log_date_str( time_t now );
 static void make_log_entry( httpd_conn* hc, struct timeval* nowP );
+#ifdef USE_LOG_RING
+static void start_log_ring( httpd_server* hs );
+static void stop_log_ring( httpd_server* hs );
+static void copy_field( char* to, char* from, size_t size );
+static void* log_writer( void* arg );
+#endif /* USE_LOG_RING */
 static int check_referrer( httpd_conn* hc );
 static int really_check_referrer( httpd_conn* hc );
 static int sockaddr_check( httpd_sockaddr* saP );
@@ -203,6 +327,103 @@ check_options( void )
     }
 
 
+/* The request headers we act on.  They get looked up by a perfect hash
+** of the name, so each header line costs one hash and one comparison
+** instead of a walk down a list of strncasecmp()s.
+*/
+#define HDR_UNKNOWN 0
+#define HDR_REFERER 1
+#define HDR_USER_AGENT 2
+#define HDR_HOST 3
+#define HDR_ACCEPT 4
+#define HDR_ACCEPT_ENCODING 5
+#define HDR_ACCEPT_LANGUAGE 6
+#define HDR_IF_MODIFIED_SINCE 7
+#define HDR_IF_NONE_MATCH 8
+#define HDR_COOKIE 9
+#define HDR_RANGE 10
+#define HDR_IF_RANGE 11
+#define HDR_CONTENT_TYPE 12
+#define HDR_CONTENT_LENGTH 13
+#define HDR_AUTHORIZATION 14
+#define HDR_CONNECTION 15
+
+static struct {
+    char* name;
+    int id;
+    size_t len;		/* filled in by init_headers() */
+    } headers[] = {
+    { "Referer", HDR_REFERER },
+    { "Referrer", HDR_REFERER },
+    { "User-Agent", HDR_USER_AGENT },
+    { "Host", HDR_HOST },
+    { "Accept", HDR_ACCEPT },
+    { "Accept-Encoding", HDR_ACCEPT_ENCODING },
+    { "Accept-Language", HDR_ACCEPT_LANGUAGE },
+    { "If-Modified-Since", HDR_IF_MODIFIED_SINCE },
+    { "If-None-Match", HDR_IF_NONE_MATCH },
+    { "Cookie", HDR_COOKIE },
+    { "Range", HDR_RANGE },
+    { "Range-If", HDR_IF_RANGE },
+    { "If-Range", HDR_IF_RANGE },
+    { "Content-Type", HDR_CONTENT_TYPE },
+    { "Content-Length", HDR_CONTENT_LENGTH },
+    { "Authorization", HDR_AUTHORIZATION },
+    { "Connection", HDR_CONNECTION },
+    };
+
+/* The hash looks at the length and three characters of the name, folded
+** to lower case.  Its multipliers were picked so that every name above
+** gets a slot of its own; init_headers() makes sure that's still true.
+*/
+#define HEADER_HASH_SIZE 32
+#define HEADER_HASH(s,len) \
+    ( ( (len) * 2 + ( (s)[0] | 0x20 ) + ( (s)[(len) - 1] | 0x20 ) * 4 + \
+	( (s)[3] | 0x20 ) ) & ( HEADER_HASH_SIZE - 1 ) )
+
+/* Index plus one into headers[] for each hash slot, or 0 if it's empty. */
+static int header_slots[HEADER_HASH_SIZE];
+
+
+static void
+init_headers( void )
+    {
+    int i, h;
+
+    for ( i = 0; i < HEADER_HASH_SIZE; ++i )
+	header_slots[i] = 0;
+    for ( i = 0; i < sizeof(headers) / sizeof(*headers); ++i )
+	{
+	headers[i].len = strlen( headers[i].name );
+	h = HEADER_HASH( headers[i].name, headers[i].len );
+	if ( header_slots[h] != 0 )
+	    {
+	    syslog(
+		LOG_CRIT, "request headers %s and %s have the same hash",
+		headers[header_slots[h] - 1].name, headers[i].name );
+	    exit( 1 );
+	    }
+	header_slots[h] = i + 1;
+	}
+    }
+
+
+/* Returns the HDR_* code for a header name of len characters. */
+static int
+header_id( char* name, size_t len )
+    {
+    int i;
+
+    if ( len < 4 )
+	return HDR_UNKNOWN;
+    i = header_slots[HEADER_HASH( name, len )];
+    if ( i == 0 || headers[i - 1].len != len ||
+	 strncasecmp( name, headers[i - 1].name, len ) != 0 )
+	return HDR_UNKNOWN;
+    return headers[i - 1].id;
+    }
+
+
 static void
 free_httpd_server( httpd_server* hs )
     {
@@ -220,6 +441,8 @@ free_httpd_server( httpd_server* hs )
 	free( (void*) hs->url_pattern );
     if ( hs->local_pattern != (char*) 0 )
 	free( (void*) hs->local_pattern );
+    if ( hs->cgi_pids != (pid_t*) 0 )
+	free( (void*) hs->cgi_pids );
     free( (void*) hs );
     }
 
@@ -230,13 +453,14 @@ httpd_initialize(
     unsigned short port, char* cgi_pattern, int cgi_limit, char* charset,
     char* p3p, int max_age, char* cwd, int no_log, FILE* logfp,
     int no_symlink_check, int vhost, int global_passwd, char* url_pattern,
-    char* local_pattern, int no_empty_referrers )
+    char* local_pattern, int no_empty_referrers, int reuse_port )
     {
     httpd_server* hs;
     static char ghnbuf[256];
     char* cp;
 
     check_options();
+    init_headers();
 
     hs = NEW( httpd_server, 1 );
     if ( hs == (httpd_server*) 0 )
@@ -296,6 +520,8 @@ httpd_initialize(
 	}
     hs->cgi_limit = cgi_limit;
     hs->cgi_count = 0;
+    hs->cgi_pids = (pid_t*) 0;
+    hs->max_cgi_pids = 0;
     hs->charset = strdup( charset );
     hs->p3p = strdup( p3p );
     hs->max_age = max_age;
@@ -329,7 +555,12 @@ httpd_initialize(
 	}
     hs->no_log = no_log;
     hs->logfp = (FILE*) 0;
+    hs->log_ring = (void*) 0;
     httpd_set_logfp( hs, logfp );
+#ifdef USE_LOG_RING
+    if ( logfp != (FILE*) 0 && ! no_log )
+	start_log_ring( hs );
+#endif /* USE_LOG_RING */
     hs->no_symlink_check = no_symlink_check;
     hs->vhost = vhost;
     hs->global_passwd = global_passwd;
@@ -342,11 +573,11 @@ httpd_initialize(
     if ( sa6P == (httpd_sockaddr*) 0 )
 	hs->listen6_fd = -1;
     else
-	hs->listen6_fd = initialize_listen_socket( sa6P );
+	hs->listen6_fd = initialize_listen_socket( sa6P, reuse_port );
     if ( sa4P == (httpd_sockaddr*) 0 )
 	hs->listen4_fd = -1;
     else
-	hs->listen4_fd = initialize_listen_socket( sa4P );
+	hs->listen4_fd = initialize_listen_socket( sa4P, reuse_port );
     /* If we didn't get any valid sockets, fail. */
     if ( hs->listen4_fd == -1 && hs->listen6_fd == -1 )
 	{
@@ -354,8 +585,6 @@ httpd_initialize(
 	return (httpd_server*) 0;
 	}
 
-    init_mime();
-
     /* Done initializing. */
     if ( hs->binding_hostname == (char*) 0 )
 	syslog(
@@ -371,7 +600,7 @@ httpd_initialize(
 
 
 static int
-initialize_listen_socket( httpd_sockaddr* saP )
+initialize_listen_socket( httpd_sockaddr* saP, int reuse_port )
     {
     int listen_fd;
     int on, flags;
@@ -399,6 +628,27 @@ initialize_listen_socket( httpd_sockaddr* saP )
 	     sizeof(on) ) < 0 )
 	syslog( LOG_CRIT, "setsockopt SO_REUSEADDR - %m" );
 
+    /* Let other processes bind their own sockets to the same port, with
+    ** the kernel spreading new connections across them.
+    */
+    if ( reuse_port )
+	{
+#ifdef SO_REUSEPORT
+	if ( setsockopt(
+		 listen_fd, SOL_SOCKET, SO_REUSEPORT, (char*) &on,
+		 sizeof(on) ) < 0 )
+	    {
+	    syslog( LOG_CRIT, "setsockopt SO_REUSEPORT - %m" );
+	    (void) close( listen_fd );
+	    return -1;
+	    }
+#else /* SO_REUSEPORT */
+	syslog( LOG_CRIT, "SO_REUSEPORT is not supported on this system" );
+	(void) close( listen_fd );
+	return -1;
+#endif /* SO_REUSEPORT */
+	}
+
     /* Bind to it. */
     if ( bind( listen_fd, &saP->sa, sockaddr_len( saP ) ) < 0 )
 	{
@@ -454,6 +704,24 @@ initialize_listen_socket( httpd_sockaddr* saP )
 void
 httpd_set_logfp( httpd_server* hs, FILE* logfp )
     {
+#ifdef USE_LOG_RING
+    if ( hs->log_ring != (void*) 0 )
+	{
+	log_ring* lr = (log_ring*) hs->log_ring;
+
+	/* The writer may be in the middle of a batch, so it does the
+	** switch and closes the old stream itself.
+	*/
+	(void) pthread_mutex_lock( &lr->mutex );
+	if ( lr->new_fp != (FILE*) 0 )
+	    (void) fclose( lr->new_fp );
+	lr->new_fp = logfp;
+	(void) pthread_cond_signal( &lr->nonempty );
+	(void) pthread_mutex_unlock( &lr->mutex );
+	hs->logfp = logfp;
+	return;
+	}
+#endif /* USE_LOG_RING */
     if ( hs->logfp != (FILE*) 0 )
 	(void) fclose( hs->logfp );
     hs->logfp = logfp;
@@ -464,12 +732,79 @@ void
 httpd_terminate( httpd_server* hs )
     {
     httpd_unlisten( hs );
+#ifdef USE_LOG_RING
+    stop_log_ring( hs );
+#endif /* USE_LOG_RING */
     if ( hs->logfp != (FILE*) 0 )
 	(void) fclose( hs->logfp );
     free_httpd_server( hs );
     }
 
 
+/* Remember a child process, counting it against the CGI limit until
+** httpd_reap_children() collects it.
+*/
+static void
+add_child( httpd_server* hs, pid_t pid )
+    {
+    if ( hs->cgi_count >= hs->max_cgi_pids )
+	{
+	if ( hs->max_cgi_pids == 0 )
+	    {
+	    hs->max_cgi_pids = 16;
+	    hs->cgi_pids = NEW( pid_t, hs->max_cgi_pids );
+	    }
+	else
+	    {
+	    hs->max_cgi_pids *= 2;
+	    hs->cgi_pids = RENEW( hs->cgi_pids, pid_t, hs->max_cgi_pids );
+	    }
+	if ( hs->cgi_pids == (pid_t*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory recording child process" );
+	    exit( 1 );
+	    }
+	}
+    hs->cgi_pids[hs->cgi_count++] = pid;
+    }
+
+
+void
+httpd_reap_children( httpd_server* hs )
+    {
+    int i, status;
+    pid_t pid;
+
+    /* Each server only waits for its own children, so with several
+    ** threads no one has to guess whose child a SIGCHLD was for.
+    */
+#ifdef HAVE_WAITPID
+    for ( i = 0; i < hs->cgi_count; )
+	{
+	pid = waitpid( hs->cgi_pids[i], &status, WNOHANG );
+	if ( (int) pid == 0 || ( (int) pid < 0 && errno == EINTR ) )
+	    {
+	    ++i;	/* still running */
+	    continue;
+	    }
+	/* Exited, or somehow already gone - stop counting it either way. */
+	hs->cgi_pids[i] = hs->cgi_pids[--hs->cgi_count];
+	}
+#else /* HAVE_WAITPID */
+    /* Without waitpid() we can only take whatever wait3() hands back,
+    ** which is fine as long as there is just the one server.
+    */
+    while ( ( pid = wait3( &status, WNOHANG, (struct rusage*) 0 ) ) > 0 )
+	for ( i = 0; i < hs->cgi_count; ++i )
+	    if ( hs->cgi_pids[i] == pid )
+		{
+		hs->cgi_pids[i] = hs->cgi_pids[--hs->cgi_count];
+		break;
+		}
+#endif /* HAVE_WAITPID */
+    }
+
+
 void
 httpd_unlisten( httpd_server* hs )
     {
@@ -554,7 +889,9 @@ add_response( httpd_conn* hc, char* str )
     size_t len;
 
     len = strlen( str );
-    httpd_realloc_str( &hc->response, &hc->maxresponse, hc->responselen + len );
+    borrow_str(
+	&response_pool, &hc->response, &hc->maxresponse,
+	hc->responselen + len );
     (void) memmove( &(hc->response[hc->responselen]), str, len );
     hc->responselen += len;
     }
@@ -607,29 +944,36 @@ httpd_clear_ndelay( int fd )
     }
 
 
+/* Makes multipart boundaries differ between responses. */
+static THREAD_LOCAL unsigned int boundary_count = 0;
+
 static void
 send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extraheads, char* type, off_t length, time_t mod )
     {
     time_t now, expires;
-    const char* rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
-    char nowbuf[100];
     char modbuf[100];
     char expbuf[100];
     char fixed_type[500];
+    char boundary[50];
     char buf[1000];
     int partial_content;
     int s100;
+    char* fileheads;
+    size_t start;
 
     hc->status = status;
     hc->bytes_to_send = length;
     if ( hc->mime_flag )
 	{
 	if ( status == 200 && hc->got_range &&
-	     ( hc->last_byte_index >= hc->first_byte_index ) &&
-	     ( ( hc->last_byte_index != length - 1 ) ||
-	       ( hc->first_byte_index != 0 ) ) &&
-	     ( hc->range_if == (time_t) -1 ||
-	       hc->range_if == hc->sb.st_mtime ) )
+	     ( hc->nranges > 1 ||
+	       ( ( hc->last_byte_index >= hc->first_byte_index ) &&
+		 ( ( hc->last_byte_index != length - 1 ) ||
+		   ( hc->first_byte_index != 0 ) ) ) ) &&
+	     ( hc->range_if_tag[0] != '\0' ?
+	       strcmp( hc->range_if_tag, hc->etag ) == 0 :
+	       ( hc->range_if == (time_t) -1 ||
+		 hc->range_if == hc->sb.st_mtime ) ) )
 	    {
 	    partial_content = 1;
 	    hc->status = status = 206;
@@ -639,48 +983,98 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
 	    {
 	    partial_content = 0;
 	    hc->got_range = 0;
+	    hc->nranges = 0;
 	    }
 
 	now = time( (time_t*) 0 );
 	if ( mod == (time_t) 0 )
 	    mod = now;
-	(void) strftime( nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime( &now ) );
-	(void) strftime( modbuf, sizeof(modbuf), rfc1123fmt, gmtime( &mod ) );
-	(void) my_snprintf(
-	    fixed_type, sizeof(fixed_type), type, hc->hs->charset );
+	/* The connection can only persist if the client can tell where
+	** this response ends.
+	*/
+	if ( length < 0 && status != 304 )
+	    hc->keep_alive = 0;
 	(void) my_snprintf( buf, sizeof(buf),
-	    "%.20s %d %s\015\012Server: %s\015\012Content-Type: %s\015\012Date: %s\015\012Last-Modified: %s\015\012Accept-Ranges: bytes\015\012Connection: close\015\012",
-	    hc->protocol, status, title, EXPOSED_SERVER_SOFTWARE, fixed_type,
-	    nowbuf, modbuf );
+	    "%.20s %d %s\015\012Server: %s\015\012Date: %s\015\012Connection: %s\015\012",
+	    hc->protocol, status, title, EXPOSED_SERVER_SOFTWARE,
+	    date_header( now ),
+	    hc->keep_alive ? "keep-alive" : "close" );
 	add_response( hc, buf );
-	s100 = status / 100;
-	if ( s100 != 2 && s100 != 3 )
-	    {
-	    (void) my_snprintf( buf, sizeof(buf),
-		"Cache-Control: no-cache,no-store\015\012" );
-	    add_response( hc, buf );
-	    }
-	if ( encodings[0] != '\0' )
-	    {
-	    (void) my_snprintf( buf, sizeof(buf),
-		"Content-Encoding: %s\015\012", encodings );
-	    add_response( hc, buf );
-	    }
-	if ( partial_content )
-	    {
-	    (void) my_snprintf( buf, sizeof(buf),
-		"Content-Range: bytes %lld-%lld/%lld\015\012Content-Length: %lld\015\012",
-		(long long) hc->first_byte_index,
-		(long long) hc->last_byte_index,
-		(long long) length,
-		(long long) ( hc->last_byte_index - hc->first_byte_index + 1 ) );
-	    add_response( hc, buf );
-	    }
-	else if ( length >= 0 )
+
+	/* A whole cached file keeps the lines that only depend on the file,
+	** Last-Modified included, so they don't have to be rebuilt on every
+	** hit.
+	*/
+	fileheads = (char*) 0;
+	if ( status == 200 && ! partial_content &&
+	     hc->file_address != (char*) 0 )
+	    fileheads = mmc_header(
+		hc->file_address, &hc->sb, hc->expnfilename );
+	if ( fileheads != (char*) 0 )
+	    add_response( hc, fileheads );
+	else
 	    {
+	    start = hc->responselen;
+	    rfc1123_date( mod, modbuf );
+	    (void) my_snprintf(
+		fixed_type, sizeof(fixed_type), type, hc->hs->charset );
+	    if ( partial_content && hc->nranges > 1 )
+		{
+		/* Several ranges go out as a multipart body, with the
+		** real type in each part's headers.
+		*/
+		(void) my_snprintf( boundary, sizeof(boundary),
+		    "%lx%lx%x", (long) now, (long) getpid(),
+		    ++boundary_count );
+		length = make_parts( hc, fixed_type, length, boundary );
+		hc->bytes_to_send = length;
+		(void) my_snprintf( fixed_type, sizeof(fixed_type),
+		    "multipart/byteranges; boundary=%s", boundary );
+		}
 	    (void) my_snprintf( buf, sizeof(buf),
-		"Content-Length: %lld\015\012", (long long) length );
+		"Content-Type: %s\015\012Last-Modified: %s\015\012Accept-Ranges: bytes\015\012",
+		fixed_type, modbuf );
 	    add_response( hc, buf );
+	    if ( hc->etag[0] != '\0' )
+		{
+		(void) my_snprintf( buf, sizeof(buf),
+		    "ETag: %s\015\012", hc->etag );
+		add_response( hc, buf );
+		}
+	    s100 = status / 100;
+	    if ( s100 != 2 && s100 != 3 )
+		{
+		(void) my_snprintf( buf, sizeof(buf),
+		    "Cache-Control: no-cache,no-store\015\012" );
+		add_response( hc, buf );
+		}
+	    if ( encodings[0] != '\0' )
+		{
+		(void) my_snprintf( buf, sizeof(buf),
+		    "Content-Encoding: %s\015\012", encodings );
+		add_response( hc, buf );
+		}
+	    if ( partial_content && hc->nranges == 1 )
+		{
+		(void) my_snprintf( buf, sizeof(buf),
+		    "Content-Range: bytes %lld-%lld/%lld\015\012Content-Length: %lld\015\012",
+		    (long long) hc->first_byte_index,
+		    (long long) hc->last_byte_index,
+		    (long long) length,
+		    (long long) ( hc->last_byte_index - hc->first_byte_index + 1 ) );
+		add_response( hc, buf );
+		}
+	    else if ( length >= 0 )
+		{
+		(void) my_snprintf( buf, sizeof(buf),
+		    "Content-Length: %lld\015\012", (long long) length );
+		add_response( hc, buf );
+		}
+	    if ( status == 200 && ! partial_content &&
+		 hc->file_address != (char*) 0 )
+		mmc_set_header(
+		    hc->file_address, &hc->sb, hc->expnfilename,
+		    &hc->response[start], hc->responselen - start );
 	    }
 	if ( hc->hs->p3p[0] != '\0' )
 	    {
@@ -690,8 +1084,7 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
 	if ( hc->hs->max_age >= 0 )
 	    {
 	    expires = now + hc->hs->max_age;
-	    (void) strftime(
-		expbuf, sizeof(expbuf), rfc1123fmt, gmtime( &expires ) );
+	    rfc1123_date( expires, expbuf );
 	    (void) my_snprintf( buf, sizeof(buf),
 		"Cache-Control: max-age=%d\015\012Expires: %s\015\012",
 		hc->hs->max_age, expbuf );
@@ -704,8 +1097,253 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
     }
 
 
-static int str_alloc_count = 0;
-static size_t str_alloc_size = 0;
+/* Formats an HTTP date, the same as strftime() with
+** "%a, %d %b %Y %H:%M:%S GMT" but without the locale machinery.  buf
+** must hold at least 30 characters.
+*/
+static void
+rfc1123_date( time_t t, char* buf )
+    {
+    static const char* day_names[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char* month_names[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    struct tm tm;
+    struct tm* tmP;
+    int year;
+
+    tmP = GMTIME( &t, &tm );
+    year = tmP->tm_year + 1900;
+    (void) memcpy( &buf[0], day_names[tmP->tm_wday], 3 );
+    buf[3] = ',';
+    buf[4] = ' ';
+    buf[5] = '0' + tmP->tm_mday / 10;
+    buf[6] = '0' + tmP->tm_mday % 10;
+    buf[7] = ' ';
+    (void) memcpy( &buf[8], month_names[tmP->tm_mon], 3 );
+    buf[11] = ' ';
+    buf[12] = '0' + year / 1000 % 10;
+    buf[13] = '0' + year / 100 % 10;
+    buf[14] = '0' + year / 10 % 10;
+    buf[15] = '0' + year % 10;
+    buf[16] = ' ';
+    buf[17] = '0' + tmP->tm_hour / 10;
+    buf[18] = '0' + tmP->tm_hour % 10;
+    buf[19] = ':';
+    buf[20] = '0' + tmP->tm_min / 10;
+    buf[21] = '0' + tmP->tm_min % 10;
+    buf[22] = ':';
+    buf[23] = '0' + tmP->tm_sec / 10;
+    buf[24] = '0' + tmP->tm_sec % 10;
+    (void) strcpy( &buf[25], " GMT" );
+    }
+
+
+/* Builds a strong entity tag for the file in hc->sb.  It changes
+** whenever the file is replaced or rewritten, down to the nanosecond
+** where the system keeps them.
+*/
+static void
+make_etag( httpd_conn* hc )
+    {
+    long nsec;
+
+#ifdef HAVE_ST_MTIM
+    nsec = (long) hc->sb.st_mtim.tv_nsec;
+#else /* HAVE_ST_MTIM */
+    nsec = 0;
+#endif /* HAVE_ST_MTIM */
+    (void) my_snprintf( hc->etag, sizeof(hc->etag), "\"%llx-%llx-%llx.%lx\"",
+	(unsigned long long) hc->sb.st_ino, (long long) hc->sb.st_size,
+	(long long) hc->sb.st_mtime, nsec );
+    }
+
+
+/* Parses the byte-range-set of a Range header: first-last, first- and
+** -suffix specs separated by commas.  A suffix is kept as a first byte
+** index of -1 and its length until the file size is known.  If any spec
+** is malformed or there are more than MAX_BYTE_RANGES of them, the whole
+** header is ignored.
+*/
+static void
+parse_ranges( httpd_conn* hc, char* cp )
+    {
+    int n;
+    off_t first, last;
+
+    n = 0;
+    for (;;)
+	{
+	cp += strspn( cp, " \t" );
+	if ( *cp == '-' && isdigit( (int) cp[1] ) )
+	    {
+	    first = -1;
+	    last = atoll( cp + 1 );
+	    cp += 1 + strspn( cp + 1, "0123456789" );
+	    }
+	else if ( isdigit( (int) *cp ) )
+	    {
+	    first = atoll( cp );
+	    cp += strspn( cp, "0123456789" );
+	    if ( *cp != '-' )
+		return;
+	    ++cp;
+	    if ( isdigit( (int) *cp ) )
+		{
+		last = atoll( cp );
+		cp += strspn( cp, "0123456789" );
+		if ( last < first )
+		    return;
+		}
+	    else
+		last = -1;
+	    }
+	else
+	    return;
+	if ( first < -1 || last < -1 || n == MAX_BYTE_RANGES )
+	    return;
+	hc->range_first[n] = first;
+	hc->range_last[n] = last;
+	++n;
+	cp += strspn( cp, " \t" );
+	if ( *cp == '\0' )
+	    break;
+	if ( *cp != ',' )
+	    return;
+	++cp;
+	}
+    hc->nranges = n;
+    }
+
+
+/* Fits the requested ranges to the file, dropping any that start past
+** its end.  If some are left, got_range gets set, and the first one
+** also goes in first_byte_index and last_byte_index.
+*/
+static void
+resolve_ranges( httpd_conn* hc )
+    {
+    int i, n;
+    off_t first, last;
+
+    n = 0;
+    for ( i = 0; i < hc->nranges; ++i )
+	{
+	first = hc->range_first[i];
+	last = hc->range_last[i];
+	if ( first == -1 )
+	    {
+	    if ( last == 0 )
+		continue;
+	    first = MAX( hc->sb.st_size - last, 0 );
+	    last = hc->sb.st_size - 1;
+	    }
+	else if ( last == -1 || last >= hc->sb.st_size )
+	    last = hc->sb.st_size - 1;
+	if ( first > last )
+	    continue;
+	hc->range_first[n] = first;
+	hc->range_last[n] = last;
+	++n;
+	}
+    hc->nranges = n;
+    hc->got_range = ( n > 0 );
+    if ( hc->got_range )
+	{
+	hc->first_byte_index = hc->range_first[0];
+	hc->last_byte_index = hc->range_last[0];
+	}
+    }
+
+
+/* Lays out a multipart/byteranges body.  The boundary and headers in
+** front of each part, and the closing boundary, go in hc->parts, with
+** part_text[] saying where each one starts.  Returns the length of the
+** whole body.
+*/
+static off_t
+make_parts( httpd_conn* hc, char* type, off_t size, char* boundary )
+    {
+    char buf[1000];
+    size_t len, textlen;
+    off_t total;
+    int i;
+
+    textlen = 0;
+    total = 0;
+    for ( i = 0; i <= hc->nranges; ++i )
+	{
+	if ( i < hc->nranges )
+	    (void) my_snprintf( buf, sizeof(buf),
+		"\015\012--%s\015\012Content-Type: %s\015\012Content-Range: bytes %lld-%lld/%lld\015\012\015\012",
+		boundary, type, (long long) hc->range_first[i],
+		(long long) hc->range_last[i], (long long) size );
+	else
+	    (void) my_snprintf( buf, sizeof(buf),
+		"\015\012--%s--\015\012", boundary );
+	len = strlen( buf );
+	httpd_realloc_str( &hc->parts, &hc->maxparts, textlen + len );
+	(void) memcpy( &hc->parts[textlen], buf, len );
+	hc->part_text[i] = textlen;
+	textlen += len;
+	total += len;
+	if ( i < hc->nranges )
+	    total += hc->range_last[i] - hc->range_first[i] + 1;
+	}
+    hc->part_text[hc->nranges + 1] = textlen;
+    return total;
+    }
+
+
+/* Checks an If-None-Match list against an entity tag.  This is the weak
+** comparison, so a W/ prefix is ignored, and "*" matches anything.
+*/
+static int
+etag_match( char* list, char* etag )
+    {
+    char* cp;
+    size_t len, etaglen;
+
+    etaglen = strlen( etag );
+    cp = list;
+    for (;;)
+	{
+	cp += strspn( cp, " \t," );
+	if ( *cp == '\0' )
+	    return 0;
+	if ( *cp == '*' )
+	    return 1;
+	if ( strncmp( cp, "W/", 2 ) == 0 )
+	    cp += 2;
+	len = strcspn( cp, " \t," );
+	if ( len == etaglen && strncmp( cp, etag, len ) == 0 )
+	    return 1;
+	cp += len;
+	}
+    }
+
+
+/* The Date header only changes once a second, so each thread keeps
+** the last one it formatted.
+*/
+static THREAD_LOCAL time_t date_time = (time_t) -1;
+static THREAD_LOCAL char date_buf[30];
+
+static char*
+date_header( time_t now )
+    {
+    if ( now != date_time )
+	{
+	rfc1123_date( now, date_buf );
+	date_time = now;
+	}
+    return date_buf;
+    }
+
+
+static THREAD_LOCAL int str_alloc_count = 0;
+static THREAD_LOCAL size_t str_alloc_size = 0;
 
 void
 httpd_realloc_str( char** strP, size_t* maxsizeP, size_t size )
@@ -736,6 +1374,169 @@ httpd_realloc_str( char** strP, size_t* maxsizeP, size_t size )
     }
 
 
+/* The strings that only live as long as one request - the decoded URL,
+** query, host names, remote user and so on - are carved from a block
+** belonging to the connection.  That's just a pointer bump, and they all
+** get thrown away together when the next request starts.  A request
+** that needs more than the block holds spills into extra chunks, and
+** the block then grows so the next one like it fits.
+*/
+#define ARENA_SIZE 2000
+
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    } arena_chunk;
+
+static char*
+arena_alloc( httpd_conn* hc, size_t size )
+    {
+    arena_chunk* ch;
+    char* p;
+
+    if ( size <= hc->arena_size - hc->arena_used )
+	{
+	p = &hc->arena[hc->arena_used];
+	hc->arena_used += size;
+	return p;
+	}
+    ch = (arena_chunk*) malloc( sizeof(arena_chunk) + size );
+    if ( ch == (arena_chunk*) 0 )
+	{
+	syslog(
+	    LOG_ERR, "out of memory allocating %ld bytes for a request",
+	    (long) size );
+	exit( 1 );
+	}
+    ch->next = (arena_chunk*) hc->arena_extra;
+    hc->arena_extra = (void*) ch;
+    hc->arena_spill += size;
+    return (char*) ( ch + 1 );
+    }
+
+
+static char*
+arena_strdup( httpd_conn* hc, char* str )
+    {
+    char* p;
+
+    p = arena_alloc( hc, strlen( str ) + 1 );
+    (void) strcpy( p, str );
+    return p;
+    }
+
+
+/* Returns list and item joined into a comma-separated list. */
+static char*
+join_list( httpd_conn* hc, char* list, char* item )
+    {
+    size_t size;
+    char* p;
+
+    size = strlen( list ) + 2 + strlen( item ) + 1;
+    p = arena_alloc( hc, size );
+    (void) my_snprintf( p, size, "%s, %s", list, item );
+    return p;
+    }
+
+
+static void
+arena_reset( httpd_conn* hc )
+    {
+    arena_chunk* ch;
+
+    if ( hc->arena_extra != (void*) 0 )
+	{
+	while ( hc->arena_extra != (void*) 0 )
+	    {
+	    ch = (arena_chunk*) hc->arena_extra;
+	    hc->arena_extra = (void*) ch->next;
+	    free( (void*) ch );
+	    }
+	str_alloc_size -= hc->arena_size;
+	hc->arena_size = hc->arena_used + hc->arena_spill;
+	hc->arena = RENEW( hc->arena, char, hc->arena_size );
+	if ( hc->arena == (char*) 0 )
+	    {
+	    syslog(
+		LOG_ERR, "out of memory growing a request arena to %ld bytes",
+		(long) hc->arena_size );
+	    exit( 1 );
+	    }
+	str_alloc_size += hc->arena_size;
+	hc->arena_spill = 0;
+	}
+    hc->arena_used = 0;
+    }
+
+
+static void
+borrow_str( buf_pool* bp, char** strP, size_t* maxsizeP, size_t size )
+    {
+    pool_buf* pb;
+
+    if ( *maxsizeP == 0 )
+	{
+	++bp->lent;
+	if ( bp->free != (pool_buf*) 0 )
+	    {
+	    pb = bp->free;
+	    bp->free = pb->next;
+	    --bp->count;
+	    bp->size -= pb->size;
+	    *strP = (char*) pb;
+	    *maxsizeP = pb->size;
+	    }
+	}
+    httpd_realloc_str( strP, maxsizeP, size );
+    }
+
+
+void
+httpd_borrow_read_buf( httpd_conn* hc, size_t size )
+    {
+    borrow_str( &read_pool, &hc->read_buf, &hc->read_size, size );
+    }
+
+
+static void
+return_str( buf_pool* bp, char** strP, size_t* maxsizeP )
+    {
+    pool_buf* pb;
+
+    if ( *maxsizeP == 0 )
+	return;
+    --bp->lent;
+    /* A buffer that grew for some unusual request isn't worth keeping. */
+    if ( bp->count < BUFFER_POOL_SIZE && *maxsizeP <= BUFFER_POOL_MAX_BUF )
+	{
+	pb = (pool_buf*) *strP;
+	pb->size = *maxsizeP;
+	pb->next = bp->free;
+	bp->free = pb;
+	++bp->count;
+	bp->size += pb->size;
+	}
+    else
+	{
+	free( (void*) *strP );
+	--str_alloc_count;
+	str_alloc_size -= *maxsizeP;
+	}
+    *strP = (char*) 0;
+    *maxsizeP = 0;
+    }
+
+
+void
+httpd_idle_conn( httpd_conn* hc )
+    {
+    if ( hc->read_idx == 0 )
+	return_str( &read_pool, &hc->read_buf, &hc->read_size );
+    if ( hc->responselen == 0 )
+	return_str( &response_pool, &hc->response, &hc->maxresponse );
+    }
+
+
 static void
 send_response( httpd_conn* hc, int status, char* title, char* extraheads, char* form, char* arg )
     {
@@ -896,8 +1697,8 @@ send_err_file( httpd_conn* hc, int status, char* title, char* extraheads, char*
 static void
 send_authenticate( httpd_conn* hc, char* realm )
     {
-    static char* header;
-    static size_t maxheader = 0;
+    static THREAD_LOCAL char* header;
+    static THREAD_LOCAL size_t maxheader = 0;
     static char headstr[] = "WWW-Authenticate: Basic realm=\"";
 
     httpd_realloc_str(
@@ -1020,8 +1821,8 @@ auth_check( httpd_conn* hc, char* dirname  )
 static int
 auth_check2( httpd_conn* hc, char* dirname  )
     {
-    static char* authpath;
-    static size_t maxauthpath = 0;
+    static THREAD_LOCAL char* authpath;
+    static THREAD_LOCAL size_t maxauthpath = 0;
     struct stat sb;
     char authinfo[500];
     char* authpass;
@@ -1030,13 +1831,13 @@ auth_check2( httpd_conn* hc, char* dirname  )
     FILE* fp;
     char line[500];
     char* cryp;
-    static char* prevauthpath;
-    static size_t maxprevauthpath = 0;
-    static time_t prevmtime;
-    static char* prevuser;
-    static size_t maxprevuser = 0;
-    static char* prevcryp;
-    static size_t maxprevcryp = 0;
+    static THREAD_LOCAL char* prevauthpath;
+    static THREAD_LOCAL size_t maxprevauthpath = 0;
+    static THREAD_LOCAL time_t prevmtime;
+    static THREAD_LOCAL char* prevuser;
+    static THREAD_LOCAL size_t maxprevuser = 0;
+    static THREAD_LOCAL char* prevcryp;
+    static THREAD_LOCAL size_t maxprevcryp = 0;
 
     /* Construct auth filename. */
     httpd_realloc_str(
@@ -1044,7 +1845,7 @@ auth_check2( httpd_conn* hc, char* dirname  )
     (void) my_snprintf( authpath, maxauthpath, "%s/%s", dirname, AUTH_FILE );
 
     /* Does this directory have an auth file? */
-    if ( stat( authpath, &sb ) < 0 )
+    if ( stc_stat( authpath, &sb, (struct timeval*) 0 ) < 0 )
 	/* Nope, let the request go through. */
 	return 0;
 
@@ -1086,9 +1887,7 @@ auth_check2( httpd_conn* hc, char* dirname  )
 	if ( strcmp( crypt( authpass, prevcryp ), prevcryp ) == 0 )
 	    {
 	    /* Ok! */
-	    httpd_realloc_str(
-		&hc->remoteuser, &hc->maxremoteuser, strlen( authinfo ) );
-	    (void) strcpy( hc->remoteuser, authinfo );
+	    hc->remoteuser = arena_strdup( hc, authinfo );
 	    return 1;
 	    }
 	else
@@ -1135,9 +1934,7 @@ auth_check2( httpd_conn* hc, char* dirname  )
 	    if ( strcmp( crypt( authpass, cryp ), cryp ) == 0 )
 		{
 		/* Ok! */
-		httpd_realloc_str(
-		    &hc->remoteuser, &hc->maxremoteuser, strlen( line ) );
-		(void) strcpy( hc->remoteuser, line );
+		hc->remoteuser = arena_strdup( hc, line );
 		/* And cache this user's info for next time. */
 		httpd_realloc_str(
 		    &prevauthpath, &maxprevauthpath, strlen( authpath ) );
@@ -1171,9 +1968,9 @@ auth_check2( httpd_conn* hc, char* dirname  )
 static void
 send_dirredirect( httpd_conn* hc )
     {
-    static char* location;
-    static char* header;
-    static size_t maxlocation = 0, maxheader = 0;
+    static THREAD_LOCAL char* location;
+    static THREAD_LOCAL char* header;
+    static THREAD_LOCAL size_t maxlocation = 0, maxheader = 0;
     static char headstr[] = "Location: ";
 
     if ( hc->query[0] != '\0')
@@ -1280,8 +2077,8 @@ strencode( char* to, int tosize, char* from )
 static int
 tilde_map_1( httpd_conn* hc )
     {
-    static char* temp;
-    static size_t maxtemp = 0;
+    static THREAD_LOCAL char* temp;
+    static THREAD_LOCAL size_t maxtemp = 0;
     int len;
     static char* prefix = TILDE_MAP_1;
 
@@ -1303,8 +2100,8 @@ tilde_map_1( httpd_conn* hc )
 static int
 tilde_map_2( httpd_conn* hc )
     {
-    static char* temp;
-    static size_t maxtemp = 0;
+    static THREAD_LOCAL char* temp;
+    static THREAD_LOCAL size_t maxtemp = 0;
     static char* postfix = TILDE_MAP_2;
     char* cp;
     struct passwd* pw;
@@ -1362,8 +2159,8 @@ vhost_map( httpd_conn* hc )
     {
     httpd_sockaddr sa;
     socklen_t sz;
-    static char* tempfilename;
-    static size_t maxtempfilename = 0;
+    static THREAD_LOCAL char* tempfilename;
+    static THREAD_LOCAL size_t maxtempfilename = 0;
     char* cp1;
     int len;
 #ifdef VHOST_DIRLEVELS
@@ -1396,9 +2193,8 @@ vhost_map( httpd_conn* hc )
 
     /* Figure out the host directory. */
 #ifdef VHOST_DIRLEVELS
-    httpd_realloc_str(
-	&hc->hostdir, &hc->maxhostdir,
-	strlen( hc->hostname ) + 2 * VHOST_DIRLEVELS );
+    hc->hostdir = arena_alloc(
+	hc, strlen( hc->hostname ) + 2 * VHOST_DIRLEVELS + 1 );
     if ( strncmp( hc->hostname, "www.", 4 ) == 0 )
 	cp1 = &hc->hostname[4];
     else
@@ -1423,8 +2219,7 @@ vhost_map( httpd_conn* hc )
 	}
     (void) strcpy( cp2, hc->hostname );
 #else /* VHOST_DIRLEVELS */
-    httpd_realloc_str( &hc->hostdir, &hc->maxhostdir, strlen( hc->hostname ) );
-    (void) strcpy( hc->hostdir, hc->hostname );
+    hc->hostdir = arena_strdup( hc, hc->hostname );
 #endif /* VHOST_DIRLEVELS */
 
     /* Prepend hostdir to the filename. */
@@ -1444,18 +2239,40 @@ vhost_map( httpd_conn* hc )
 /* Expands all symlinks in the given filename, eliding ..'s and leading /'s.
 ** Returns the expanded path (pointer to static string), or (char*) 0 on
 ** errors.  Also returns, in the string pointed to by restP, any trailing
-** parts of the path that don't exist.
+** parts of the path that don't exist.  Both strings must be copied
+** before the next call.
 **
-** This is a fairly nice little routine.  It handles any size filenames
-** without excessive mallocs.
+** Recent expansions come from the stat cache.
 */
 static char*
 expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped )
     {
-    static char* checked;
-    static char* rest;
+    char* checked;
+    int flags;
+
+    flags = ( no_symlink_check ? 1 : 0 ) | ( tildemapped ? 2 : 0 );
+    if ( stc_get_expansion(
+	     path, flags, &checked, restP, (struct timeval*) 0 ) )
+	return checked;
+    checked = really_expand_symlinks(
+	path, restP, no_symlink_check, tildemapped );
+    if ( checked != (char*) 0 )
+	stc_put_expansion(
+	    path, flags, checked, *restP, (struct timeval*) 0 );
+    return checked;
+    }
+
+
+/* This is a fairly nice little routine.  It handles any size filenames
+** without excessive mallocs.
+*/
+static char*
+really_expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped )
+    {
+    static THREAD_LOCAL char* checked;
+    static THREAD_LOCAL char* rest;
     char lnk[5000];
-    static size_t maxchecked = 0, maxrest = 0;
+    static THREAD_LOCAL size_t maxchecked = 0, maxrest = 0;
     size_t checkedlen, restlen, linklen, prevcheckedlen, prevrestlen;
     int nlinks, i;
     char* r;
@@ -1676,31 +2493,32 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 
     if ( ! hc->initialized )
 	{
+	/* The read and response buffers get borrowed when needed. */
+	hc->read_buf = hc->response = (char*) 0;
 	hc->read_size = 0;
-	httpd_realloc_str( &hc->read_buf, &hc->read_size, 500 );
-	hc->maxdecodedurl =
-	    hc->maxorigfilename = hc->maxexpnfilename = hc->maxencodings =
-	    hc->maxpathinfo = hc->maxquery = hc->maxaccept =
-	    hc->maxaccepte = hc->maxreqhost = hc->maxhostdir =
-	    hc->maxremoteuser = hc->maxresponse = 0;
+	hc->maxexpnfilename = hc->maxencodings = hc->maxpathinfo =
+	    hc->maxresponse = hc->maxparts = 0;
 #ifdef TILDE_MAP_2
 	hc->maxaltdir = 0;
 #endif /* TILDE_MAP_2 */
-	httpd_realloc_str( &hc->decodedurl, &hc->maxdecodedurl, 1 );
-	httpd_realloc_str( &hc->origfilename, &hc->maxorigfilename, 1 );
 	httpd_realloc_str( &hc->expnfilename, &hc->maxexpnfilename, 0 );
 	httpd_realloc_str( &hc->encodings, &hc->maxencodings, 0 );
 	httpd_realloc_str( &hc->pathinfo, &hc->maxpathinfo, 0 );
-	httpd_realloc_str( &hc->query, &hc->maxquery, 0 );
-	httpd_realloc_str( &hc->accept, &hc->maxaccept, 0 );
-	httpd_realloc_str( &hc->accepte, &hc->maxaccepte, 0 );
-	httpd_realloc_str( &hc->reqhost, &hc->maxreqhost, 0 );
-	httpd_realloc_str( &hc->hostdir, &hc->maxhostdir, 0 );
-	httpd_realloc_str( &hc->remoteuser, &hc->maxremoteuser, 0 );
-	httpd_realloc_str( &hc->response, &hc->maxresponse, 0 );
+	httpd_realloc_str( &hc->parts, &hc->maxparts, 0 );
 #ifdef TILDE_MAP_2
 	httpd_realloc_str( &hc->altdir, &hc->maxaltdir, 0 );
 #endif /* TILDE_MAP_2 */
+	hc->arena_size = ARENA_SIZE;
+	hc->arena = NEW( char, hc->arena_size );
+	if ( hc->arena == (char*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory allocating a request arena" );
+	    exit( 1 );
+	    }
+	++str_alloc_count;
+	str_alloc_size += hc->arena_size;
+	hc->arena_used = hc->arena_spill = 0;
+	hc->arena_extra = (void*) 0;
 	hc->initialized = 1;
 	}
 
@@ -1730,6 +2548,20 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
     (void) memset( &hc->client_addr, 0, sizeof(hc->client_addr) );
     (void) memmove( &hc->client_addr, &sa, sockaddr_len( &sa ) );
     hc->read_idx = 0;
+    hc->responselen = 0;
+    init_request( hc );
+    return GC_OK;
+    }
+
+
+/* Sets up the per-request fields of an httpd_conn.  The read buffer and
+** the response buffer belong to the connection, since with pipelining
+** they can hold data for more than one request.
+*/
+static void
+init_request( httpd_conn* hc )
+    {
+    arena_reset( hc );
     hc->checked_idx = 0;
     hc->checked_state = CHST_FIRSTWORD;
     hc->method = METHOD_UNKNOWN;
@@ -1737,30 +2569,30 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
     hc->bytes_to_send = 0;
     hc->bytes_sent = 0;
     hc->encodedurl = "";
-    hc->decodedurl[0] = '\0';
+    hc->decodedurl = "";
     hc->protocol = "UNKNOWN";
-    hc->origfilename[0] = '\0';
+    hc->origfilename = "";
     hc->expnfilename[0] = '\0';
     hc->encodings[0] = '\0';
     hc->pathinfo[0] = '\0';
-    hc->query[0] = '\0';
+    hc->query = "";
     hc->referrer = "";
     hc->useragent = "";
-    hc->accept[0] = '\0';
-    hc->accepte[0] = '\0';
+    hc->accept = "";
+    hc->accepte = "";
     hc->acceptl = "";
     hc->cookie = "";
     hc->contenttype = "";
-    hc->reqhost[0] = '\0';
+    hc->if_none_match = "";
+    hc->range_if_tag = "";
+    hc->reqhost = "";
     hc->hdrhost = "";
-    hc->hostdir[0] = '\0';
+    hc->hostdir = "";
     hc->authorization = "";
-    hc->remoteuser[0] = '\0';
-    hc->response[0] = '\0';
+    hc->remoteuser = "";
 #ifdef TILDE_MAP_2
     hc->altdir[0] = '\0';
 #endif /* TILDE_MAP_2 */
-    hc->responselen = 0;
     hc->if_modified_since = (time_t) -1;
     hc->range_if = (time_t) -1;
     hc->contentlength = -1;
@@ -1772,10 +2604,13 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
     hc->tildemapped = 0;
     hc->first_byte_index = 0;
     hc->last_byte_index = -1;
+    hc->nranges = 0;
     hc->keep_alive = 0;
     hc->should_linger = 0;
+    hc->etag[0] = '\0';
     hc->file_address = (char*) 0;
-    return GC_OK;
+    hc->file_fd = -1;
+    hc->window_address = (char*) 0;
     }
 
 
@@ -1876,6 +2711,14 @@ httpd_got_request( httpd_conn* hc )
 		}
 	    break;
 	    case CHST_LINE:
+	    /* Most of a request is the middle of header lines, so skip
+	    ** right to the end of this one.
+	    */
+	    hc->checked_idx = scan_eol(
+		hc->read_buf, hc->checked_idx, hc->read_idx );
+	    if ( hc->checked_idx == hc->read_idx )
+		return GR_NO_REQUEST;
+	    c = hc->read_buf[hc->checked_idx];
 	    switch ( c )
 		{
 		case '\012':
@@ -1958,8 +2801,11 @@ httpd_parse_request( httpd_conn* hc )
     char* eol;
     char* cp;
     char* pi;
+    size_t len;
+    int conn_close;
 
     hc->checked_idx = 0;	/* reset */
+    conn_close = 0;
     method_str = bufgets( hc );
     url = strpbrk( method_str, " \t\012\015" );
     if ( url == (char*) 0 )
@@ -2011,8 +2857,7 @@ httpd_parse_request( httpd_conn* hc )
 	    httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 	    return -1;
 	    }
-	httpd_realloc_str( &hc->reqhost, &hc->maxreqhost, strlen( reqhost ) );
-	(void) strcpy( hc->reqhost, reqhost );
+	hc->reqhost = arena_strdup( hc, reqhost );
 	*url = '/';
 	}
 
@@ -2035,12 +2880,11 @@ httpd_parse_request( httpd_conn* hc )
 	}
 
     hc->encodedurl = url;
-    httpd_realloc_str(
-	&hc->decodedurl, &hc->maxdecodedurl, strlen( hc->encodedurl ) );
+    hc->decodedurl = arena_alloc( hc, strlen( hc->encodedurl ) + 1 );
     strdecode( hc->decodedurl, hc->encodedurl );
 
-    httpd_realloc_str(
-	&hc->origfilename, &hc->maxorigfilename, strlen( hc->decodedurl ) );
+    /* Room for at least "." */
+    hc->origfilename = arena_alloc( hc, strlen( hc->decodedurl ) + 1 );
     (void) strcpy( hc->origfilename, &hc->decodedurl[1] );
     /* Special case for top-level URL. */
     if ( hc->origfilename[0] == '\0' )
@@ -2051,8 +2895,7 @@ httpd_parse_request( httpd_conn* hc )
     if ( cp != (char*) 0 )
 	{
 	++cp;
-	httpd_realloc_str( &hc->query, &hc->maxquery, strlen( cp ) );
-	(void) strcpy( hc->query, cp );
+	hc->query = arena_strdup( hc, cp );
 	/* Remove query from (decoded) origfilename. */
 	cp = strchr( hc->origfilename, '?' );
 	if ( cp != (char*) 0 )
@@ -2075,27 +2918,23 @@ httpd_parse_request( httpd_conn* hc )
 	    {
 	    if ( buf[0] == '\0' )
 		break;
-	    if ( strncasecmp( buf, "Referer:", 8 ) == 0 )
-		{
-		cp = &buf[8];
-		cp += strspn( cp, " \t" );
-		hc->referrer = cp;
-		}
-	    else if ( strncasecmp( buf, "Referrer:", 9 ) == 0 )
+	    cp = strchr( buf, ':' );
+	    if ( cp == (char*) 0 )
+		continue;
+	    switch ( header_id( buf, cp - buf ) )
 		{
-		cp = &buf[9];
+		case HDR_REFERER:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->referrer = cp;
-		}
-	    else if ( strncasecmp( buf, "User-Agent:", 11 ) == 0 )
-		{
-		cp = &buf[11];
+		break;
+		case HDR_USER_AGENT:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->useragent = cp;
-		}
-	    else if ( strncasecmp( buf, "Host:", 5 ) == 0 )
-		{
-		cp = &buf[5];
+		break;
+		case HDR_HOST:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->hdrhost = cp;
 		cp = strchr( hc->hdrhost, ':' );
@@ -2106,10 +2945,12 @@ httpd_parse_request( httpd_conn* hc )
 		    httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 		    return -1;
 		    }
-		}
-	    else if ( strncasecmp( buf, "Accept:", 7 ) == 0 )
-		{
-		cp = &buf[7];
+		break;
+		case HDR_ACCEPT:
+		/* Usually there's just one, which can stay where it is.
+		** Repeats get joined up in the arena.
+		*/
+		++cp;
 		cp += strspn( cp, " \t" );
 		if ( hc->accept[0] != '\0' )
 		    {
@@ -2120,19 +2961,13 @@ httpd_parse_request( httpd_conn* hc )
 			    httpd_ntoa( &hc->client_addr ) );
 			continue;
 			}
-		    httpd_realloc_str(
-			&hc->accept, &hc->maxaccept,
-			strlen( hc->accept ) + 2 + strlen( cp ) );
-		    (void) strcat( hc->accept, ", " );
+		    hc->accept = join_list( hc, hc->accept, cp );
 		    }
 		else
-		    httpd_realloc_str(
-			&hc->accept, &hc->maxaccept, strlen( cp ) );
-		(void) strcat( hc->accept, cp );
-		}
-	    else if ( strncasecmp( buf, "Accept-Encoding:", 16 ) == 0 )
-		{
-		cp = &buf[16];
+		    hc->accept = cp;
+		break;
+		case HDR_ACCEPT_ENCODING:
+		++cp;
 		cp += strspn( cp, " \t" );
 		if ( hc->accepte[0] != '\0' )
 		    {
@@ -2143,131 +2978,132 @@ httpd_parse_request( httpd_conn* hc )
 			    httpd_ntoa( &hc->client_addr ) );
 			continue;
 			}
-		    httpd_realloc_str(
-			&hc->accepte, &hc->maxaccepte,
-			strlen( hc->accepte ) + 2 + strlen( cp ) );
-		    (void) strcat( hc->accepte, ", " );
+		    hc->accepte = join_list( hc, hc->accepte, cp );
 		    }
 		else
-		    httpd_realloc_str(
-			&hc->accepte, &hc->maxaccepte, strlen( cp ) );
-		(void) strcpy( hc->accepte, cp );
-		}
-	    else if ( strncasecmp( buf, "Accept-Language:", 16 ) == 0 )
-		{
-		cp = &buf[16];
+		    hc->accepte = cp;
+		break;
+		case HDR_ACCEPT_LANGUAGE:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->acceptl = cp;
-		}
-	    else if ( strncasecmp( buf, "If-Modified-Since:", 18 ) == 0 )
-		{
-		cp = &buf[18];
+		break;
+		case HDR_IF_MODIFIED_SINCE:
+		++cp;
 		hc->if_modified_since = tdate_parse( cp );
 		if ( hc->if_modified_since == (time_t) -1 )
 		    syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
-		}
-	    else if ( strncasecmp( buf, "Cookie:", 7 ) == 0 )
-		{
-		cp = &buf[7];
+		break;
+		case HDR_IF_NONE_MATCH:
+		++cp;
+		cp += strspn( cp, " \t" );
+		hc->if_none_match = cp;
+		break;
+		case HDR_COOKIE:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->cookie = cp;
-		}
-	    else if ( strncasecmp( buf, "Range:", 6 ) == 0 )
-		{
-		/* Only support %d- and %d-%d, not %d-%d,%d-%d or -%d. */
-		if ( strchr( buf, ',' ) == (char*) 0 )
+		break;
+		case HDR_RANGE:
+		++cp;
+		cp += strspn( cp, " \t" );
+		if ( strncasecmp( cp, "bytes=", 6 ) == 0 )
+		    parse_ranges( hc, &cp[6] );
+		break;
+		case HDR_IF_RANGE:
+		++cp;
+		cp += strspn( cp, " \t" );
+		/* Either an entity tag or a date. */
+		if ( *cp == '"' || strncmp( cp, "W/", 2 ) == 0 )
 		    {
-		    char* cp_dash;
-		    cp = strpbrk( buf, "=" );
-		    if ( cp != (char*) 0 )
-			{
-			cp_dash = strchr( cp + 1, '-' );
-			if ( cp_dash != (char*) 0 && cp_dash != cp + 1 )
-			    {
-			    *cp_dash = '\0';
-			    hc->got_range = 1;
-			    hc->first_byte_index = atoll( cp + 1 );
-			    if ( hc->first_byte_index < 0 )
-				hc->first_byte_index = 0;
-			    if ( isdigit( (int) cp_dash[1] ) )
-				{
-				hc->last_byte_index = atoll( cp_dash + 1 );
-				if ( hc->last_byte_index < 0 )
-				    hc->last_byte_index = -1;
-				}
-			    }
-			}
+		    cp[strcspn( cp, " \t" )] = '\0';
+		    hc->range_if_tag = cp;
 		    }
-		}
-	    else if ( strncasecmp( buf, "Range-If:", 9 ) == 0 ||
-		      strncasecmp( buf, "If-Range:", 9 ) == 0 )
-		{
-		cp = &buf[9];
-		hc->range_if = tdate_parse( cp );
-		if ( hc->range_if == (time_t) -1 )
-		    syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
-		}
-	    else if ( strncasecmp( buf, "Content-Type:", 13 ) == 0 )
-		{
-		cp = &buf[13];
+		else
+		    {
+		    hc->range_if = tdate_parse( cp );
+		    if ( hc->range_if == (time_t) -1 )
+			syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
+		    }
+		break;
+		case HDR_CONTENT_TYPE:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->contenttype = cp;
-		}
-	    else if ( strncasecmp( buf, "Content-Length:", 15 ) == 0 )
-		{
-		cp = &buf[15];
+		break;
+		case HDR_CONTENT_LENGTH:
+		++cp;
 		hc->contentlength = atol( cp );
-		}
-	    else if ( strncasecmp( buf, "Authorization:", 14 ) == 0 )
-		{
-		cp = &buf[14];
+		break;
+		case HDR_AUTHORIZATION:
+		++cp;
 		cp += strspn( cp, " \t" );
 		hc->authorization = cp;
-		}
-	    else if ( strncasecmp( buf, "Connection:", 11 ) == 0 )
-		{
-		cp = &buf[11];
-		cp += strspn( cp, " \t" );
-		if ( strcasecmp( cp, "keep-alive" ) == 0 )
-		    hc->keep_alive = 1;
-		}
+		break;
+		case HDR_CONNECTION:
+		/* This is a comma-separated list of tokens. */
+		++cp;
+		for (;;)
+		    {
+		    cp += strspn( cp, " \t," );
+		    if ( *cp == '\0' )
+			break;
+		    len = strcspn( cp, " \t," );
+		    if ( len == 10 && strncasecmp( cp, "keep-alive", 10 ) == 0 )
+			hc->keep_alive = 1;
+		    else if ( len == 5 && strncasecmp( cp, "close", 5 ) == 0 )
+			conn_close = 1;
+		    cp += len;
+		    }
+		break;
 #ifdef LOG_UNKNOWN_HEADERS
-	    else if ( strncasecmp( buf, "Accept-Charset:", 15 ) == 0 ||
-		      strncasecmp( buf, "Accept-Language:", 16 ) == 0 ||
-		      strncasecmp( buf, "Agent:", 6 ) == 0 ||
-		      strncasecmp( buf, "Cache-Control:", 14 ) == 0 ||
-		      strncasecmp( buf, "Cache-Info:", 11 ) == 0 ||
-		      strncasecmp( buf, "Charge-To:", 10 ) == 0 ||
-		      strncasecmp( buf, "Client-IP:", 10 ) == 0 ||
-		      strncasecmp( buf, "Date:", 5 ) == 0 ||
-		      strncasecmp( buf, "Extension:", 10 ) == 0 ||
-		      strncasecmp( buf, "Forwarded:", 10 ) == 0 ||
-		      strncasecmp( buf, "From:", 5 ) == 0 ||
-		      strncasecmp( buf, "HTTP-Version:", 13 ) == 0 ||
-		      strncasecmp( buf, "Max-Forwards:", 13 ) == 0 ||
-		      strncasecmp( buf, "Message-Id:", 11 ) == 0 ||
-		      strncasecmp( buf, "MIME-Version:", 13 ) == 0 ||
-		      strncasecmp( buf, "Negotiate:", 10 ) == 0 ||
-		      strncasecmp( buf, "Pragma:", 7 ) == 0 ||
-		      strncasecmp( buf, "Proxy-Agent:", 12 ) == 0 ||
-		      strncasecmp( buf, "Proxy-Connection:", 17 ) == 0 ||
-		      strncasecmp( buf, "Security-Scheme:", 16 ) == 0 ||
-		      strncasecmp( buf, "Session-Id:", 11 ) == 0 ||
-		      strncasecmp( buf, "UA-Color:", 9 ) == 0 ||
-		      strncasecmp( buf, "UA-CPU:", 7 ) == 0 ||
-		      strncasecmp( buf, "UA-Disp:", 8 ) == 0 ||
-		      strncasecmp( buf, "UA-OS:", 6 ) == 0 ||
-		      strncasecmp( buf, "UA-Pixels:", 10 ) == 0 ||
-		      strncasecmp( buf, "User:", 5 ) == 0 ||
-		      strncasecmp( buf, "Via:", 4 ) == 0 ||
-		      strncasecmp( buf, "X-", 2 ) == 0 )
-		; /* ignore */
-	    else
-		syslog( LOG_DEBUG, "unknown request header: %.80s", buf );
+		default:
+		if ( strncasecmp( buf, "Accept-Charset:", 15 ) == 0 ||
+		     strncasecmp( buf, "Accept-Language:", 16 ) == 0 ||
+		     strncasecmp( buf, "Agent:", 6 ) == 0 ||
+		     strncasecmp( buf, "Cache-Control:", 14 ) == 0 ||
+		     strncasecmp( buf, "Cache-Info:", 11 ) == 0 ||
+		     strncasecmp( buf, "Charge-To:", 10 ) == 0 ||
+		     strncasecmp( buf, "Client-IP:", 10 ) == 0 ||
+		     strncasecmp( buf, "Date:", 5 ) == 0 ||
+		     strncasecmp( buf, "Extension:", 10 ) == 0 ||
+		     strncasecmp( buf, "Forwarded:", 10 ) == 0 ||
+		     strncasecmp( buf, "From:", 5 ) == 0 ||
+		     strncasecmp( buf, "HTTP-Version:", 13 ) == 0 ||
+		     strncasecmp( buf, "Max-Forwards:", 13 ) == 0 ||
+		     strncasecmp( buf, "Message-Id:", 11 ) == 0 ||
+		     strncasecmp( buf, "MIME-Version:", 13 ) == 0 ||
+		     strncasecmp( buf, "Negotiate:", 10 ) == 0 ||
+		     strncasecmp( buf, "Pragma:", 7 ) == 0 ||
+		     strncasecmp( buf, "Proxy-Agent:", 12 ) == 0 ||
+		     strncasecmp( buf, "Proxy-Connection:", 17 ) == 0 ||
+		     strncasecmp( buf, "Security-Scheme:", 16 ) == 0 ||
+		     strncasecmp( buf, "Session-Id:", 11 ) == 0 ||
+		     strncasecmp( buf, "UA-Color:", 9 ) == 0 ||
+		     strncasecmp( buf, "UA-CPU:", 7 ) == 0 ||
+		     strncasecmp( buf, "UA-Disp:", 8 ) == 0 ||
+		     strncasecmp( buf, "UA-OS:", 6 ) == 0 ||
+		     strncasecmp( buf, "UA-Pixels:", 10 ) == 0 ||
+		     strncasecmp( buf, "User:", 5 ) == 0 ||
+		     strncasecmp( buf, "Via:", 4 ) == 0 ||
+		     strncasecmp( buf, "X-", 2 ) == 0 )
+		    ; /* ignore */
+		else
+		    syslog( LOG_DEBUG, "unknown request header: %.80s", buf );
+		break;
 #endif /* LOG_UNKNOWN_HEADERS */
+		}
 	    }
 	}
 
+    /* HTTP/1.1 connections are persistent unless the client says
+    ** otherwise; HTTP/1.0 ones only if the client asks.
+    */
+    if ( conn_close )
+	hc->keep_alive = 0;
+    else if ( hc->one_one )
+	hc->keep_alive = 1;
+
     if ( hc->one_one )
 	{
 	/* Check that HTTP/1.1 requests specify a host, as required. */
@@ -2278,15 +3114,20 @@ httpd_parse_request( httpd_conn* hc )
 	    }
 
 	/* If the client wants to do keep-alives, it might also be doing
-	** pipelining.  There's no way for us to tell.  Since we don't
-	** implement keep-alives yet, if we close such a connection there
-	** might be unread pipelined requests waiting.  So, we have to
-	** do a lingering close.
+	** pipelining.  There's no way for us to tell.  If we end up
+	** closing such a connection anyway there might be unread pipelined
+	** requests waiting.  So, we have to do a lingering close.
 	*/
 	if ( hc->keep_alive )
 	    hc->should_linger = 1;
 	}
 
+    /* We don't know where a POST body ends unless a CGI reads it, so
+    ** there's no telling where the next request would start.
+    */
+    if ( hc->method == METHOD_POST )
+	hc->keep_alive = 0;
+
     /* Ok, the request has been parsed.  Now we resolve stuff that
     ** may require the entire request.
     */
@@ -2384,29 +3225,58 @@ httpd_parse_request( httpd_conn* hc )
     }
 
 
+/* Returns the index of the first CR or LF in buf between start and end,
+** or end if there isn't one.  With SSE2 this checks sixteen bytes at a
+** time.
+*/
+static size_t
+scan_eol( char* buf, size_t start, size_t end )
+    {
+    size_t i;
+#ifdef USE_SSE2_SCAN
+    __m128i cr, lf, v;
+    int mask;
+
+    cr = _mm_set1_epi8( '\015' );
+    lf = _mm_set1_epi8( '\012' );
+    for ( i = start; i + 16 <= end; i += 16 )
+	{
+	v = _mm_loadu_si128( (__m128i*) &buf[i] );
+	mask = _mm_movemask_epi8( _mm_or_si128(
+	    _mm_cmpeq_epi8( v, cr ), _mm_cmpeq_epi8( v, lf ) ) );
+	if ( mask != 0 )
+	    return i + __builtin_ctz( mask );
+	}
+#else /* USE_SSE2_SCAN */
+    i = start;
+#endif /* USE_SSE2_SCAN */
+    for ( ; i < end; ++i )
+	if ( buf[i] == '\012' || buf[i] == '\015' )
+	    break;
+    return i;
+    }
+
+
 static char*
 bufgets( httpd_conn* hc )
     {
     int i;
     char c;
 
-    for ( i = hc->checked_idx; hc->checked_idx < hc->read_idx; ++hc->checked_idx )
+    i = hc->checked_idx;
+    hc->checked_idx = scan_eol( hc->read_buf, i, hc->read_idx );
+    if ( hc->checked_idx == hc->read_idx )
+	return (char*) 0;
+    c = hc->read_buf[hc->checked_idx];
+    hc->read_buf[hc->checked_idx] = '\0';
+    ++hc->checked_idx;
+    if ( c == '\015' && hc->checked_idx < hc->read_idx &&
+	 hc->read_buf[hc->checked_idx] == '\012' )
 	{
-	c = hc->read_buf[hc->checked_idx];
-	if ( c == '\012' || c == '\015' )
-	    {
-	    hc->read_buf[hc->checked_idx] = '\0';
-	    ++hc->checked_idx;
-	    if ( c == '\015' && hc->checked_idx < hc->read_idx &&
-		 hc->read_buf[hc->checked_idx] == '\012' )
-		{
-		hc->read_buf[hc->checked_idx] = '\0';
-		++hc->checked_idx;
-		}
-	    return &(hc->read_buf[i]);
-	    }
+	hc->read_buf[hc->checked_idx] = '\0';
+	++hc->checked_idx;
 	}
-    return (char*) 0;
+    return &(hc->read_buf[i]);
     }
 
 
@@ -2458,20 +3328,64 @@ de_dotdot( char* file )
 
 
 void
-httpd_close_conn( httpd_conn* hc, struct timeval* nowP )
+httpd_reset_conn( httpd_conn* hc, struct timeval* nowP )
     {
+    size_t leftover;
+
     make_log_entry( hc, nowP );
 
+    if ( hc->window_address != (char*) 0 )
+	{
+	mmc_unmap_window( hc->window_address, hc->window_len );
+	hc->window_address = (char*) 0;
+	}
+    if ( hc->file_address != (char*) 0 )
+	{
+	mmc_unmap( hc->file_address, &(hc->sb), nowP );
+	hc->file_address = (char*) 0;
+	hc->file_fd = -1;
+	}
+
+    /* Anything past the end of this request is the start of the next
+    ** one.  Move it to the front of the buffer.
+    */
+    leftover = hc->read_idx - hc->checked_idx;
+    if ( leftover > 0 )
+	(void) memmove( hc->read_buf, &(hc->read_buf[hc->checked_idx]), leftover );
+    hc->read_idx = leftover;
+    init_request( hc );
+    }
+
+
+void
+httpd_close_conn( httpd_conn* hc, struct timeval* nowP )
+    {
+    /* A persistent connection that times out or gets closed while
+    ** waiting for its next request has nothing to log.
+    */
+    if ( hc->status != 0 )
+	make_log_entry( hc, nowP );
+
+    if ( hc->window_address != (char*) 0 )
+	{
+	mmc_unmap_window( hc->window_address, hc->window_len );
+	hc->window_address = (char*) 0;
+	}
     if ( hc->file_address != (char*) 0 )
 	{
 	mmc_unmap( hc->file_address, &(hc->sb), nowP );
 	hc->file_address = (char*) 0;
+	hc->file_fd = -1;
 	}
     if ( hc->conn_fd >= 0 )
 	{
 	(void) close( hc->conn_fd );
 	hc->conn_fd = -1;
 	}
+
+    /* Nothing more will be read or sent, so the buffers can go back. */
+    hc->read_idx = hc->responselen = 0;
+    httpd_idle_conn( hc );
     }
 
 void
@@ -2480,74 +3394,70 @@ httpd_destroy_conn( httpd_conn* hc )
     if ( hc->initialized )
 	{
 	free( (void*) hc->read_buf );
-	free( (void*) hc->decodedurl );
-	free( (void*) hc->origfilename );
 	free( (void*) hc->expnfilename );
 	free( (void*) hc->encodings );
 	free( (void*) hc->pathinfo );
-	free( (void*) hc->query );
-	free( (void*) hc->accept );
-	free( (void*) hc->accepte );
-	free( (void*) hc->reqhost );
-	free( (void*) hc->hostdir );
-	free( (void*) hc->remoteuser );
 	free( (void*) hc->response );
+	free( (void*) hc->parts );
 #ifdef TILDE_MAP_2
 	free( (void*) hc->altdir );
 #endif /* TILDE_MAP_2 */
+	arena_reset( hc );
+	free( (void*) hc->arena );
 	hc->initialized = 0;
 	}
     }
 
 
+/* The MIME tables are perfect hashes built by mimehash from
+** mime_encodings.txt and mime_types.txt.  Every extension has a slot of
+** its own, found by hashing into a bucket and applying that bucket's
+** displacement; unused slots are all zeros.
+*/
 struct mime_entry {
     char* ext;
     size_t ext_len;
     char* val;
     size_t val_len;
+    unsigned int hash;
     };
-static struct mime_entry enc_tab[] = {
 #include "mime_encodings.h"
-    };
-static const int n_enc_tab = sizeof(enc_tab) / sizeof(*enc_tab);
-static struct mime_entry typ_tab[] = {
 #include "mime_types.h"
-    };
-static const int n_typ_tab = sizeof(typ_tab) / sizeof(*typ_tab);
 
 
-/* qsort comparison routine */
-static int
-ext_compare( const void* v1, const void* v2 )
+/* Case-insensitive FNV-1a.  This has to match mime_hash() in mimehash.c. */
+static unsigned int
+mime_hash( char* s, size_t len )
     {
-    const struct mime_entry* m1 = (const struct mime_entry*) v1;
-    const struct mime_entry* m2 = (const struct mime_entry*) v2;
+    unsigned int h = 2166136261U;
+    size_t i;
 
-    return strcmp( m1->ext, m2->ext );
+    for ( i = 0; i < len; ++i )
+	h = ( h ^ (unsigned int) ( (unsigned char) s[i] | 0x20 ) ) * 16777619U;
+    return h;
     }
 
 
-static void
-init_mime( void )
+/* Returns the slot an extension would have, or -1 if it isn't in the
+** table.  A miss is nearly always caught by the stored length and hash,
+** so strncasecmp() only runs on a probable hit.
+*/
+static int
+mime_lookup(
+    const struct mime_entry* tab, const unsigned int* disp, int buckets,
+    int slot_bits, char* ext, size_t ext_len )
     {
-    int i;
-
-    /* Sort the tables so we can do binary search. */
-    qsort( enc_tab, n_enc_tab, sizeof(*enc_tab), ext_compare );
-    qsort( typ_tab, n_typ_tab, sizeof(*typ_tab), ext_compare );
-
-    /* Fill in the lengths. */
-    for ( i = 0; i < n_enc_tab; ++i )
-	{
-	enc_tab[i].ext_len = strlen( enc_tab[i].ext );
-	enc_tab[i].val_len = strlen( enc_tab[i].val );
-	}
-    for ( i = 0; i < n_typ_tab; ++i )
-	{
-	typ_tab[i].ext_len = strlen( typ_tab[i].ext );
-	typ_tab[i].val_len = strlen( typ_tab[i].val );
-	}
+    unsigned int h;
+    int s;
 
+    if ( ext_len == 0 )
+	return -1;
+    h = mime_hash( ext, ext_len );
+    s = ( ( h ^ disp[h & ( buckets - 1 )] ) * 2654435761U ) >> ( 32 - slot_bits );
+    if ( tab[s].hash != h || tab[s].ext_len != ext_len ||
+	 strncasecmp( ext, tab[s].ext, ext_len ) != 0 )
+	return -1;
+    return s;
     }
 
 
@@ -2563,8 +3473,7 @@ figure_mime( httpd_conn* hc )
     char* ext;
     int me_indexes[100], n_me_indexes;
     size_t ext_len, encodings_len;
-    int i, top, bot, mid;
-    int r;
+    int i;
     char* default_type = "text/plain; charset=%s";
 
     /* Peel off encoding extensions until there aren't any more. */
@@ -2583,50 +3492,28 @@ figure_mime( httpd_conn* hc )
 	    }
 	ext = dot + 1;
 	ext_len = prev_dot - ext;
-	/* Search the encodings table.  Linear search is fine here, there
-	** are only a few entries.
-	*/
-	for ( i = 0; i < n_enc_tab; ++i )
+	/* Look it up in the encodings table. */
+	i = mime_lookup(
+	    enc_tab, enc_disp, ENC_BUCKETS, ENC_SLOT_BITS, ext, ext_len );
+	if ( i == -1 )
+	    /* No encoding extension found.  Break and look for a type
+	    ** extension.
+	    */
+	    break;
+	if ( n_me_indexes < sizeof(me_indexes)/sizeof(*me_indexes) )
 	    {
-	    if ( ext_len == enc_tab[i].ext_len && strncasecmp( ext, enc_tab[i].ext, ext_len ) == 0 )
-		{
-		if ( n_me_indexes < sizeof(me_indexes)/sizeof(*me_indexes) )
-		    {
-		    me_indexes[n_me_indexes] = i;
-		    ++n_me_indexes;
-		    }
-		goto next;
-		}
+	    me_indexes[n_me_indexes] = i;
+	    ++n_me_indexes;
 	    }
-	/* No encoding extension found.  Break and look for a type extension. */
-	break;
-
-	next: ;
 	}
 
-    /* Binary search for a matching type extension. */
-    top = n_typ_tab - 1;
-    bot = 0;
-    while ( top >= bot )
-	{
-	mid = ( top + bot ) / 2;
-	r = strncasecmp( ext, typ_tab[mid].ext, ext_len );
-	if ( r < 0 )
-	    top = mid - 1;
-	else if ( r > 0 )
-	    bot = mid + 1;
-	else
-	    if ( ext_len < typ_tab[mid].ext_len )
-		top = mid - 1;
-	    else if ( ext_len > typ_tab[mid].ext_len )
-		bot = mid + 1;
-	    else
-		{
-		hc->type = typ_tab[mid].val;
-		goto done;
-		}
-	}
-    hc->type = default_type;
+    /* Look for a matching type extension. */
+    i = mime_lookup(
+	typ_tab, typ_disp, TYP_BUCKETS, TYP_SLOT_BITS, ext, ext_len );
+    if ( i != -1 )
+	hc->type = typ_tab[i].val;
+    else
+	hc->type = default_type;
 
     done:
 
@@ -2650,6 +3537,96 @@ figure_mime( httpd_conn* hc )
     }
 
 
+#ifdef PRECOMPRESSED_FILES
+/* Precompressed versions of a file are found by tacking on one of these
+** extensions.  They get tried in this order.
+*/
+static struct {
+    char* ext;
+    char* coding;
+    } precomp_tab[] = {
+    { ".br", "br" },
+    { ".zst", "zstd" },
+    { ".gz", "gzip" },
+    };
+
+/* If the client takes a content-coding that there's a precompressed
+** version of this file for, switch the request over to that version.
+** The precompressed file has to be a plain world-readable file at least
+** as new as the original.  Returns 1 if there is any such version,
+** whether or not it switched, and 0 if there isn't.
+*/
+static int
+precompressed( httpd_conn* hc )
+    {
+    size_t len;
+    int i, found;
+    struct stat sb;
+
+    len = strlen( hc->expnfilename );
+    found = 0;
+    for ( i = 0; i < sizeof(precomp_tab) / sizeof(*precomp_tab); ++i )
+	{
+	httpd_realloc_str(
+	    &hc->expnfilename, &hc->maxexpnfilename,
+	    len + strlen( precomp_tab[i].ext ) );
+	(void) strcpy( &hc->expnfilename[len], precomp_tab[i].ext );
+	/* Use lstat() so a symlink can't lead outside the tree. */
+	if ( stc_lstat( hc->expnfilename, &sb, (struct timeval*) 0 ) == 0 &&
+	     S_ISREG( sb.st_mode ) &&
+	     ( sb.st_mode & S_IROTH ) && ! ( sb.st_mode & S_IXOTH ) &&
+	     sb.st_mtime >= hc->sb.st_mtime )
+	    {
+	    found = 1;
+	    if ( ! accepts_coding( hc->accepte, precomp_tab[i].coding ) )
+		{
+		hc->expnfilename[len] = '\0';
+		continue;
+		}
+	    hc->sb = sb;
+	    httpd_realloc_str(
+		&hc->encodings, &hc->maxencodings,
+		strlen( precomp_tab[i].coding ) );
+	    (void) strcpy( hc->encodings, precomp_tab[i].coding );
+	    return 1;
+	    }
+	hc->expnfilename[len] = '\0';
+	}
+    return found;
+    }
+
+
+/* Checks whether an Accept-Encoding list includes the given coding,
+** without giving it a q-value of zero.
+*/
+static int
+accepts_coding( char* accepte, char* coding )
+    {
+    size_t len = strlen( coding );
+    char* cp;
+
+    for ( cp = accepte; *cp != '\0'; cp += strcspn( cp, "," ) )
+	{
+	cp += strspn( cp, " \t," );
+	if ( strncasecmp( cp, coding, len ) != 0 )
+	    continue;
+	cp += len;
+	cp += strspn( cp, " \t" );
+	if ( *cp == '\0' || *cp == ',' )
+	    return 1;
+	if ( *cp != ';' )
+	    continue;
+	++cp;
+	cp += strspn( cp, " \t" );
+	if ( ( *cp == 'q' || *cp == 'Q' ) && cp[1] == '=' )
+	    return atof( &cp[2] ) > 0.0;
+	return 1;
+	}
+    return 0;
+    }
+#endif /* PRECOMPRESSED_FILES */
+
+
 #ifdef CGI_TIMELIMIT
 static void
 cgi_kill2( ClientData client_data, struct timeval* nowP )
@@ -2699,16 +3676,16 @@ ls( httpd_conn* hc )
     DIR* dirp;
     struct dirent* de;
     int namlen;
-    static int maxnames = 0;
+    static THREAD_LOCAL int maxnames = 0;
     int nnames;
-    static char* names;
-    static char** nameptrs;
-    static char* name;
-    static size_t maxname = 0;
-    static char* rname;
-    static size_t maxrname = 0;
-    static char* encrname;
-    static size_t maxencrname = 0;
+    static THREAD_LOCAL char* names;
+    static THREAD_LOCAL char** nameptrs;
+    static THREAD_LOCAL char* name;
+    static THREAD_LOCAL size_t maxname = 0;
+    static THREAD_LOCAL char* rname;
+    static THREAD_LOCAL size_t maxrname = 0;
+    static THREAD_LOCAL char* encrname;
+    static THREAD_LOCAL size_t maxencrname = 0;
     FILE* fp;
     int i, r;
     struct stat sb;
@@ -2747,7 +3724,6 @@ ls( httpd_conn* hc )
 		hc->encodedurl );
 	    return -1;
 	    }
-	++hc->hs->cgi_count;
 	r = fork( );
 	if ( r < 0 )
 	    {
@@ -2963,8 +3939,12 @@ mode  links    bytes  last-changed  name\n\
 	    exit( 0 );
 	    }
 
-	/* Parent process. */
+	/* Parent process.  Any responses held for earlier pipelined
+	** requests went out from the child, ahead of the listing.
+	*/
 	closedir( dirp );
+	hc->responselen = 0;
+	add_child( hc->hs, r );
 	syslog( LOG_DEBUG, "spawned indexing process %d for directory '%.200s'", r, hc->expnfilename );
 #ifdef CGI_TIMELIMIT
 	/* Schedule a kill for the child process, in case it runs too long */
@@ -2977,6 +3957,7 @@ mode  links    bytes  last-changed  name\n\
 #endif /* CGI_TIMELIMIT */
 	hc->status = 200;
 	hc->bytes_sent = CGI_BYTECOUNT;
+	hc->keep_alive = 0;
 	hc->should_linger = 0;
 	}
     else
@@ -3576,7 +4557,6 @@ cgi( httpd_conn* hc )
 		hc->encodedurl );
 	    return -1;
 	    }
-	++hc->hs->cgi_count;
 	httpd_clear_ndelay( hc->conn_fd );
 	r = fork( );
 	if ( r < 0 )
@@ -3588,13 +4568,19 @@ cgi( httpd_conn* hc )
 	    }
 	if ( r == 0 )
 	    {
-	    /* Child process. */
+	    /* Child process.  Responses to earlier pipelined requests have
+	    ** to go out before the program starts writing, and here it's
+	    ** fine to block until they have.
+	    */
 	    sub_process = 1;
 	    httpd_unlisten( hc->hs );
+	    httpd_write_response( hc );
 	    cgi_child( hc );
 	    }
 
-	/* Parent process. */
+	/* Parent process.  The child sent any held responses. */
+	hc->responselen = 0;
+	add_child( hc->hs, r );
 	syslog( LOG_DEBUG, "spawned CGI process %d for file '%.200s'", r, hc->expnfilename );
 #ifdef CGI_TIMELIMIT
 	/* Schedule a kill for the child process, in case it runs too long */
@@ -3607,6 +4593,7 @@ cgi( httpd_conn* hc )
 #endif /* CGI_TIMELIMIT */
 	hc->status = 200;
 	hc->bytes_sent = CGI_BYTECOUNT;
+	hc->keep_alive = 0;
 	hc->should_linger = 0;
 	}
     else
@@ -3623,17 +4610,18 @@ cgi( httpd_conn* hc )
 static int
 really_start_request( httpd_conn* hc, struct timeval* nowP )
     {
-    static char* indexname;
-    static size_t maxindexname = 0;
+    static THREAD_LOCAL char* indexname;
+    static THREAD_LOCAL size_t maxindexname = 0;
     static const char* index_names[] = { INDEX_NAMES };
     int i;
 #ifdef AUTH_FILE
-    static char* dirname;
-    static size_t maxdirname = 0;
+    static THREAD_LOCAL char* dirname;
+    static THREAD_LOCAL size_t maxdirname = 0;
 #endif /* AUTH_FILE */
     size_t expnlen, indxlen;
     char* cp;
     char* pi;
+    char* extraheads = "";
 
     expnlen = strlen( hc->expnfilename );
 
@@ -3646,7 +4634,7 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	}
 
     /* Stat the file. */
-    if ( stat( hc->expnfilename, &hc->sb ) < 0 )
+    if ( stc_stat( hc->expnfilename, &hc->sb, nowP ) < 0 )
 	{
 	httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 	return -1;
@@ -3705,7 +4693,7 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	    if ( strcmp( indexname, "./" ) == 0 )
 		indexname[0] = '\0';
 	    (void) strcat( indexname, index_names[i] );
-	    if ( stat( indexname, &hc->sb ) >= 0 )
+	    if ( stc_stat( indexname, &hc->sb, nowP ) >= 0 )
 		goto got_one;
 	    }
 
@@ -3855,25 +4843,39 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	return -1;
 	}
 
-    /* Fill in last_byte_index, if necessary. */
-    if ( hc->got_range &&
-	 ( hc->last_byte_index == -1 || hc->last_byte_index >= hc->sb.st_size ) )
-	hc->last_byte_index = hc->sb.st_size - 1;
-
     figure_mime( hc );
 
+#ifdef PRECOMPRESSED_FILES
+    /* Maybe send a precompressed version instead.  Whenever there is one,
+    ** caches need to know that the response depends on Accept-Encoding,
+    ** even if this particular client got the plain file.
+    */
+    if ( hc->encodings[0] == '\0' && precompressed( hc ) )
+	extraheads = "Vary: Accept-Encoding\015\012";
+#endif /* PRECOMPRESSED_FILES */
+
+    /* Fit any ranges to the file. */
+    resolve_ranges( hc );
+
+    /* The tag comes from the stat alone, so revalidations can be
+    ** answered without touching the file.
+    */
+    make_etag( hc );
+
     if ( hc->method == METHOD_HEAD )
 	{
 	send_mime(
-	    hc, 200, ok200title, hc->encodings, "", hc->type, hc->sb.st_size,
-	    hc->sb.st_mtime );
+	    hc, 200, ok200title, hc->encodings, extraheads, hc->type,
+	    hc->sb.st_size, hc->sb.st_mtime );
 	}
-    else if ( hc->if_modified_since != (time_t) -1 &&
-	 hc->if_modified_since >= hc->sb.st_mtime )
+    else if ( hc->if_none_match[0] != '\0' ?
+	      etag_match( hc->if_none_match, hc->etag ) :
+	      ( hc->if_modified_since != (time_t) -1 &&
+		hc->if_modified_since >= hc->sb.st_mtime ) )
 	{
 	send_mime(
-	    hc, 304, err304title, hc->encodings, "", hc->type, (off_t) -1,
-	    hc->sb.st_mtime );
+	    hc, 304, err304title, hc->encodings, extraheads, hc->type,
+	    (off_t) -1, hc->sb.st_mtime );
 	}
     else
 	{
@@ -3883,9 +4885,15 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 	    return -1;
 	    }
+	hc->file_fd = mmc_fd( hc->file_address, &(hc->sb) );
+	/* If our stat came from the cache and the file has since shrunk,
+	** mmc_map() updated hc->sb; keep the range inside it.
+	*/
+	resolve_ranges( hc );
+	make_etag( hc );
 	send_mime(
-	    hc, 200, ok200title, hc->encodings, "", hc->type, hc->sb.st_size,
-	    hc->sb.st_mtime );
+	    hc, 200, ok200title, hc->encodings, extraheads, hc->type,
+	    hc->sb.st_size, hc->sb.st_mtime );
 	}
 
     return 0;
@@ -3905,6 +4913,151 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP )
     }
 
 
+char*
+httpd_file_window( httpd_conn* hc, off_t offset, size_t* lenP )
+    {
+    off_t start;
+
+    /* Slide the window along if offset has moved out of it. */
+    if ( hc->window_address == (char*) 0 ||
+	 offset < hc->window_start ||
+	 offset >= hc->window_start + (off_t) hc->window_len )
+	{
+	if ( hc->window_address != (char*) 0 )
+	    {
+	    mmc_unmap_window( hc->window_address, hc->window_len );
+	    hc->window_address = (char*) 0;
+	    }
+	start = offset - offset % FILE_WINDOW_SIZE;
+	hc->window_len = MIN( FILE_WINDOW_SIZE, hc->sb.st_size - start );
+	hc->window_address = (char*) mmc_map_window(
+	    hc->file_fd, start, hc->window_len );
+	if ( hc->window_address == (char*) 0 )
+	    return (char*) 0;
+	hc->window_start = start;
+	}
+    *lenP = hc->window_start + hc->window_len - offset;
+    return &hc->window_address[offset - hc->window_start];
+    }
+
+
+int
+httpd_parts_iovec( httpd_conn* hc, off_t offset, size_t max_bytes, struct iovec* iv, int maxiv )
+    {
+    int i, n;
+    off_t pos, len, skip;
+    size_t avail;
+    char* src;
+
+    /* The body is the text in front of each part, then the part's slice
+    ** of the file, and finally the closing boundary.  Walk along it to
+    ** offset and gather pieces from there.
+    */
+    n = 0;
+    pos = 0;
+    for ( i = 0; i <= hc->nranges; ++i )
+	{
+	len = hc->part_text[i + 1] - hc->part_text[i];
+	if ( offset < pos + len )
+	    {
+	    if ( n == maxiv || max_bytes == 0 )
+		break;
+	    skip = offset - pos;
+	    iv[n].iov_base = &hc->parts[hc->part_text[i] + skip];
+	    iv[n].iov_len = MIN( len - skip, max_bytes );
+	    offset += iv[n].iov_len;
+	    max_bytes -= iv[n].iov_len;
+	    ++n;
+	    }
+	pos += len;
+	if ( i == hc->nranges )
+	    break;
+
+	len = hc->range_last[i] - hc->range_first[i] + 1;
+	if ( offset < pos + len )
+	    {
+	    if ( n == maxiv || max_bytes == 0 )
+		break;
+	    skip = offset - pos;
+	    if ( hc->file_fd == -1 )
+		{
+		src = &hc->file_address[hc->range_first[i] + skip];
+		avail = len - skip;
+		}
+	    else
+		{
+		src = httpd_file_window(
+		    hc, hc->range_first[i] + skip, &avail );
+		if ( src == (char*) 0 )
+		    return -1;
+		avail = MIN( avail, len - skip );
+		}
+	    iv[n].iov_base = src;
+	    iv[n].iov_len = MIN( avail, max_bytes );
+	    offset += iv[n].iov_len;
+	    max_bytes -= iv[n].iov_len;
+	    ++n;
+	    /* Moving the window for another slice would unmap this one. */
+	    if ( hc->file_fd != -1 )
+		break;
+	    }
+	pos += len;
+	}
+    return n;
+    }
+
+
+/* The last log date formatted, good for the rest of its second. */
+static THREAD_LOCAL time_t log_date_time = (time_t) -1;
+static THREAD_LOCAL char log_date[100];
+
+/* Log file lines handed to the writer thread, and lines dropped because
+** its ring was full.
+*/
+static THREAD_LOCAL long log_queued = 0;
+static THREAD_LOCAL long log_dropped = 0;
+
+
+/* Formats the time for a log file line, forcing a numeric timezone (some
+** log analyzers are stoooopid about this).  Like the Date header, this
+** only has to be redone when the second changes.
+*/
+static char*
+log_date_str( time_t now )
+    {
+    struct tm tm;
+    struct tm* t;
+    const char* cernfmt_nozone = "%d/%b/%Y:%H:%M:%S";
+    char date_nozone[100];
+    int zone;
+    char sign;
+
+    if ( now != log_date_time )
+	{
+	t = LOCALTIME( &now, &tm );
+	(void) strftime( date_nozone, sizeof(date_nozone), cernfmt_nozone, t );
+#ifdef HAVE_TM_GMTOFF
+	zone = t->tm_gmtoff / 60L;
+#else
+	zone = -timezone / 60L;
+	/* Probably have to add something about daylight time here. */
+#endif
+	if ( zone >= 0 )
+	    sign = '+';
+	else
+	    {
+	    sign = '-';
+	    zone = -zone;
+	    }
+	zone = ( zone / 60 ) * 100 + zone % 60;
+	(void) my_snprintf( log_date, sizeof(log_date),
+	    "%s %c%04d", date_nozone, sign, zone );
+	log_date_time = now;
+	}
+    return log_date;
+    }
+
+
 static void
 make_log_entry( httpd_conn* hc, struct timeval* nowP )
     {
@@ -3949,43 +5102,58 @@ make_log_entry( httpd_conn* hc, struct timeval* nowP )
     if ( hc->hs->logfp != (FILE*) 0 )
 	{
 	time_t now;
-	struct tm* t;
-	const char* cernfmt_nozone = "%d/%b/%Y:%H:%M:%S";
-	char date_nozone[100];
-	int zone;
-	char sign;
-	char date[100];
 
 	/* Get the current time, if necessary. */
 	if ( nowP != (struct timeval*) 0 )
 	    now = nowP->tv_sec;
 	else
 	    now = time( (time_t*) 0 );
-	/* Format the time, forcing a numeric timezone (some log analyzers
-	** are stoooopid about this).
-	*/
-	t = localtime( &now );
-	(void) strftime( date_nozone, sizeof(date_nozone), cernfmt_nozone, t );
-#ifdef HAVE_TM_GMTOFF
-	zone = t->tm_gmtoff / 60L;
-#else
-	zone = -timezone / 60L;
-	/* Probably have to add something about daylight time here. */
-#endif
-	if ( zone >= 0 )
-	    sign = '+';
-	else
+#ifdef USE_LOG_RING
+	/* If there's a writer thread, just copy the fields into its ring. */
+	if ( hc->hs->log_ring != (void*) 0 )
 	    {
-	    sign = '-';
-	    zone = -zone;
+	    log_ring* lr = (log_ring*) hc->hs->log_ring;
+	    unsigned long tail = lr->tail;
+	    log_rec* rec;
+
+	    while ( tail - RING_LOAD( &lr->head ) >= LOG_RING_SIZE )
+		{
+#ifdef LOG_RING_BLOCK
+		(void) pthread_mutex_lock( &lr->mutex );
+		if ( tail - RING_LOAD( &lr->head ) >= LOG_RING_SIZE )
+		    (void) pthread_cond_wait( &lr->room, &lr->mutex );
+		(void) pthread_mutex_unlock( &lr->mutex );
+#else /* LOG_RING_BLOCK */
+		++log_dropped;
+		return;
+#endif /* LOG_RING_BLOCK */
+		}
+	    rec = &lr->recs[tail % LOG_RING_SIZE];
+	    rec->now = now;
+	    rec->status = hc->status;
+	    rec->method = httpd_method_str( hc->method );
+	    copy_field( rec->client, httpd_ntoa( &hc->client_addr ), sizeof(rec->client) );
+	    copy_field( rec->ru, ru, sizeof(rec->ru) );
+	    copy_field( rec->url, url, sizeof(rec->url) );
+	    copy_field( rec->protocol, hc->protocol, sizeof(rec->protocol) );
+	    copy_field( rec->bytes, bytes, sizeof(rec->bytes) );
+	    copy_field( rec->referrer, hc->referrer, sizeof(rec->referrer) );
+	    copy_field( rec->useragent, hc->useragent, sizeof(rec->useragent) );
+	    RING_STORE( &lr->tail, tail + 1 );
+	    ++log_queued;
+	    /* Wake the writer if it had caught up. */
+	    if ( RING_LOAD( &lr->head ) == tail )
+		{
+		(void) pthread_mutex_lock( &lr->mutex );
+		(void) pthread_cond_signal( &lr->nonempty );
+		(void) pthread_mutex_unlock( &lr->mutex );
+		}
+	    return;
 	    }
-	zone = ( zone / 60 ) * 100 + zone % 60;
-	(void) my_snprintf( date, sizeof(date),
-	    "%s %c%04d", date_nozone, sign, zone );
-	/* And write the log entry. */
-	(void) fprintf( hc->hs->logfp,
-	    "%.80s - %.80s [%s] \"%.80s %.300s %.80s\" %d %s \"%.200s\" \"%.200s\"\n",
-	    httpd_ntoa( &hc->client_addr ), ru, date,
+#endif /* USE_LOG_RING */
+	/* Write the log entry. */
+	(void) fprintf( hc->hs->logfp, LOG_FILE_FORMAT,
+	    httpd_ntoa( &hc->client_addr ), ru, log_date_str( now ),
 	    httpd_method_str( hc->method ), url, hc->protocol,
 	    hc->status, bytes, hc->referrer, hc->useragent );
 #ifdef FLUSH_LOG_EVERY_TIME
@@ -4001,6 +5169,157 @@ make_log_entry( httpd_conn* hc, struct timeval* nowP )
     }
 
 
+#ifdef USE_LOG_RING
+/* Starts a writer thread for hs's log file.  If that can't be done the
+** log just gets written synchronously, as without LOG_RING_SIZE.
+*/
+static void
+start_log_ring( httpd_server* hs )
+    {
+    log_ring* lr;
+    sigset_t all, old;
+    int r;
+
+    lr = NEW( log_ring, 1 );
+    if ( lr == (log_ring*) 0 )
+	{
+	syslog( LOG_ERR, "out of memory allocating a log ring" );
+	return;
+	}
+    lr->head = lr->tail = 0;
+    lr->fp = hs->logfp;
+    lr->new_fp = (FILE*) 0;
+    lr->stopping = 0;
+    (void) pthread_mutex_init( &lr->mutex, (pthread_mutexattr_t*) 0 );
+    (void) pthread_cond_init( &lr->nonempty, (pthread_condattr_t*) 0 );
+    (void) pthread_cond_init( &lr->room, (pthread_condattr_t*) 0 );
+
+    /* Signals are for the main loops, so the writer blocks them all. */
+    (void) sigfillset( &all );
+    (void) pthread_sigmask( SIG_SETMASK, &all, &old );
+    r = pthread_create( &lr->tid, (pthread_attr_t*) 0, log_writer, (void*) lr );
+    (void) pthread_sigmask( SIG_SETMASK, &old, (sigset_t*) 0 );
+    if ( r != 0 )
+	{
+	syslog( LOG_ERR, "pthread_create log writer - %s", strerror( r ) );
+	(void) pthread_mutex_destroy( &lr->mutex );
+	(void) pthread_cond_destroy( &lr->nonempty );
+	(void) pthread_cond_destroy( &lr->room );
+	free( (void*) lr );
+	return;
+	}
+    hs->log_ring = (void*) lr;
+    }
+
+
+/* Tells hs's writer thread to finish what's in the ring and waits for it. */
+static void
+stop_log_ring( httpd_server* hs )
+    {
+    log_ring* lr = (log_ring*) hs->log_ring;
+
+    if ( lr == (log_ring*) 0 )
+	return;
+    /* The writer empties the ring before it goes. */
+    (void) pthread_mutex_lock( &lr->mutex );
+    lr->stopping = 1;
+    (void) pthread_cond_signal( &lr->nonempty );
+    (void) pthread_mutex_unlock( &lr->mutex );
+    (void) pthread_join( lr->tid, (void**) 0 );
+    (void) pthread_mutex_destroy( &lr->mutex );
+    (void) pthread_cond_destroy( &lr->nonempty );
+    (void) pthread_cond_destroy( &lr->room );
+    free( (void*) lr );
+    hs->log_ring = (void*) 0;
+    }
+
+
+/* Like strncpy() but always terminates, and doesn't bother padding. */
+static void
+copy_field( char* to, char* from, size_t size )
+    {
+    char* end = &to[size - 1];
+
+    while ( to < end && *from != '\0' )
+	*to++ = *from++;
+    *to = '\0';
+    }
+
+
+/* The writer thread.  Each time it wakes up it formats everything in the
+** ring into one buffer and writes that with a single write() if it fits.
+** The stream was opened for appending, so these writes don't get mixed
+** up with other workers' or threads'.
+*/
+static void*
+log_writer( void* arg )
+    {
+    log_ring* lr = (log_ring*) arg;
+    char* buf;
+    size_t len;
+    unsigned long tail;
+    log_rec* rec;
+    FILE* old_fp;
+    int stopping;
+
+    buf = (char*) malloc( LOG_BATCH_SIZE );
+    if ( buf == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a log batch buffer" );
+	exit( 1 );
+	}
+    for (;;)
+	{
+	(void) pthread_mutex_lock( &lr->mutex );
+	while ( lr->head == RING_LOAD( &lr->tail ) &&
+		! lr->stopping && lr->new_fp == (FILE*) 0 )
+	    (void) pthread_cond_wait( &lr->nonempty, &lr->mutex );
+	stopping = lr->stopping;
+	old_fp = (FILE*) 0;
+	if ( lr->new_fp != (FILE*) 0 )
+	    {
+	    old_fp = lr->fp;
+	    lr->fp = lr->new_fp;
+	    lr->new_fp = (FILE*) 0;
+	    }
+	(void) pthread_mutex_unlock( &lr->mutex );
+	if ( old_fp != (FILE*) 0 )
+	    (void) fclose( old_fp );
+
+	len = 0;
+	tail = RING_LOAD( &lr->tail );
+	while ( lr->head != tail )
+	    {
+	    rec = &lr->recs[lr->head % LOG_RING_SIZE];
+	    len += my_snprintf( &buf[len], LOG_BATCH_SIZE - len,
+		LOG_FILE_FORMAT, rec->client, rec->ru, log_date_str( rec->now ),
+		rec->method, rec->url, rec->protocol, rec->status, rec->bytes,
+		rec->referrer, rec->useragent );
+	    RING_STORE( &lr->head, lr->head + 1 );
+	    if ( LOG_BATCH_SIZE - len < sizeof(log_rec) + 100 )
+		{
+		/* Nearly full, write this much out now. */
+		(void) httpd_write_fully( fileno( lr->fp ), buf, len );
+		len = 0;
+		}
+	    }
+	if ( len > 0 )
+	    (void) httpd_write_fully( fileno( lr->fp ), buf, len );
+#ifdef LOG_RING_BLOCK
+	(void) pthread_mutex_lock( &lr->mutex );
+	(void) pthread_cond_broadcast( &lr->room );
+	(void) pthread_mutex_unlock( &lr->mutex );
+#endif /* LOG_RING_BLOCK */
+
+	if ( stopping && lr->head == RING_LOAD( &lr->tail ) )
+	    break;
+	}
+    free( (void*) buf );
+    return (void*) 0;
+    }
+#endif /* USE_LOG_RING */
+
+
 /* Returns 1 if ok to serve the url, 0 if not. */
 static int
 check_referrer( httpd_conn* hc )
@@ -4042,8 +5361,8 @@ really_check_referrer( httpd_conn* hc )
     char* cp1;
     char* cp2;
     char* cp3;
-    static char* refhost = (char*) 0;
-    static size_t refhost_size = 0;
+    static THREAD_LOCAL char* refhost = (char*) 0;
+    static THREAD_LOCAL size_t refhost_size = 0;
     char *lp;
 
     hs = hc->hs;
@@ -4113,7 +5432,7 @@ char*
 httpd_ntoa( httpd_sockaddr* saP )
     {
 #ifdef USE_IPV6
-    static char str[200];
+    static THREAD_LOCAL char str[200];
 
     if ( getnameinfo( &saP->sa, sockaddr_len( saP ), str, sizeof(str), 0, 0, NI_NUMERICHOST ) != 0 )
 	{
@@ -4277,4 +5596,13 @@ httpd_logstats( long secs )
 	    "  libhttpd - %d strings allocated, %lu bytes (%g bytes/str)",
 	    str_alloc_count, (unsigned long) str_alloc_size,
 	    (float) str_alloc_size / str_alloc_count );
+    syslog( LOG_NOTICE,
+	"  buffer pools - read %d lent, %d pooled (%lu bytes); response %d lent, %d pooled (%lu bytes)",
+	read_pool.lent, read_pool.count, (unsigned long) read_pool.size,
+	response_pool.lent, response_pool.count,
+	(unsigned long) response_pool.size );
+    if ( log_queued > 0 || log_dropped > 0 )
+	syslog( LOG_NOTICE,
+	    "  log ring - %ld lines queued, %ld dropped",
+	    log_queued, log_dropped );
     }
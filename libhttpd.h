@@ -32,6 +32,7 @@
 #include <sys/time.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -75,6 +76,8 @@ typedef struct {
     unsigned short port;
     char* cgi_pattern;
     int cgi_limit, cgi_count;
+    pid_t* cgi_pids;	/* the cgi_count children, for reaping */
+    int max_cgi_pids;
     char* charset;
     char* p3p;
     int max_age;
@@ -82,6 +85,7 @@ typedef struct {
     int listen4_fd, listen6_fd;
     int no_log;
     FILE* logfp;
+    void* log_ring;	/* writer thread for logfp, or 0 */
     int no_symlink_check;
     int vhost;
     int global_passwd;
@@ -90,18 +94,29 @@ typedef struct {
     int no_empty_referrers;
     } httpd_server;
 
-/* A connection. */
+/* A connection.  The fields handle_read() and handle_send() look at on
+** every event are grouped at the front so they sit in the first couple of
+** cache lines; the parsed request and the stat buffer come after.
+*/
 typedef struct {
-    int initialized;
-    httpd_server* hs;
-    httpd_sockaddr client_addr;
+    int conn_fd;
+    int file_fd;	/* open file to send from, or -1 */
+    char* file_address;
+    char* window_address;	/* part of file_fd mapped by httpd_file_window() */
+    off_t window_start;
+    size_t window_len;
+    char* response;
+    size_t responselen;
+    off_t bytes_sent;
+    int nranges;	/* byte ranges requested, more than one is multipart */
+    int checked_state;
     char* read_buf;
     size_t read_size, read_idx, checked_idx;
-    int checked_state;
+    int initialized;
     int method;
     int status;
+    httpd_server* hs;
     off_t bytes_to_send;
-    off_t bytes_sent;
     char* encodedurl;
     char* decodedurl;
     char* protocol;
@@ -117,20 +132,21 @@ typedef struct {
     char* acceptl;
     char* cookie;
     char* contenttype;
+    char* if_none_match;
+    char* range_if_tag;	/* If-Range entity tag, "" if a date or none */
     char* reqhost;
     char* hdrhost;
     char* hostdir;
     char* authorization;
     char* remoteuser;
-    char* response;
-    size_t maxdecodedurl, maxorigfilename, maxexpnfilename, maxencodings,
-	maxpathinfo, maxquery, maxaccept, maxaccepte, maxreqhost, maxhostdir,
-	maxremoteuser, maxresponse;
+    size_t maxexpnfilename, maxencodings, maxpathinfo, maxresponse, maxparts;
+    char* arena;	/* per-request strings are carved from here */
+    size_t arena_size, arena_used, arena_spill;
+    void* arena_extra;	/* overflow chunks for this request */
 #ifdef TILDE_MAP_2
     char* altdir;
     size_t maxaltdir;
 #endif /* TILDE_MAP_2 */
-    size_t responselen;
     time_t if_modified_since, range_if;
     size_t contentlength;
     char* type;		/* not malloc()ed */
@@ -139,12 +155,15 @@ typedef struct {
     int one_one;	/* HTTP/1.1 or better */
     int got_range;
     int tildemapped;	/* this connection got tilde-mapped */
-    off_t first_byte_index, last_byte_index;
-    int keep_alive;
+    int keep_alive;	/* connection can stay open for another request */
     int should_linger;
+    off_t first_byte_index, last_byte_index;
+    char* parts;	/* multipart/byteranges boundaries and part headers */
+    size_t part_text[MAX_BYTE_RANGES + 2];	/* where each piece starts */
+    off_t range_first[MAX_BYTE_RANGES], range_last[MAX_BYTE_RANGES];
+    char etag[80];	/* entity tag of the file being sent, or "" */
+    httpd_sockaddr client_addr;
     struct stat sb;
-    int conn_fd;
-    char* file_address;
     } httpd_conn;
 
 /* Methods. */
@@ -170,6 +189,8 @@ typedef struct {
 
 /* Initializes.  Does the socket(), bind(), and listen().   Returns an
 ** httpd_server* which includes a socket fd that you can select() on.
+** If reuse_port is set the sockets get SO_REUSEPORT, so that several
+** processes can each listen on the same port.
 ** Return (httpd_server*) 0 on error.
 */
 httpd_server* httpd_initialize(
@@ -177,7 +198,7 @@ httpd_server* httpd_initialize(
     unsigned short port, char* cgi_pattern, int cgi_limit, char* charset,
     char* p3p, int max_age, char* cwd, int no_log, FILE* logfp,
     int no_symlink_check, int vhost, int global_passwd, char* url_pattern,
-    char* local_pattern, int no_empty_referrers );
+    char* local_pattern, int no_empty_referrers, int reuse_port );
 
 /* Change the log file. */
 void httpd_set_logfp( httpd_server* hs, FILE* logfp );
@@ -188,6 +209,11 @@ void httpd_unlisten( httpd_server* hs );
 /* Call to shut down. */
 void httpd_terminate( httpd_server* hs );
 
+/* Call after a SIGCHLD to collect this server's CGI and indexing children
+** that have exited, so they no longer count against the CGI limit.
+*/
+void httpd_reap_children( httpd_server* hs );
+
 
 /* When a listen fd is ready to read, call this.  It does the accept() and
 ** returns an httpd_conn* which includes the fd to read the request from and
@@ -232,9 +258,29 @@ int httpd_parse_request( httpd_conn* hc );
 */
 int httpd_start_request( httpd_conn* hc, struct timeval* nowP );
 
+/* For a file that's being sent from hc->file_fd, returns a pointer to
+** the byte at offset and sets *lenP to how many bytes after it are
+** available in memory.  Returns (char*) 0 on errors.
+*/
+char* httpd_file_window( httpd_conn* hc, off_t offset, size_t* lenP );
+
+/* Fills in an iovec array with up to max_bytes of a multipart/byteranges
+** body, starting at offset into the body.  Returns the number of iovecs
+** used, or -1 on errors.
+*/
+int httpd_parts_iovec( httpd_conn* hc, off_t offset, size_t max_bytes, struct iovec* iv, int maxiv );
+
 /* Actually sends any buffered response text. */
 void httpd_write_response( httpd_conn* hc );
 
+/* Call this when a response has been sent on a connection with keep_alive
+** set.  It logs the request and frees its data, and gets the httpd_conn
+** ready to read the next request on the same socket.  Any pipelined bytes
+** left in the read buffer are kept, so call httpd_got_request() before
+** reading more.
+*/
+void httpd_reset_conn( httpd_conn* hc, struct timeval* nowP );
+
 /* Call this to close down a connection and free the data.  A fine point,
 ** if you fork() with a connection open you should still call this in the
 ** parent process - the connection will stay open in the child.
@@ -267,6 +313,18 @@ char* httpd_method_str( int method );
 /* Reallocate a string. */
 void httpd_realloc_str( char** strP, size_t* maxsizeP, size_t size );
 
+/* Makes the read buffer at least size bytes, like httpd_realloc_str().
+** A connection with no read buffer yet gets one from the pool that idle
+** connections give theirs back to.
+*/
+void httpd_borrow_read_buf( httpd_conn* hc, size_t size );
+
+/* Gives a connection's read and response buffers back to the pool, if
+** there's nothing in them.  Call this when it goes idle waiting for its
+** next request.
+*/
+void httpd_idle_conn( httpd_conn* hc );
+
 /* Format a network socket to a string representation. */
 char* httpd_ntoa( httpd_sockaddr* saP );
 
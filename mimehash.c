@@ -0,0 +1,330 @@
+/* mimehash.c - build a perfect-hash MIME table
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+/* Reads mime_types.txt or mime_encodings.txt on stdin and writes the C
+** tables libhttpd.c uses to look extensions up.  Usage:
+**
+**     mimehash prefix < mime_types.txt > mime_types.h
+**
+** Each extension hashes to a bucket, and each bucket gets a displacement
+** chosen so that every extension in the table ends up in a slot of its
+** own.  A lookup is then one hash, one displacement, and at most one
+** string comparison, which only happens when the stored hash matches too.
+** The hash here must stay the same as mime_hash() in libhttpd.c.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+
+#define MAX_ENTRIES 2000
+#define MAX_TRIES 10000000
+
+struct entry {
+    char* ext;
+    char* val;
+    unsigned int hash;
+    int bucket;
+    };
+
+static char* argv0;
+static struct entry entries[MAX_ENTRIES];
+static int n_entries;
+static int n_buckets, slot_bits;
+static unsigned int* disp;
+static int* slots;
+static int* bucket_order;
+static int* bucket_size;
+
+
+/* Forwards. */
+static void read_table( void );
+static unsigned int mime_hash( char* s, size_t len );
+static int mime_slot( unsigned int hash, unsigned int d );
+static int bucket_compare( const void* v1, const void* v2 );
+static void place_buckets( void );
+static void write_string( char* s );
+static void write_table( char* prefix );
+static void* xmalloc( size_t size );
+
+
+int
+main( int argc, char** argv )
+    {
+    int i, j;
+
+    argv0 = argv[0];
+    if ( argc != 2 )
+	{
+	(void) fprintf( stderr, "usage:  %s prefix\n", argv0 );
+	exit( 1 );
+	}
+
+    read_table();
+
+    /* Aim for about four extensions per bucket, and a table no more than
+    ** half full.  Both are powers of two so they can be masked.
+    */
+    for ( n_buckets = 1; n_buckets * 4 < n_entries; n_buckets *= 2 )
+	;
+    for ( slot_bits = 1; ( 1 << slot_bits ) < n_entries * 2; ++slot_bits )
+	;
+    for ( i = 0; i < n_entries; ++i )
+	{
+	for ( j = 0; j < i; ++j )
+	    if ( strcasecmp( entries[i].ext, entries[j].ext ) == 0 )
+		{
+		(void) fprintf(
+		    stderr, "%s: extension \"%s\" is listed twice\n",
+		    argv0, entries[i].ext );
+		exit( 1 );
+		}
+	entries[i].hash = mime_hash( entries[i].ext, strlen( entries[i].ext ) );
+	entries[i].bucket = entries[i].hash & ( n_buckets - 1 );
+	}
+
+    place_buckets();
+    write_table( argv[1] );
+    exit( 0 );
+    }
+
+
+/* Lines are an extension, whitespace, and the value, with # comments. */
+static void
+read_table( void )
+    {
+    char line[1000];
+    char* cp;
+    char* ext;
+    char* val;
+
+    n_entries = 0;
+    while ( fgets( line, sizeof(line), stdin ) != (char*) 0 )
+	{
+	if ( ( cp = strchr( line, '#' ) ) != (char*) 0 )
+	    *cp = '\0';
+	for ( cp = &line[strlen(line)]; cp > line && isspace( (unsigned char) cp[-1] ); --cp )
+	    ;
+	*cp = '\0';
+	ext = line;
+	while ( isspace( (unsigned char) *ext ) )
+	    ++ext;
+	if ( *ext == '\0' )
+	    continue;
+	for ( val = ext; *val != '\0' && ! isspace( (unsigned char) *val ); ++val )
+	    ;
+	if ( *val == '\0' )
+	    {
+	    (void) fprintf(
+		stderr, "%s: extension \"%s\" has no value\n", argv0, ext );
+	    exit( 1 );
+	    }
+	*val++ = '\0';
+	while ( isspace( (unsigned char) *val ) )
+	    ++val;
+	if ( n_entries >= MAX_ENTRIES )
+	    {
+	    (void) fprintf( stderr, "%s: too many entries\n", argv0 );
+	    exit( 1 );
+	    }
+	entries[n_entries].ext = strdup( ext );
+	entries[n_entries].val = strdup( val );
+	if ( entries[n_entries].ext == (char*) 0 ||
+	     entries[n_entries].val == (char*) 0 )
+	    {
+	    (void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	    exit( 1 );
+	    }
+	++n_entries;
+	}
+    }
+
+
+/* FNV-1a over the extension with ASCII letters folded to lower case.
+** Folding with | 0x20 also merges a few punctuation characters with
+** control characters, which is harmless because a hit is always
+** confirmed with strncasecmp().
+*/
+static unsigned int
+mime_hash( char* s, size_t len )
+    {
+    unsigned int h = 2166136261U;
+    size_t i;
+
+    for ( i = 0; i < len; ++i )
+	h = ( h ^ (unsigned int) ( (unsigned char) s[i] | 0x20 ) ) * 16777619U;
+    return h;
+    }
+
+
+static int
+mime_slot( unsigned int hash, unsigned int d )
+    {
+    return ( ( hash ^ d ) * 2654435761U ) >> ( 32 - slot_bits );
+    }
+
+
+/* Sorts bucket numbers so the fullest buckets get placed first. */
+static int
+bucket_compare( const void* v1, const void* v2 )
+    {
+    const int* b1 = (const int*) v1;
+    const int* b2 = (const int*) v2;
+
+    if ( bucket_size[*b1] != bucket_size[*b2] )
+	return bucket_size[*b2] - bucket_size[*b1];
+    return *b1 - *b2;
+    }
+
+
+static void
+place_buckets( void )
+    {
+    int n_slots = 1 << slot_bits;
+    int i, j, b, s;
+    unsigned int d;
+
+    disp = (unsigned int*) xmalloc( n_buckets * sizeof(*disp) );
+    bucket_order = (int*) xmalloc( n_buckets * sizeof(*bucket_order) );
+    bucket_size = (int*) xmalloc( n_buckets * sizeof(*bucket_size) );
+    slots = (int*) xmalloc( n_slots * sizeof(*slots) );
+    for ( b = 0; b < n_buckets; ++b )
+	{
+	disp[b] = 0;
+	bucket_order[b] = b;
+	bucket_size[b] = 0;
+	}
+    for ( i = 0; i < n_entries; ++i )
+	++bucket_size[entries[i].bucket];
+    for ( s = 0; s < n_slots; ++s )
+	slots[s] = -1;
+    qsort( bucket_order, n_buckets, sizeof(*bucket_order), bucket_compare );
+
+    for ( j = 0; j < n_buckets; ++j )
+	{
+	b = bucket_order[j];
+	if ( bucket_size[b] == 0 )
+	    break;
+	for ( d = 0; d < MAX_TRIES; ++d )
+	    {
+	    /* Try this displacement; back it out if anything collides. */
+	    for ( i = 0; i < n_entries; ++i )
+		{
+		if ( entries[i].bucket != b )
+		    continue;
+		s = mime_slot( entries[i].hash, d );
+		if ( slots[s] != -1 )
+		    break;
+		slots[s] = i;
+		}
+	    if ( i == n_entries )
+		break;
+	    for ( i = 0; i < n_entries; ++i )
+		if ( entries[i].bucket == b )
+		    {
+		    s = mime_slot( entries[i].hash, d );
+		    if ( slots[s] == i )
+			slots[s] = -1;
+		    }
+	    }
+	if ( d == MAX_TRIES )
+	    {
+	    (void) fprintf( stderr, "%s: couldn't place bucket %d\n", argv0, b );
+	    exit( 1 );
+	    }
+	disp[b] = d;
+	}
+    }
+
+
+static void
+write_string( char* s )
+    {
+    (void) putchar( '"' );
+    for ( ; *s != '\0'; ++s )
+	{
+	if ( *s == '"' || *s == '\\' )
+	    (void) putchar( '\\' );
+	(void) putchar( *s );
+	}
+    (void) putchar( '"' );
+    }
+
+
+static void
+write_table( char* prefix )
+    {
+    int n_slots = 1 << slot_bits;
+    char upper[100];
+    int i, b, s;
+
+    for ( i = 0; prefix[i] != '\0' && i < sizeof(upper) - 1; ++i )
+	upper[i] = toupper( (unsigned char) prefix[i] );
+    upper[i] = '\0';
+
+    (void) printf( "/* Generated by mimehash, do not edit. */\n\n" );
+    (void) printf( "#define %s_BUCKETS %d\n", upper, n_buckets );
+    (void) printf( "#define %s_SLOT_BITS %d\n\n", upper, slot_bits );
+    (void) printf(
+	"static const unsigned int %s_disp[%s_BUCKETS] = {\n", prefix, upper );
+    for ( b = 0; b < n_buckets; ++b )
+	(void) printf( "    %uU,\n", disp[b] );
+    (void) printf( "    };\n\n" );
+    (void) printf(
+	"static const struct mime_entry %s_tab[1 << %s_SLOT_BITS] = {\n",
+	prefix, upper );
+    for ( s = 0; s < n_slots; ++s )
+	{
+	i = slots[s];
+	if ( i == -1 )
+	    {
+	    (void) printf( "    { (char*) 0, 0, (char*) 0, 0, 0 },\n" );
+	    continue;
+	    }
+	(void) printf( "    { " );
+	write_string( entries[i].ext );
+	(void) printf( ", %d, ", (int) strlen( entries[i].ext ) );
+	write_string( entries[i].val );
+	(void) printf(
+	    ", %d, 0x%08xU },\n", (int) strlen( entries[i].val ),
+	    entries[i].hash );
+	}
+    (void) printf( "    };\n" );
+    }
+
+
+static void*
+xmalloc( size_t size )
+    {
+    void* p = malloc( size );
+
+    if ( p == (void*) 0 )
+	{
+	(void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	exit( 1 );
+	}
+    return p;
+    }
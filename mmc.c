@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <fcntl.h>
 #include <syslog.h>
@@ -42,6 +43,14 @@
 #include <sys/mman.h>
 #endif /* HAVE_MMAP */
 
+#ifdef HAVE_SHM_OPEN
+#include <signal.h>
+#endif /* HAVE_SHM_OPEN */
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+
 #include "mmc.h"
 #include "libhttpd.h"
 
@@ -66,14 +75,51 @@ typedef long long int64_t;
 #ifndef INITIAL_HASH_SIZE
 #define INITIAL_HASH_SIZE (1 << 10)
 #endif
-
-#ifndef MAX
-#define MAX(a,b) ((a)>(b)?(a):(b))
+#ifndef SMALL_FILE_SIZE
+#define SMALL_FILE_SIZE 16384
+#endif
+#ifndef LARGE_FILE_SIZE
+#define LARGE_FILE_SIZE 33554432
 #endif
+
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
 
+/* The shared cache needs named shared memory and atomic operations. */
+#if defined(SHARED_CACHE_SIZE) && defined(HAVE_MMAP) && defined(HAVE_SHM_OPEN) && defined(__GNUC__)
+#define SHARED_CACHE
+#endif
+
+/* Files we just keep open rather than map or read in. */
+#ifdef HAVE_MMAP
+#define HOLD_OPEN(size) \
+    ( ( fd_mode && (size) > SMALL_FILE_SIZE ) || (size) > LARGE_FILE_SIZE )
+#else /* HAVE_MMAP */
+#define HOLD_OPEN(size) ( fd_mode && (size) > SMALL_FILE_SIZE )
+#endif /* HAVE_MMAP */
+
+/* The frequency sketch used for admission: SKETCH_ROWS rows of small
+** saturating counters, all halved every SKETCH_RESET additions so that
+** old popularity fades away.
+*/
+#define SKETCH_BITS 12
+#define SKETCH_WIDTH (1 << SKETCH_BITS)
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+#define SKETCH_RESET ( SKETCH_WIDTH * 10 )
+
+/* Nanoseconds of a change time, where the system keeps them. */
+#ifdef HAVE_ST_MTIM
+#define CT_NSEC(sbP) ( (long) (sbP)->st_ctim.tv_nsec )
+#else /* HAVE_ST_MTIM */
+#define CT_NSEC(sbP) 0L
+#endif /* HAVE_ST_MTIM */
+
+#define OVER_BUDGET() \
+    ( mapped_bytes > DESIRED_MAX_MAPPED_BYTES || \
+      map_count > DESIRED_MAX_MAPPED_FILES )
+
 
 /* The Map struct. */
 typedef struct MapStruct {
@@ -81,12 +127,22 @@ typedef struct MapStruct {
     dev_t dev;
     off_t size;
     time_t ct;
+    long ct_nsec;
     int refcount;
     time_t reftime;
     void* addr;
+    int fd;
+    char* header_name;
+    char* header;
+    int admitted;
+    int shared;
+    unsigned int gen;
     unsigned int hash;
     int hash_idx;
     struct MapStruct* next;
+    struct MapStruct* prev;
+    struct MapStruct* lru_next;
+    struct MapStruct* lru_prev;
     } Map;
 
 
@@ -97,18 +153,139 @@ static int alloc_count = 0, map_count = 0, free_count = 0;
 static Map** hash_table = (Map**) 0;
 static int hash_size;
 static unsigned int hash_mask;
-static time_t expire_age = DEFAULT_EXPIRE_AGE;
 static off_t mapped_bytes = 0;
+static int fd_mode = 0;
+
+/* Unreferenced entries, least recently used first. */
+static Map* lru_head = (Map*) 0;
+static Map* lru_tail = (Map*) 0;
+static long evict_count = 0, reject_count = 0;
+
+#ifdef SHARED_CACHE
+/* The shared cache is one region of named shared memory, and every thttpd
+** process serving the same document root on the host uses the same one -
+** workers of one server, and separate servers too.  It holds an
+** open-addressing table of small files plus an arena of their contents.
+** Entries are never changed once they're ready, so lookups need no locks;
+** inserts claim a slot with a compare-and-swap and bump-allocate from the
+** arena.  A header at the front says what build made the region and how
+** it's laid out, so a process that wouldn't agree stays out of it.
+**
+** The arena is split into two halves, used by alternate generations.
+** When the current half fills up the cache moves on to the next
+** generation, which starts over in the other half and forgets everything
+** that was in it.  That is only allowed once no process has anything from
+** that half still mapped, so each process claims an Owner entry where it
+** counts its references into each half, and lets go of old-generation
+** entries as soon as it can.  The entries of processes that died are
+** taken back when they get in the way.  Until the move can happen, new
+** files just stay private to each process.
+*/
+#define SHARED_MAGIC 0x74687463
+#define SHARED_VERSION 1
+#define SHARED_OWNERS 256
+#define SHARED_HEADER_SIZE 128
+#define SLOT_EMPTY 0
+#define SLOT_FILLING 1
+#define SLOT_READY 2
+#define SLOT_DEAD 3
+#define SLOT_TAG(gen,state) ( ( (gen) << 2 ) | (state) )
+#define SLOT_GEN(tag) ( (tag) >> 2 )
+#define SLOT_STATE(tag) ( (tag) & 3 )
+#define SHARED_PROBES 16
+
+#define SHARED_LOAD(x) __atomic_load_n( &(x), __ATOMIC_SEQ_CST )
+#define SHARED_STORE(x,v) __atomic_store_n( &(x), (v), __ATOMIC_SEQ_CST )
+
+typedef struct {
+    unsigned int tag;	/* generation and state */
+    ino_t ino;
+    dev_t dev;
+    off_t size;
+    time_t ct;
+    long ct_nsec;
+    size_t offset;
+    } Slot;
+
+typedef struct {
+    unsigned int magic;	/* stored last, once the rest is filled in */
+    unsigned int version;
+    size_t region_size;
+    size_t nslots;
+    size_t half_size;
+    unsigned int gen;	/* current generation, which uses half gen & 1 */
+    int moving;		/* held while moving to the next generation */
+    size_t used[2];	/* bytes handed out from each half */
+    } SharedHeader;
+
+typedef struct {
+    int pid;		/* 0 if free, -1 while being taken back */
+    int pins[2];	/* references into each half */
+    } Owner;
+
+static SharedHeader* shared_header = (SharedHeader*) 0;
+static Owner* shared_owners;
+static Slot* shared_slots;
+static unsigned int shared_mask;
+static char* shared_data[2];
+static size_t shared_half_size;
+static Owner* my_owner = (Owner*) 0;
+static int* my_pins = (int*) 0;	/* my_owner's, once this process has one */
+static unsigned int seen_gen = 0;
+#endif /* SHARED_CACHE */
+
+static unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+static int sketch_adds = 0;
+static const unsigned int sketch_seeds[SKETCH_ROWS] = {
+    0x5bd1e995, 0x1b873593, 0xcc9e2d51, 0x85ebca6b };
+
+/* The cache is shared by all the threads in a threaded build, so mapping,
+** unmapping, and cleanup hold this lock - though not while opening or
+** reading files.  mmc_term() and mmc_logstats() don't, since they can get
+** called from signal handlers.
+*/
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t mmc_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK() (void) pthread_mutex_lock( &mmc_lock )
+#define UNLOCK() (void) pthread_mutex_unlock( &mmc_lock )
+#else /* HAVE_LIBPTHREAD */
+#define LOCK()
+#define UNLOCK()
+#endif /* HAVE_LIBPTHREAD */
 
 
 
 /* Forwards. */
-static void panic( void );
-static void really_unmap( Map** mm );
+static void* find_map( struct stat* sbP, time_t now, int count );
+static void* load( int* fdP, struct stat* sbP, int* sharedP, unsigned int* genP );
+static void* add_map( struct stat* sbP, time_t now, void* addr, int fd, int shared, unsigned int gen );
+static void unload( void* addr, off_t size, int fd, int shared, unsigned int gen );
+static int locked_evict( void );
+static void release( Map* m );
+static int evict_lru( void );
+static void lru_add( Map* m );
+static void lru_remove( Map* m );
+static unsigned int sketch_index( unsigned int kh, int row );
+static void sketch_touch( unsigned int kh );
+static int sketch_freq( unsigned int kh );
+static void really_unmap( Map* m );
+static int stale( Map* m );
+static void drop_stale( void );
+static Map* find_current( struct stat* sbP );
+#ifdef SHARED_CACHE
+static void* shared_find( struct stat* sbP, unsigned int* genP );
+static void* shared_add( int fd, struct stat* sbP, unsigned int* genP );
+static Slot* shared_claim( struct stat* sbP, unsigned int gen );
+static void shared_move( unsigned int gen );
+static void shared_pin( unsigned int gen, int n );
+static int shared_reap( Owner* o );
+#endif /* SHARED_CACHE */
 static int check_hash_size( void );
 static int add_hash( Map* m );
-static Map* find_hash( ino_t ino, dev_t dev, off_t size, time_t ct );
+static Map* find_hash( struct stat* sbP );
+static Map* find_addr( void* addr, struct stat* sbP );
 static unsigned int hash( ino_t ino, dev_t dev, off_t size, time_t ct );
+static unsigned int key_hash( ino_t ino, dev_t dev, off_t size, time_t ct );
 
 
 void*
@@ -116,8 +293,11 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
     {
     time_t now;
     struct stat sb;
-    Map* m;
+    struct stat fsb;
+    void* addr;
     int fd;
+    int shared = 0;
+    unsigned int gen = 0;
 
     /* Stat the file, if necessary. */
     if ( sbP != (struct stat*) 0 )
@@ -137,29 +317,210 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
     else
 	now = time( (time_t*) 0 );
 
-    /* See if we have it mapped already, via the hash table. */
+    /* See if we have it already.  Only the bookkeeping is done under the
+    ** lock; opening and reading the file happen without it, so one thread
+    ** waiting on the disk doesn't hold up all the others.
+    */
+    LOCK();
+    addr = find_map( &sb, now, 1 );
+    UNLOCK();
+    if ( addr != (void*) 0 )
+	return addr;
+
+    fd = -1;
+#ifdef SHARED_CACHE
+    /* Another process may have read it into the shared cache already,
+    ** in which case we don't even have to open it.
+    */
+    if ( sb.st_size > 0 && sb.st_size <= SMALL_FILE_SIZE )
+	{
+	addr = shared_find( &sb, &gen );
+	if ( addr != (void*) 0 )
+	    shared = 1;
+	}
+#endif /* SHARED_CACHE */
+
+    if ( ! shared )
+	{
+	/* Open the file.  If we're out of descriptors, maybe because
+	** we're holding them all, give back unreferenced ones until it
+	** works.
+	*/
+	fd = open( filename, O_RDONLY );
+	while ( fd < 0 && fd_mode &&
+		( errno == EMFILE || errno == ENFILE ) && locked_evict() )
+	    fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+	    {
+	    syslog( LOG_ERR, "open - %m" );
+	    return (void*) 0;
+	    }
+
+	/* The caller's stat buffer may be a cached one, so make sure it
+	** still describes the file we just opened.  If not, go by the
+	** file, tell the caller, and look again.
+	*/
+	if ( sbP != (struct stat*) 0 && fstat( fd, &fsb ) == 0 &&
+	     ( fsb.st_ino != sb.st_ino || fsb.st_dev != sb.st_dev ||
+	       fsb.st_size != sb.st_size || fsb.st_ctime != sb.st_ctime ||
+	       CT_NSEC( &fsb ) != CT_NSEC( &sb ) ) )
+	    {
+	    sb = fsb;
+	    *sbP = fsb;
+	    LOCK();
+	    addr = find_map( &sb, now, 0 );
+	    UNLOCK();
+	    if ( addr != (void*) 0 )
+		{
+		(void) close( fd );
+		return addr;
+		}
+	    }
+
+	addr = load( &fd, &sb, &shared, &gen );
+	if ( addr == (void*) 0 )
+	    return (void*) 0;
+	}
+
+    LOCK();
+    addr = add_map( &sb, now, addr, fd, shared, gen );
+    UNLOCK();
+    return addr;
+    }
+
+
+/* Looks for a current Map for the file, and takes a reference on it if
+** there is one.  Call with the lock held.
+*/
+static void*
+find_map( struct stat* sbP, time_t now, int count )
+    {
+    Map* m;
+
+#ifdef SHARED_CACHE
+    /* If the shared cache has moved on, let go of what we can from before
+    ** right away, so the next move doesn't have to wait for us.
+    */
+    if ( my_pins != (int*) 0 &&
+	 SHARED_LOAD( shared_header->gen ) != seen_gen )
+	{
+	seen_gen = SHARED_LOAD( shared_header->gen );
+	drop_stale();
+	}
+#endif /* SHARED_CACHE */
+
+    /* Count the request for the admission policy. */
+    if ( count )
+	sketch_touch(
+	    key_hash( sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime ) );
+
+    if ( hash_table == (Map**) 0 )
+	return (void*) 0;
+    m = find_current( sbP );
+    if ( m == (Map*) 0 )
+	return (void*) 0;
+    if ( m->refcount == 0 )
+	lru_remove( m );
+    ++m->refcount;
+    m->reftime = now;
+    return m->addr;
+    }
+
+
+/* Gets the contents of an open file into memory, or decides to keep it
+** open, without the lock.  *fdP is left open only in that last case,
+** otherwise it gets closed and set to -1.  Returns (void*) 0 on errors.
+*/
+static void*
+load( int* fdP, struct stat* sbP, int* sharedP, unsigned int* genP )
+    {
+    int fd = *fdP;
+    size_t size_size = (size_t) sbP->st_size;	/* loses on files >2GB */
+    void* addr;
+
+    *fdP = -1;
+
+    /* Avoid doing anything for zero-length files; some systems don't like
+    ** to mmap them, other systems dislike mallocing zero bytes.
+    */
+    if ( size_size == 0 )
+	addr = (void*) 1;	/* arbitrary non-NULL address */
+#ifdef SHARED_CACHE
+    else if ( size_size <= SMALL_FILE_SIZE &&
+	      ( addr = shared_add( fd, sbP, genP ) ) != (void*) 0 )
+	*sharedP = 1;
+#endif /* SHARED_CACHE */
+    else if ( HOLD_OPEN( sbP->st_size ) )
+	{
+	/* Just hang on to the open file.  Its Map will be its address. */
+	*fdP = fd;
+	return (void*) 1;
+	}
+#ifdef HAVE_MMAP
+    else if ( size_size > SMALL_FILE_SIZE )
+	{
+	/* Map the file into memory. */
+	addr = mmap( 0, size_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	/* Ooo, out of address space.  Free unreferenced maps until it fits. */
+	while ( addr == (void*) -1 && errno == ENOMEM && locked_evict() )
+	    addr = mmap( 0, size_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if ( addr == (void*) -1 )
+	    {
+	    syslog( LOG_ERR, "mmap - %m" );
+	    addr = (void*) 0;
+	    }
+	}
+#endif /* HAVE_MMAP */
+    else
+	{
+	/* Small files, or all files without mmap(), just get read into
+	** memory.  A mapping or an open descriptor costs the kernel more
+	** than a little malloc.
+	*/
+	addr = (void*) malloc( size_size );
+	/* Ooo, out of memory.  Free unreferenced maps until it fits. */
+	while ( addr == (void*) 0 && locked_evict() )
+	    addr = (void*) malloc( size_size );
+	if ( addr == (void*) 0 )
+	    syslog( LOG_ERR, "out of memory storing a file" );
+	else if ( httpd_read_fully( fd, addr, size_size ) != size_size )
+	    {
+	    syslog( LOG_ERR, "read - %m" );
+	    free( addr );
+	    addr = (void*) 0;
+	    }
+	}
+    (void) close( fd );
+    return addr;
+    }
+
+
+/* Makes a Map for what load() came up with, unless another thread got
+** the same file in first, in which case its Map gets used and ours is
+** thrown away.  Call with the lock held.
+*/
+static void*
+add_map( struct stat* sbP, time_t now, void* addr, int fd, int shared, unsigned int gen )
+    {
+    Map* m;
+
     if ( check_hash_size() < 0 )
 	{
 	syslog( LOG_ERR, "check_hash_size() failure" );
+	unload( addr, sbP->st_size, fd, shared, gen );
 	return (void*) 0;
 	}
-    m = find_hash( sb.st_ino, sb.st_dev, sb.st_size, sb.st_ctime );
+    m = find_current( sbP );
     if ( m != (Map*) 0 )
 	{
-	/* Yep.  Just return the existing map */
+	unload( addr, sbP->st_size, fd, shared, gen );
+	if ( m->refcount == 0 )
+	    lru_remove( m );
 	++m->refcount;
 	m->reftime = now;
 	return m->addr;
 	}
 
-    /* Open the file. */
-    fd = open( filename, O_RDONLY );
-    if ( fd < 0 )
-	{
-	syslog( LOG_ERR, "open - %m" );
-	return (void*) 0;
-	}
-
     /* Find a free Map entry or make a new one. */
     if ( free_maps != (Map*) 0 )
 	{
@@ -172,118 +533,105 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	m = (Map*) malloc( sizeof(Map) );
 	if ( m == (Map*) 0 )
 	    {
-	    (void) close( fd );
+	    unload( addr, sbP->st_size, fd, shared, gen );
 	    syslog( LOG_ERR, "out of memory allocating a Map" );
 	    return (void*) 0;
 	    }
 	++alloc_count;
 	}
 
-    /* Fill in the Map entry. */
-    m->ino = sb.st_ino;
-    m->dev = sb.st_dev;
-    m->size = sb.st_size;
-    m->ct = sb.st_ctime;
+    /* Fill in the Map entry.  A held-open file has no memory of its own,
+    ** so the Map itself makes a handy unique address.
+    */
+    m->ino = sbP->st_ino;
+    m->dev = sbP->st_dev;
+    m->size = sbP->st_size;
+    m->ct = sbP->st_ctime;
+    m->ct_nsec = CT_NSEC( sbP );
     m->refcount = 1;
     m->reftime = now;
-
-    /* Avoid doing anything for zero-length files; some systems don't like
-    ** to mmap them, other systems dislike mallocing zero bytes.
-    */
-    if ( m->size == 0 )
-	m->addr = (void*) 1;	/* arbitrary non-NULL address */
-    else
-	{
-	size_t size_size = (size_t) m->size;	/* loses on files >2GB */
-#ifdef HAVE_MMAP
-	/* Map the file into memory. */
-	m->addr = mmap( 0, size_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-	if ( m->addr == (void*) -1 && errno == ENOMEM )
-	    {
-	    /* Ooo, out of address space.  Free all unreferenced maps
-	    ** and try again.
-	    */
-	    panic();
-	    m->addr = mmap( 0, size_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-	    }
-	if ( m->addr == (void*) -1 )
-	    {
-	    syslog( LOG_ERR, "mmap - %m" );
-	    (void) close( fd );
-	    free( (void*) m );
-	    --alloc_count;
-	    return (void*) 0;
-	    }
-#else /* HAVE_MMAP */
-	/* Read the file into memory. */
-	m->addr = (void*) malloc( size_size );
-	if ( m->addr == (void*) 0 )
-	    {
-	    /* Ooo, out of memory.  Free all unreferenced maps
-	    ** and try again.
-	    */
-	    panic();
-	    m->addr = (void*) malloc( size_size );
-	    }
-	if ( m->addr == (void*) 0 )
-	    {
-	    syslog( LOG_ERR, "out of memory storing a file" );
-	    (void) close( fd );
-	    free( (void*) m );
-	    --alloc_count;
-	    return (void*) 0;
-	    }
-	if ( httpd_read_fully( fd, m->addr, size_size ) != size_size )
-	    {
-	    syslog( LOG_ERR, "read - %m" );
-	    (void) close( fd );
-	    free( (void*) m );
-	    --alloc_count;
-	    return (void*) 0;
-	    }
-#endif /* HAVE_MMAP */
-	}
-    (void) close( fd );
+    m->fd = fd;
+    m->addr = fd != -1 ? (void*) m : addr;
+    m->header_name = m->header = (char*) 0;
+    m->admitted = 0;
+    m->shared = shared;
+    m->gen = gen;
 
     /* Put the Map into the hash table. */
     if ( add_hash( m ) < 0 )
 	{
 	syslog( LOG_ERR, "add_hash() failure" );
+	unload( addr, sbP->st_size, fd, shared, gen );
 	free( (void*) m );
 	--alloc_count;
 	return (void*) 0;
 	}
 
     /* Put the Map on the active list. */
+    m->prev = (Map*) 0;
     m->next = maps;
+    if ( maps != (Map*) 0 )
+	maps->prev = m;
     maps = m;
     ++map_count;
 
-    /* Update the total byte count. */
-    mapped_bytes += m->size;
+    /* Update the total byte count.  Open files and the shared cache don't
+    ** take up any memory of ours.
+    */
+    if ( m->fd == -1 && ! m->shared )
+	mapped_bytes += m->size;
 
     /* And return the address. */
     return m->addr;
     }
 
 
+/* Lets go of what load() got for a file. */
+static void
+unload( void* addr, off_t size, int fd, int shared, unsigned int gen )
+    {
+    if ( fd != -1 )
+	(void) close( fd );
+#ifdef SHARED_CACHE
+    else if ( shared )
+	shared_pin( gen, -1 );
+#endif /* SHARED_CACHE */
+    else if ( size != 0 )
+	{
+#ifdef HAVE_MMAP
+	if ( size > SMALL_FILE_SIZE )
+	    {
+	    if ( munmap( addr, size ) < 0 )
+		syslog( LOG_ERR, "munmap - %m" );
+	    }
+	else
+#endif /* HAVE_MMAP */
+	    free( addr );
+	}
+    }
+
+
+/* evict_lru() for use without the lock held. */
+static int
+locked_evict( void )
+    {
+    int r;
+
+    LOCK();
+    r = evict_lru();
+    UNLOCK();
+    return r;
+    }
+
+
 void
 mmc_unmap( void* addr, struct stat* sbP, struct timeval* nowP )
     {
-    Map* m = (Map*) 0;
+    Map* m;
 
-    /* Find the Map entry for this address.  First try a hash. */
-    if ( sbP != (struct stat*) 0 )
-	{
-	m = find_hash( sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime );
-	if ( m != (Map*) 0 && m->addr != addr )
-	    m = (Map*) 0;
-	}
-    /* If that didn't work, try a full search. */
-    if ( m == (Map*) 0 )
-	for ( m = maps; m != (Map*) 0; m = m->next )
-	    if ( m->addr == addr )
-		break;
+    LOCK();
+
+    m = find_addr( addr, sbP );
     if ( m == (Map*) 0 )
 	syslog( LOG_ERR, "mmc_unmap failed to find entry!" );
     else if ( m->refcount <= 0 )
@@ -295,7 +643,119 @@ mmc_unmap( void* addr, struct stat* sbP, struct timeval* nowP )
 	    m->reftime = nowP->tv_sec;
 	else
 	    m->reftime = time( (time_t*) 0 );
+	if ( m->refcount == 0 )
+	    release( m );
 	}
+
+    UNLOCK();
+    }
+
+
+int
+mmc_fd( void* addr, struct stat* sbP )
+    {
+    Map* m;
+    int fd = -1;
+
+    LOCK();
+    m = find_addr( addr, sbP );
+    if ( m != (Map*) 0 )
+	fd = m->fd;
+    UNLOCK();
+    return fd;
+    }
+
+
+char*
+mmc_header( void* addr, struct stat* sbP, char* name )
+    {
+    Map* m;
+    char* header = (char*) 0;
+
+    LOCK();
+    m = find_addr( addr, sbP );
+    if ( m != (Map*) 0 && m->header != (char*) 0 &&
+	 strcmp( m->header_name, name ) == 0 )
+	header = m->header;
+    UNLOCK();
+    return header;
+    }
+
+
+void
+mmc_set_header( void* addr, struct stat* sbP, char* name, char* header, size_t len )
+    {
+    Map* m;
+    char* hn;
+    char* h;
+
+    LOCK();
+    m = find_addr( addr, sbP );
+    if ( m != (Map*) 0 && m->header == (char*) 0 )
+	{
+	hn = (char*) malloc( strlen( name ) + 1 );
+	h = (char*) malloc( len + 1 );
+	if ( hn != (char*) 0 && h != (char*) 0 )
+	    {
+	    (void) strcpy( hn, name );
+	    (void) memcpy( h, header, len );
+	    h[len] = '\0';
+	    m->header_name = hn;
+	    m->header = h;
+	    }
+	else
+	    {
+	    if ( hn != (char*) 0 )
+		free( (void*) hn );
+	    if ( h != (char*) 0 )
+		free( (void*) h );
+	    }
+	}
+    UNLOCK();
+    }
+
+
+void*
+mmc_map_window( int fd, off_t start, size_t len )
+    {
+#ifdef HAVE_MMAP
+    void* addr;
+
+    addr = mmap( 0, len, PROT_READ, MAP_PRIVATE, fd, start );
+    if ( addr == (void*) -1 )
+	{
+	syslog( LOG_ERR, "mmap - %m" );
+	return (void*) 0;
+	}
+#ifdef MADV_SEQUENTIAL
+    /* We'll go through it once, front to back. */
+    (void) madvise( addr, len, MADV_SEQUENTIAL );
+#endif /* MADV_SEQUENTIAL */
+#ifdef POSIX_FADV_WILLNEED
+    /* And the next window will probably be wanted too. */
+    (void) posix_fadvise( fd, start + len, len, POSIX_FADV_WILLNEED );
+#endif /* POSIX_FADV_WILLNEED */
+    return addr;
+#else /* HAVE_MMAP */
+    return (void*) 0;
+#endif /* HAVE_MMAP */
+    }
+
+
+void
+mmc_unmap_window( void* addr, size_t len )
+    {
+#ifdef HAVE_MMAP
+    if ( munmap( addr, len ) < 0 )
+	syslog( LOG_ERR, "munmap - %m" );
+#endif /* HAVE_MMAP */
+    }
+
+
+void
+mmc_set_fd_mode( int on )
+    {
+    fd_mode = on;
     }
 
 
@@ -303,7 +763,6 @@ void
 mmc_cleanup( struct timeval* nowP )
     {
     time_t now;
-    Map** mm;
     Map* m;
 
     /* Get the current time, if necessary. */
@@ -312,25 +771,17 @@ mmc_cleanup( struct timeval* nowP )
     else
 	now = time( (time_t*) 0 );
 
-    /* Really unmap any unreferenced entries older than the age limit. */
-    for ( mm = &maps; *mm != (Map*) 0; )
-	{
-	m = *mm;
-	if ( m->refcount == 0 && now - m->reftime >= expire_age )
-	    really_unmap( mm );
-	else
-	    mm = &(*mm)->next;
-	}
+    LOCK();
+
+    drop_stale();
 
-    /* Adjust the age limit if there are too many bytes mapped, or
-    ** too many or too few files mapped.
+    /* Really unmap any unreferenced entries older than the age limit.
+    ** The LRU list is in order of release, so only its front needs
+    ** looking at.
     */
-    if ( mapped_bytes > DESIRED_MAX_MAPPED_BYTES )
-	expire_age = MAX( ( expire_age * 2 ) / 3, DEFAULT_EXPIRE_AGE / 10 );
-    else if ( map_count > DESIRED_MAX_MAPPED_FILES )
-	expire_age = MAX( ( expire_age * 2 ) / 3, DEFAULT_EXPIRE_AGE / 10 );
-    else if ( map_count < DESIRED_MAX_MAPPED_FILES / 2 )
-	expire_age = MIN( ( expire_age * 5 ) / 4, DEFAULT_EXPIRE_AGE * 3 );
+    while ( lru_head != (Map*) 0 &&
+	    now - lru_head->reftime >= DEFAULT_EXPIRE_AGE )
+	really_unmap( lru_head );
 
     /* Really free excess blocks on the free list. */
     while ( free_count > DESIRED_FREE_COUNT )
@@ -341,66 +792,609 @@ mmc_cleanup( struct timeval* nowP )
 	free( (void*) m );
 	--alloc_count;
 	}
+
+    UNLOCK();
     }
 
 
+/* An entry's last reference just went away.  Put it on the LRU list,
+** then get back under budget by unmapping from the front of the list.
+*/
 static void
-panic( void )
+release( Map* m )
     {
-    Map** mm;
-    Map* m;
+    int freq;
+
+    /* Nothing from an old shared cache generation is worth keeping. */
+    if ( stale( m ) )
+	{
+	if ( m->admitted )
+	    lru_add( m );	/* really_unmap() will expect it there */
+	really_unmap( m );
+	return;
+	}
+    if ( ! m->admitted )
+	{
+	/* The first time, a new entry only gets to push out older ones
+	** if it has been asked for more often than they have; otherwise
+	** it goes right away.  That way one pass over a big tree can't
+	** flush out the popular files.
+	*/
+	freq = sketch_freq( key_hash( m->ino, m->dev, m->size, m->ct ) );
+	while ( OVER_BUDGET() && lru_head != (Map*) 0 )
+	    {
+	    if ( freq <= sketch_freq( key_hash(
+		     lru_head->ino, lru_head->dev, lru_head->size,
+		     lru_head->ct ) ) )
+		{
+		++reject_count;
+		really_unmap( m );
+		return;
+		}
+	    ++evict_count;
+	    really_unmap( lru_head );
+	    }
+	m->admitted = 1;
+	}
+    lru_add( m );
+    while ( OVER_BUDGET() && lru_head != (Map*) 0 )
+	{
+	++evict_count;
+	really_unmap( lru_head );
+	}
+    }
+
+
+/* Unmaps the least recently used unreferenced entry.  Returns 0 if there
+** weren't any.
+*/
+static int
+evict_lru( void )
+    {
+    if ( lru_head == (Map*) 0 )
+	return 0;
+    ++evict_count;
+    really_unmap( lru_head );
+    return 1;
+    }
+
+
+static void
+lru_add( Map* m )
+    {
+    m->lru_next = (Map*) 0;
+    m->lru_prev = lru_tail;
+    if ( lru_tail != (Map*) 0 )
+	lru_tail->lru_next = m;
+    else
+	lru_head = m;
+    lru_tail = m;
+    }
+
+
+static void
+lru_remove( Map* m )
+    {
+    if ( m->lru_prev != (Map*) 0 )
+	m->lru_prev->lru_next = m->lru_next;
+    else
+	lru_head = m->lru_next;
+    if ( m->lru_next != (Map*) 0 )
+	m->lru_next->lru_prev = m->lru_prev;
+    else
+	lru_tail = m->lru_prev;
+    }
 
-    syslog( LOG_ERR, "mmc panic - freeing all unreferenced maps" );
 
-    /* Really unmap all unreferenced entries. */
-    for ( mm = &maps; *mm != (Map*) 0; )
+static unsigned int
+sketch_index( unsigned int kh, int row )
+    {
+    kh ^= sketch_seeds[row];
+    kh *= 2654435761U;
+    return ( kh >> ( 32 - SKETCH_BITS ) ) & ( SKETCH_WIDTH - 1 );
+    }
+
+
+static void
+sketch_touch( unsigned int kh )
+    {
+    int r, i;
+    unsigned char* cP;
+
+    for ( r = 0; r < SKETCH_ROWS; ++r )
 	{
-	m = *mm;
-	if ( m->refcount == 0 )
-	    really_unmap( mm );
-	else
-	    mm = &(*mm)->next;
+	cP = &sketch[r][sketch_index( kh, r )];
+	if ( *cP < SKETCH_MAX )
+	    ++*cP;
+	}
+    if ( ++sketch_adds >= SKETCH_RESET )
+	{
+	for ( r = 0; r < SKETCH_ROWS; ++r )
+	    for ( i = 0; i < SKETCH_WIDTH; ++i )
+		sketch[r][i] >>= 1;
+	sketch_adds = 0;
 	}
     }
 
 
+/* Estimated recent request count for a key: the smallest of its counters. */
+static int
+sketch_freq( unsigned int kh )
+    {
+    int r, c, freq;
+
+    freq = SKETCH_MAX;
+    for ( r = 0; r < SKETCH_ROWS; ++r )
+	{
+	c = sketch[r][sketch_index( kh, r )];
+	if ( c < freq )
+	    freq = c;
+	}
+    return freq;
+    }
+
+
 static void
-really_unmap( Map** mm )
+really_unmap( Map* m )
     {
-    Map* m;
+    unsigned int i;
+    Map* m2;
 
-    m = *mm;
-    if ( m->size != 0 )
+    unload( m->addr, m->size, m->fd, m->shared, m->gen );
+    if ( m->header != (char*) 0 )
 	{
-#ifdef HAVE_MMAP
-	if ( munmap( m->addr, m->size ) < 0 )
-	    syslog( LOG_ERR, "munmap - %m" );
-#else /* HAVE_MMAP */
-	free( (void*) m->addr );
-#endif /* HAVE_MMAP */
+	free( (void*) m->header_name );
+	free( (void*) m->header );
 	}
     /* Update the total byte count. */
-    mapped_bytes -= m->size;
+    if ( m->fd == -1 && ! m->shared )
+	mapped_bytes -= m->size;
+    /* Take it off the LRU list, if it's unreferenced. */
+    if ( m->refcount == 0 && m->admitted )
+	lru_remove( m );
     /* And move the Map to the free list. */
-    *mm = m->next;
+    if ( m->prev != (Map*) 0 )
+	m->prev->next = m->next;
+    else
+	maps = m->next;
+    if ( m->next != (Map*) 0 )
+	m->next->prev = m->prev;
     --map_count;
     m->next = free_maps;
     free_maps = m;
     ++free_count;
-    /* This will sometimes break hash chains, but that's harmless; the
-    ** unmapping code that searches the hash table knows to keep searching.
+    /* Take it out of the hash table, and put back the rest of its cluster
+    ** so that no probe chain gets broken.
     */
     hash_table[m->hash_idx] = (Map*) 0;
+    for ( i = ( m->hash_idx + 1 ) & hash_mask; hash_table[i] != (Map*) 0;
+	  i = ( i + 1 ) & hash_mask )
+	{
+	m2 = hash_table[i];
+	hash_table[i] = (Map*) 0;
+	(void) add_hash( m2 );
+	}
+    }
+
+
+void
+mmc_share( char* root )
+    {
+#ifdef SHARED_CACHE
+    size_t nslots, owners_size, header_size, region_size;
+    unsigned int h;
+    char* cp;
+    char name[32];
+    int fd, created, tries;
+    struct stat sb;
+    char* region;
+    SharedHeader* hdr;
+
+    /* Allow for files averaging a few K, with the table at most half full. */
+    nslots = 1024;
+    while ( nslots < SHARED_CACHE_SIZE / 2048 )
+	nslots <<= 1;
+    owners_size = ( SHARED_OWNERS * sizeof(Owner) + 63 ) & ~ (size_t) 63;
+    header_size = SHARED_HEADER_SIZE + owners_size + nslots * sizeof(Slot);
+    region_size = header_size + SHARED_CACHE_SIZE;
+
+    /* Name the region after the document root.  Two roots that happen to
+    ** hash the same just share a cache, which is harmless since entries
+    ** are keyed by the files themselves.
+    */
+    h = 0;
+    for ( cp = root; *cp != '\0'; ++cp )
+	h = h * 31 + (unsigned char) *cp;
+    (void) snprintf( name, sizeof(name), "/thttpd-%08x", h );
+
+    /* Create it, or else attach to the one that's there. */
+    created = 1;
+    fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if ( fd < 0 && errno == EEXIST )
+	{
+	created = 0;
+	fd = shm_open( name, O_RDWR, 0 );
+	}
+    if ( fd < 0 )
+	{
+	syslog( LOG_ERR, "shm_open %.80s - %m", name );
+	return;
+	}
+    if ( created )
+	{
+	if ( ftruncate( fd, region_size ) < 0 )
+	    {
+	    syslog( LOG_ERR, "ftruncate %.80s - %m", name );
+	    (void) close( fd );
+	    (void) shm_unlink( name );
+	    return;
+	    }
+	}
+    else
+	{
+	/* Whoever created it may still be setting it up. */
+	for ( tries = 0; tries < 100; ++tries )
+	    {
+	    if ( fstat( fd, &sb ) < 0 || sb.st_size != 0 )
+		break;
+	    (void) usleep( 10000 );
+	    }
+	if ( fstat( fd, &sb ) < 0 || sb.st_size != region_size )
+	    {
+	    syslog(
+		LOG_ERR, "shared cache %.80s is from a different build, not using it",
+		name );
+	    (void) close( fd );
+	    return;
+	    }
+	}
+    region = (char*) mmap(
+	0, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    (void) close( fd );
+    if ( region == (char*) -1 )
+	{
+	syslog( LOG_ERR, "mmap shared cache - %m" );
+	return;
+	}
+
+    /* A fresh region is all zeros, which is generation zero with nothing
+    ** used, no owners, and all empty slots.  It only needs its header.
+    */
+    hdr = (SharedHeader*) region;
+    if ( created )
+	{
+	hdr->version = SHARED_VERSION;
+	hdr->region_size = region_size;
+	hdr->nslots = nslots;
+	hdr->half_size = ( SHARED_CACHE_SIZE / 2 ) & ~ (size_t) 15;
+	SHARED_STORE( hdr->magic, SHARED_MAGIC );
+	}
+    else
+	{
+	for ( tries = 0;
+	      tries < 100 && SHARED_LOAD( hdr->magic ) != SHARED_MAGIC;
+	      ++tries )
+	    (void) usleep( 10000 );
+	if ( SHARED_LOAD( hdr->magic ) != SHARED_MAGIC ||
+	     hdr->version != SHARED_VERSION ||
+	     hdr->region_size != region_size || hdr->nslots != nslots ||
+	     hdr->half_size != ( ( SHARED_CACHE_SIZE / 2 ) & ~ (size_t) 15 ) )
+	    {
+	    syslog(
+		LOG_ERR, "shared cache %.80s is from a different build, not using it",
+		name );
+	    (void) munmap( region, region_size );
+	    return;
+	    }
+	}
+
+    shared_header = hdr;
+    shared_owners = (Owner*) ( region + SHARED_HEADER_SIZE );
+    shared_slots = (Slot*) ( region + SHARED_HEADER_SIZE + owners_size );
+    shared_mask = nslots - 1;
+    shared_half_size = hdr->half_size;
+    shared_data[0] = region + header_size;
+    shared_data[1] = shared_data[0] + shared_half_size;
+#endif /* SHARED_CACHE */
+    }
+
+
+void
+mmc_share_join( void )
+    {
+#ifdef SHARED_CACHE
+    int pid, pass, i;
+
+    if ( shared_header == (SharedHeader*) 0 || my_owner != (Owner*) 0 )
+	return;
+    /* Take a free Owner entry.  If there are none, take back the entries
+    ** of processes that have gone away, and try again.
+    */
+    pid = (int) getpid();
+    for ( pass = 0; pass < 2; ++pass )
+	{
+	for ( i = 0; i < SHARED_OWNERS; ++i )
+	    if ( __sync_bool_compare_and_swap( &shared_owners[i].pid, 0, pid ) )
+		{
+		my_owner = &shared_owners[i];
+		my_pins = my_owner->pins;
+		return;
+		}
+	for ( i = 0; i < SHARED_OWNERS; ++i )
+	    (void) shared_reap( &shared_owners[i] );
+	}
+    syslog( LOG_WARNING, "too many processes using the shared cache, not using it" );
+#endif /* SHARED_CACHE */
+    }
+
+
+/* Whether a Map holds on to an old generation of the shared cache. */
+static int
+stale( Map* m )
+    {
+#ifdef SHARED_CACHE
+    if ( m->shared )
+	return m->gen != SHARED_LOAD( shared_header->gen );
+#endif /* SHARED_CACHE */
+    return 0;
+    }
+
+
+/* Unmaps all the unreferenced entries from old shared cache generations,
+** so that their half of the arena can be reused.
+*/
+static void
+drop_stale( void )
+    {
+    Map* m;
+    Map* next;
+
+    for ( m = maps; m != (Map*) 0; m = next )
+	{
+	next = m->next;
+	if ( m->refcount == 0 && stale( m ) )
+	    really_unmap( m );
+	}
+    }
+
+
+/* Looks up a Map by its file, letting go of it instead if it's unused
+** and stale.
+*/
+static Map*
+find_current( struct stat* sbP )
+    {
+    Map* m;
+
+    m = find_hash( sbP );
+    if ( m != (Map*) 0 && m->refcount == 0 && stale( m ) )
+	{
+	really_unmap( m );
+	m = (Map*) 0;
+	}
+    return m;
     }
 
 
+#ifdef SHARED_CACHE
+/* Looks for a file in the current generation.  If it's there, the half
+** holding it stays pinned, and *genP says which generation to unpin later.
+*/
+static void*
+shared_find( struct stat* sbP, unsigned int* genP )
+    {
+    unsigned int gen, h, i, tag;
+    Slot* s;
+    Slot copy;
+
+    if ( my_pins == (int*) 0 )
+	return (void*) 0;
+
+    /* Pin first, then make sure the generation didn't move on meanwhile. */
+    gen = SHARED_LOAD( shared_header->gen );
+    shared_pin( gen, 1 );
+    if ( SHARED_LOAD( shared_header->gen ) == gen )
+	{
+	h = key_hash( sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime );
+	for ( i = 0; i < SHARED_PROBES; ++i )
+	    {
+	    s = &shared_slots[( h + i ) & shared_mask];
+	    tag = SHARED_LOAD( s->tag );
+	    if ( tag == SLOT_TAG( 0, SLOT_EMPTY ) )
+		break;
+	    if ( tag != SLOT_TAG( gen, SLOT_READY ) )
+		continue;
+	    /* Copy the key out, then check that a later generation didn't
+	    ** take the slot over while we were looking.
+	    */
+	    copy = *s;
+	    __sync_synchronize();
+	    if ( SHARED_LOAD( s->tag ) != tag )
+		continue;
+	    if ( copy.ino == sbP->st_ino && copy.dev == sbP->st_dev &&
+		 copy.size == sbP->st_size && copy.ct == sbP->st_ctime &&
+		 copy.ct_nsec == CT_NSEC( sbP ) )
+		{
+		*genP = gen;
+		return (void*) &shared_data[gen & 1][copy.offset];
+		}
+	    }
+	}
+    shared_pin( gen, -1 );
+    return (void*) 0;
+    }
+
+
+/* Reads a file into the shared cache.  Returns (void*) 0 if there's no
+** room, leaving the file offset where it was.  Otherwise it's the same
+** as shared_find().
+*/
+static void*
+shared_add( int fd, struct stat* sbP, unsigned int* genP )
+    {
+    unsigned int gen;
+    Slot* s;
+    size_t size, offset;
+    char* addr;
+
+    if ( my_pins == (int*) 0 )
+	return (void*) 0;
+    size = ( (size_t) sbP->st_size + 15 ) & ~ (size_t) 15;
+
+    gen = SHARED_LOAD( shared_header->gen );
+    shared_pin( gen, 1 );
+    addr = (char*) 0;
+    if ( SHARED_LOAD( shared_header->gen ) != gen )
+	s = (Slot*) 0;		/* moved on already */
+    else if ( SHARED_LOAD( shared_header->used[gen & 1] ) + size >
+	      shared_half_size )
+	{
+	shared_move( gen );	/* full, try for the next generation */
+	s = (Slot*) 0;
+	}
+    else
+	s = shared_claim( sbP, gen );
+    if ( s != (Slot*) 0 )
+	{
+	/* Get space for the contents and read them in. */
+	offset = __sync_fetch_and_add( &shared_header->used[gen & 1], size );
+	if ( offset + size > shared_half_size ||
+	     httpd_read_fully( fd, &shared_data[gen & 1][offset],
+		 sbP->st_size ) != sbP->st_size )
+	    {
+	    /* Out of room, or the read failed.  The slot is lost for
+	    ** this generation, but the table has plenty.
+	    */
+	    SHARED_STORE( s->tag, SLOT_TAG( gen, SLOT_DEAD ) );
+	    (void) lseek( fd, (off_t) 0, SEEK_SET );
+	    }
+	else
+	    {
+	    /* Fill in the key, and only then mark the slot ready. */
+	    s->ino = sbP->st_ino;
+	    s->dev = sbP->st_dev;
+	    s->size = sbP->st_size;
+	    s->ct = sbP->st_ctime;
+	    s->ct_nsec = CT_NSEC( sbP );
+	    s->offset = offset;
+	    SHARED_STORE( s->tag, SLOT_TAG( gen, SLOT_READY ) );
+	    addr = &shared_data[gen & 1][offset];
+	    }
+	}
+    if ( addr == (char*) 0 )
+	{
+	shared_pin( gen, -1 );
+	return (void*) 0;
+	}
+    *genP = gen;
+    return (void*) addr;
+    }
+
+
+/* Claims a slot for a file in this generation.  Empty slots will do, and
+** so will ones left over from earlier generations - except those still
+** being filled, unless their generation is too old for anyone to be
+** filling them any more.
+*/
+static Slot*
+shared_claim( struct stat* sbP, unsigned int gen )
+    {
+    unsigned int h, i, tag;
+    Slot* s;
+
+    h = key_hash( sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime );
+    for ( i = 0; i < SHARED_PROBES; ++i )
+	{
+	s = &shared_slots[( h + i ) & shared_mask];
+	tag = SHARED_LOAD( s->tag );
+	if ( tag != SLOT_TAG( 0, SLOT_EMPTY ) )
+	    {
+	    if ( SLOT_GEN( tag ) == gen )
+		continue;
+	    if ( SLOT_STATE( tag ) == SLOT_FILLING && gen - SLOT_GEN( tag ) < 2 )
+		continue;
+	    }
+	if ( __sync_bool_compare_and_swap(
+		 &s->tag, tag, SLOT_TAG( gen, SLOT_FILLING ) ) )
+	    return s;
+	}
+    return (Slot*) 0;
+    }
+
+
+/* Moves on from a full generation to the next one, which reuses the
+** other half of the arena.  Nobody may have anything pinned there, not
+** counting processes that have died, and only one process gets to do the
+** moving.
+*/
+static void
+shared_move( unsigned int gen )
+    {
+    int half, i;
+    Owner* o;
+
+    if ( __sync_lock_test_and_set( &shared_header->moving, 1 ) != 0 )
+	return;
+    half = ( gen + 1 ) & 1;
+    if ( SHARED_LOAD( shared_header->gen ) == gen )
+	{
+	for ( i = 0; i < SHARED_OWNERS; ++i )
+	    {
+	    o = &shared_owners[i];
+	    if ( SHARED_LOAD( o->pins[half] ) != 0 && ! shared_reap( o ) )
+		break;
+	    }
+	if ( i == SHARED_OWNERS )
+	    {
+	    SHARED_STORE( shared_header->used[half], 0 );
+	    SHARED_STORE( shared_header->gen, gen + 1 );
+	    }
+	}
+    __sync_lock_release( &shared_header->moving );
+    }
+
+
+/* Adds n references to the half of the arena used by a generation. */
+static void
+shared_pin( unsigned int gen, int n )
+    {
+    (void) __sync_fetch_and_add( &my_pins[gen & 1], n );
+    }
+
+
+/* Frees an Owner entry if its process has gone away.  Only the one that
+** marks it as being taken back clears its pins, so a process that grabs
+** it right afterwards doesn't lose any of its own.  This relies on all
+** the processes seeing the same process IDs.  Returns 1 if the entry is
+** free now.
+*/
+static int
+shared_reap( Owner* o )
+    {
+    int pid;
+
+    pid = SHARED_LOAD( o->pid );
+    if ( pid == 0 )
+	return 1;
+    if ( pid < 0 || kill( (pid_t) pid, 0 ) == 0 || errno != ESRCH )
+	return 0;
+    if ( ! __sync_bool_compare_and_swap( &o->pid, pid, -1 ) )
+	return 0;
+    SHARED_STORE( o->pins[0], 0 );
+    SHARED_STORE( o->pins[1], 0 );
+    SHARED_STORE( o->pid, 0 );
+    return 1;
+    }
+#endif /* SHARED_CACHE */
+
+
 void
 mmc_term( void )
     {
     Map* m;
 
     while ( maps != (Map*) 0 )
-	really_unmap( &maps );
+	really_unmap( maps );
     while ( free_maps != (Map*) 0 )
 	{
 	m = free_maps;
@@ -409,6 +1403,15 @@ mmc_term( void )
 	free( (void*) m );
 	--alloc_count;
 	}
+#ifdef SHARED_CACHE
+    /* Nothing is pinned any more, so give up our Owner entry. */
+    if ( my_owner != (Owner*) 0 )
+	{
+	my_pins = (int*) 0;
+	SHARED_STORE( my_owner->pid, 0 );
+	my_owner = (Owner*) 0;
+	}
+#endif /* SHARED_CACHE */
     }
 
 
@@ -479,20 +1482,21 @@ add_hash( Map* m )
 
 
 static Map*
-find_hash( ino_t ino, dev_t dev, off_t size, time_t ct )
+find_hash( struct stat* sbP )
     {
     unsigned int h, he, i;
     Map* m;
 
-    h = hash( ino, dev, size, ct );
+    h = hash( sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime );
     he = ( h + hash_size - 1 ) & hash_mask;
     for ( i = h; ; i = ( i + 1 ) & hash_mask )
 	{
 	m = hash_table[i];
 	if ( m == (Map*) 0 )
 	    break;
-	if ( m->hash == h && m->ino == ino && m->dev == dev &&
-	     m->size == size && m->ct == ct )
+	if ( m->hash == h && m->ino == sbP->st_ino &&
+	     m->dev == sbP->st_dev && m->size == sbP->st_size &&
+	     m->ct == sbP->st_ctime && m->ct_nsec == CT_NSEC( sbP ) )
 	    return m;
 	if ( i == he )
 	    break;
@@ -503,6 +1507,13 @@ find_hash( ino_t ino, dev_t dev, off_t size, time_t ct )
 
 static unsigned int
 hash( ino_t ino, dev_t dev, off_t size, time_t ct )
+    {
+    return key_hash( ino, dev, size, ct ) & hash_mask;
+    }
+
+
+static unsigned int
+key_hash( ino_t ino, dev_t dev, off_t size, time_t ct )
     {
     unsigned int h = 177573;
 
@@ -514,7 +1525,30 @@ hash( ino_t ino, dev_t dev, off_t size, time_t ct )
     h += h << 5;
     h ^= ct;
 
-    return h & hash_mask;
+    return h;
+    }
+
+
+/* Finds the active Map for an address.  Call with the lock held.  The
+** hash only finds it if the stat buffer still matches the file, so if
+** that doesn't work fall back on a full search.  A held-open file's
+** address is its Map, so a miss here must never be taken for a mapping.
+*/
+static Map*
+find_addr( void* addr, struct stat* sbP )
+    {
+    Map* m;
+
+    if ( sbP != (struct stat*) 0 )
+	{
+	m = find_hash( sbP );
+	if ( m != (Map*) 0 && m->addr == addr )
+	    return m;
+	}
+    for ( m = maps; m != (Map*) 0; m = m->next )
+	if ( m->addr == addr )
+	    return m;
+    return (Map*) 0;
     }
 
 
@@ -522,10 +1556,26 @@ hash( ino_t ino, dev_t dev, off_t size, time_t ct )
 void
 mmc_logstats( long secs )
     {
+#ifdef SHARED_CACHE
+    unsigned int gen;
+#endif /* SHARED_CACHE */
+
     syslog(
-	LOG_NOTICE, "  map cache - %d allocated, %d active (%lld bytes), %d free; hash size: %d; expire age: %lld",
+	LOG_NOTICE, "  map cache - %d allocated, %d active (%lld bytes), %d free; hash size: %d; %ld evicted, %ld not admitted",
 	alloc_count, map_count, (long long) mapped_bytes, free_count, hash_size,
-	(long long) expire_age );
+	evict_count, reject_count );
+    evict_count = reject_count = 0;
     if ( map_count + free_count != alloc_count )
 	syslog( LOG_ERR, "map counts don't add up!" );
+#ifdef SHARED_CACHE
+    if ( my_pins != (int*) 0 )
+	{
+	gen = SHARED_LOAD( shared_header->gen );
+	syslog(
+	    LOG_NOTICE, "  shared cache - generation %u, %lld of %lld bytes used",
+	    gen,
+	    (long long) MIN( shared_header->used[gen & 1], shared_half_size ),
+	    (long long) shared_half_size );
+	}
+#endif /* SHARED_CACHE */
     }
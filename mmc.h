@@ -30,6 +30,8 @@
 
 /* Returns an mmap()ed area for the given file, or (void*) 0 on errors.
 ** If you have a stat buffer on the file, pass it in, otherwise pass 0.
+** If the file turns out to have changed since the stat, the buffer gets
+** updated.
 ** Same for the current time.
 */
 void* mmc_map( char* filename, struct stat* sbP, struct timeval* nowP );
@@ -40,6 +42,54 @@ void* mmc_map( char* filename, struct stat* sbP, struct timeval* nowP );
 */
 void mmc_unmap( void* addr, struct stat* sbP, struct timeval* nowP );
 
+/* Returns the open descriptor behind an area returned by mmc_map(), or -1
+** if the file was mapped into memory instead.
+*/
+int mmc_fd( void* addr, struct stat* sbP );
+
+/* Files bigger than LARGE_FILE_SIZE never get mapped whole, mmc_map()
+** just keeps them open.  Use mmc_fd() to get the descriptor, and map
+** them a window at a time with these.  Windows are private to the
+** caller, and mmc_map_window() hints to the kernel that they'll be read
+** sequentially.  Returns (void*) 0 on errors.
+*/
+void* mmc_map_window( int fd, off_t start, size_t len );
+void mmc_unmap_window( void* addr, size_t len );
+
+/* Files of up to SMALL_FILE_SIZE bytes are just read into memory.  Any
+** area can also carry a piece of text for the caller, normally the part
+** of a response header that only depends on the file, such as its
+** Last-Modified line.  mmc_header() returns
+** the text stored for this area under the same name, or (char*) 0.
+** mmc_set_header() stores some.  Only the first text stored sticks, so
+** what mmc_header() returns stays good for as long as the area does.
+*/
+char* mmc_header( void* addr, struct stat* sbP, char* name );
+void mmc_set_header( void* addr, struct stat* sbP, char* name, char* header, size_t len );
+
+/* Turns fd mode on or off.  In fd mode, mmc_map() doesn't map files
+** bigger than SMALL_FILE_SIZE at all, it just keeps them open, and the
+** address it returns is only good for passing back to mmc_fd() and
+** mmc_unmap().  This is for
+** callers that send the files with something like sendfile().  Set it
+** before mapping anything.
+*/
+void mmc_set_fd_mode( int on );
+
+/* Attaches to the cache of small files in shared memory for the given
+** document root, creating it if this is the first process to want it,
+** if the package was built with SHARED_CACHE_SIZE.  Every process that
+** joins a cache with the same root, in this server or any other one on
+** the host, finds the files the others have read in without opening them.
+** The cache outlives the servers; a later one starts out with it warm.
+*/
+void mmc_share( char* root );
+
+/* Starts using the shared cache.  Each process that serves files calls
+** this once, after mmc_share() and after it's forked, if it is.
+*/
+void mmc_share_join( void );
+
 /* Clean up the mmc package, freeing any unused storage.
 ** This should be called periodically, say every five minutes.
 ** If you have the current time, pass it in, otherwise pass 0.
@@ -0,0 +1,457 @@
+/* stc.c - stat cache
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif /* HAVE_SYS_INOTIFY_H */
+
+#include "stc.h"
+#include "libhttpd.h"
+
+
+/* Defines. */
+#ifndef STAT_CACHE_SIZE
+#define STAT_CACHE_SIZE 4096
+#endif
+#if defined(STAT_CACHE_TIME) && ! defined(STAT_CACHE_WATCH_TIME)
+#define STAT_CACHE_WATCH_TIME STAT_CACHE_TIME
+#endif
+
+/* Kinds of entries.  KIND_WATCH entries just remember which directories
+** are being watched.  Symlink expansions add their flags to KIND_EXPAND.
+*/
+#define KIND_EMPTY 0
+#define KIND_STAT 1
+#define KIND_LSTAT 2
+#define KIND_WATCH 3
+#define KIND_EXPAND 4
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define WATCH_EVENTS \
+    ( IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+      IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR )
+#endif /* HAVE_SYS_INOTIFY_H */
+
+
+/* The Entry struct. */
+typedef struct {
+    int kind;
+    char* name;
+    size_t maxname;
+    time_t expires;
+    int result;
+    int err;
+    struct stat sb;
+    char* checked;
+    size_t maxchecked;
+    char* rest;
+    size_t maxrest;
+    } Entry;
+
+
+/* Globals. */
+static THREAD_LOCAL Entry* entries = (Entry*) 0;
+static THREAD_LOCAL int entry_count = 0;
+static THREAD_LOCAL long stats_hits = 0, stats_misses = 0;
+static THREAD_LOCAL long stats_flushes = 0;
+static THREAD_LOCAL int watch_fd = -1;
+
+
+/* Forwards. */
+static int cached_stat( int kind, char* filename, struct stat* sbP, struct timeval* nowP );
+static Entry* find_entry( int kind, char* name, time_t now );
+static Entry* new_entry( int kind, char* name, time_t expires );
+static int watch_dirs( char* filename, time_t now );
+static int watch_dir( char* dir, time_t now );
+static void flush( void );
+static void free_entry( Entry* e );
+static unsigned int hash( int kind, char* name );
+static time_t get_now( struct timeval* nowP );
+
+
+int
+stc_stat( char* filename, struct stat* sbP, struct timeval* nowP )
+    {
+    return cached_stat( KIND_STAT, filename, sbP, nowP );
+    }
+
+
+int
+stc_lstat( char* filename, struct stat* sbP, struct timeval* nowP )
+    {
+    return cached_stat( KIND_LSTAT, filename, sbP, nowP );
+    }
+
+
+static int
+cached_stat( int kind, char* filename, struct stat* sbP, struct timeval* nowP )
+    {
+    int r;
+#ifdef STAT_CACHE_TIME
+    time_t now, expires;
+    Entry* e;
+    int watched, err;
+    struct stat lsb;
+
+    now = get_now( nowP );
+    e = find_entry( kind, filename, now );
+    if ( e != (Entry*) 0 )
+	{
+	if ( e->result < 0 )
+	    {
+	    errno = e->err;
+	    return -1;
+	    }
+	*sbP = e->sb;
+	return 0;
+	}
+
+    /* Results can be trusted for longer if we'll hear about changes.
+    ** Start watching before looking, so no change can slip in between.
+    */
+    watched = watch_dirs( filename, now );
+#endif /* STAT_CACHE_TIME */
+
+    if ( kind == KIND_LSTAT )
+	r = lstat( filename, sbP );
+    else
+	r = stat( filename, sbP );
+
+#ifdef STAT_CACHE_TIME
+    err = errno;
+    /* The watches don't see changes to what a symlink points at. */
+    if ( watched && r >= 0 && kind == KIND_STAT &&
+	 ( lstat( filename, &lsb ) < 0 || S_ISLNK( lsb.st_mode ) ) )
+	watched = 0;
+    if ( watched )
+	expires = now + STAT_CACHE_WATCH_TIME;
+    else
+	expires = now + STAT_CACHE_TIME;
+    e = new_entry( kind, filename, expires );
+    if ( e != (Entry*) 0 )
+	{
+	e->result = r;
+	e->err = err;
+	if ( r >= 0 )
+	    e->sb = *sbP;
+	}
+    errno = err;
+#endif /* STAT_CACHE_TIME */
+    return r;
+    }
+
+
+int
+stc_get_expansion( char* path, int flags, char** checkedP, char** restP, struct timeval* nowP )
+    {
+#ifdef STAT_CACHE_TIME
+    Entry* e;
+
+    e = find_entry( KIND_EXPAND + flags, path, get_now( nowP ) );
+    if ( e != (Entry*) 0 )
+	{
+	*checkedP = e->checked;
+	*restP = e->rest;
+	return 1;
+	}
+#endif /* STAT_CACHE_TIME */
+    return 0;
+    }
+
+
+void
+stc_put_expansion( char* path, int flags, char* checked, char* rest, struct timeval* nowP )
+    {
+#ifdef STAT_CACHE_TIME
+    Entry* e;
+
+    e = new_entry(
+	KIND_EXPAND + flags, path, get_now( nowP ) + STAT_CACHE_TIME );
+    if ( e == (Entry*) 0 )
+	return;
+    httpd_realloc_str( &e->checked, &e->maxchecked, strlen( checked ) );
+    (void) strcpy( e->checked, checked );
+    httpd_realloc_str( &e->rest, &e->maxrest, strlen( rest ) );
+    (void) strcpy( e->rest, rest );
+#endif /* STAT_CACHE_TIME */
+    }
+
+
+/* Returns the live entry for this kind and name, or (Entry*) 0. */
+static Entry*
+find_entry( int kind, char* name, time_t now )
+    {
+    Entry* e;
+
+    if ( entries == (Entry*) 0 )
+	return (Entry*) 0;
+    e = &entries[hash( kind, name )];
+    if ( e->kind == kind && e->expires > now && strcmp( e->name, name ) == 0 )
+	{
+	++stats_hits;
+	return e;
+	}
+    ++stats_misses;
+    return (Entry*) 0;
+    }
+
+
+/* Claims the slot for this kind and name, throwing out whatever was
+** there.  The caller fills in the results.
+*/
+static Entry*
+new_entry( int kind, char* name, time_t expires )
+    {
+    Entry* e;
+
+    if ( entries == (Entry*) 0 )
+	{
+	entries = (Entry*) calloc( STAT_CACHE_SIZE, sizeof(Entry) );
+	if ( entries == (Entry*) 0 )
+	    return (Entry*) 0;
+	}
+    e = &entries[hash( kind, name )];
+    if ( e->kind == KIND_EMPTY )
+	++entry_count;
+    e->kind = kind;
+    httpd_realloc_str( &e->name, &e->maxname, strlen( name ) );
+    (void) strcpy( e->name, name );
+    e->expires = expires;
+    return e;
+    }
+
+
+/* Makes sure every directory on the way to filename is being watched,
+** starting from the top, if we're watching at all.  Renaming or replacing
+** any of them changes what filename means, and that shows up as an event
+** in the one above.  Returns 1 if they all are.
+*/
+static int
+watch_dirs( char* filename, time_t now )
+    {
+#if defined(HAVE_SYS_INOTIFY_H) && defined(STAT_CACHE_TIME)
+    static THREAD_LOCAL char* dir;
+    static THREAD_LOCAL size_t maxdir = 0;
+    char* cp;
+    int ok;
+
+    if ( watch_fd == -1 )
+	return 0;
+    httpd_realloc_str( &dir, &maxdir, strlen( filename ) );
+    (void) strcpy( dir, filename );
+    if ( dir[0] == '/' )
+	{
+	if ( ! watch_dir( "/", now ) )
+	    return 0;
+	cp = &dir[1];
+	}
+    else
+	{
+	if ( ! watch_dir( ".", now ) )
+	    return 0;
+	cp = dir;
+	}
+    for ( ; ( cp = strchr( cp, '/' ) ) != (char*) 0; ++cp )
+	{
+	*cp = '\0';
+	ok = watch_dir( dir, now );
+	*cp = '/';
+	if ( ! ok )
+	    return 0;
+	}
+    return 1;
+#else /* HAVE_SYS_INOTIFY_H && STAT_CACHE_TIME */
+    return 0;
+#endif /* HAVE_SYS_INOTIFY_H && STAT_CACHE_TIME */
+    }
+
+
+/* Makes sure one directory is being watched.  Returns 1 if it is. */
+static int
+watch_dir( char* dir, time_t now )
+    {
+#if defined(HAVE_SYS_INOTIFY_H) && defined(STAT_CACHE_TIME)
+    if ( find_entry( KIND_WATCH, dir, now ) != (Entry*) 0 )
+	return 1;
+    /* Adding a watch that already exists is harmless, so it doesn't
+    ** matter if we've forgotten about one.  Symlinks don't get followed;
+    ** changes along the way to their targets wouldn't be noticed, so
+    ** paths through them only get the short time.
+    */
+    if ( inotify_add_watch( watch_fd, dir, WATCH_EVENTS | IN_DONT_FOLLOW ) < 0 )
+	return 0;
+    (void) new_entry( KIND_WATCH, dir, now + STAT_CACHE_WATCH_TIME );
+    return 1;
+#else /* HAVE_SYS_INOTIFY_H && STAT_CACHE_TIME */
+    return 0;
+#endif /* HAVE_SYS_INOTIFY_H && STAT_CACHE_TIME */
+    }
+
+
+int
+stc_watch( void )
+    {
+#if defined(HAVE_SYS_INOTIFY_H) && defined(STAT_CACHE_TIME)
+    if ( watch_fd == -1 )
+	{
+	watch_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( watch_fd < 0 )
+	    {
+	    syslog( LOG_WARNING, "inotify_init1 - %m" );
+	    watch_fd = -1;
+	    }
+	}
+#endif /* HAVE_SYS_INOTIFY_H && STAT_CACHE_TIME */
+    return watch_fd;
+    }
+
+
+void
+stc_watch_events( void )
+    {
+#ifdef HAVE_SYS_INOTIFY_H
+    char buf[4096];
+    int got = 0;
+
+    /* We don't bother working out which entries an event is about, any
+    ** change at all just empties the cache.  Changes are rare next to
+    ** requests, and this way nothing can get missed - symlink expansions
+    ** depend on whole chains of directories, for instance.
+    */
+    while ( read( watch_fd, buf, sizeof(buf) ) > 0 )
+	got = 1;
+    if ( got )
+	flush();
+#endif /* HAVE_SYS_INOTIFY_H */
+    }
+
+
+/* Forgets everything, but keeps the storage for re-use. */
+static void
+flush( void )
+    {
+    int i;
+
+    if ( entries == (Entry*) 0 )
+	return;
+    for ( i = 0; i < STAT_CACHE_SIZE; ++i )
+	entries[i].kind = KIND_EMPTY;
+    entry_count = 0;
+    ++stats_flushes;
+    }
+
+
+static void
+free_entry( Entry* e )
+    {
+    if ( e->kind != KIND_EMPTY )
+	--entry_count;
+    e->kind = KIND_EMPTY;
+    if ( e->maxname != 0 )
+	free( (void*) e->name );
+    if ( e->maxchecked != 0 )
+	free( (void*) e->checked );
+    if ( e->maxrest != 0 )
+	free( (void*) e->rest );
+    e->maxname = e->maxchecked = e->maxrest = 0;
+    }
+
+
+static unsigned int
+hash( int kind, char* name )
+    {
+    unsigned int h = (unsigned int) kind;
+
+    for ( ; *name != '\0'; ++name )
+	h = h * 33 + (unsigned char) *name;
+    return h % STAT_CACHE_SIZE;
+    }
+
+
+static time_t
+get_now( struct timeval* nowP )
+    {
+    if ( nowP != (struct timeval*) 0 )
+	return nowP->tv_sec;
+    return time( (time_t*) 0 );
+    }
+
+
+void
+stc_cleanup( struct timeval* nowP )
+    {
+    time_t now;
+    int i;
+
+    if ( entries == (Entry*) 0 )
+	return;
+    now = get_now( nowP );
+    for ( i = 0; i < STAT_CACHE_SIZE; ++i )
+	if ( entries[i].kind != KIND_EMPTY && entries[i].expires <= now )
+	    free_entry( &entries[i] );
+    }
+
+
+void
+stc_term( void )
+    {
+    int i;
+
+    if ( entries == (Entry*) 0 )
+	return;
+    for ( i = 0; i < STAT_CACHE_SIZE; ++i )
+	free_entry( &entries[i] );
+    free( (void*) entries );
+    entries = (Entry*) 0;
+    if ( watch_fd != -1 )
+	{
+	(void) close( watch_fd );
+	watch_fd = -1;
+	}
+    }
+
+
+/* Generate debugging statistics syslog message. */
+void
+stc_logstats( long secs )
+    {
+    syslog(
+	LOG_NOTICE, "  stat cache - %d entries, %ld hits, %ld misses, %ld flushes",
+	entry_count, stats_hits, stats_misses, stats_flushes );
+    stats_hits = stats_misses = stats_flushes = 0;
+    }
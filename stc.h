@@ -0,0 +1,73 @@
+/* stc.h - header file for stat cache package
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+#ifndef _STC_H_
+#define _STC_H_
+
+/* The stat cache remembers the results of stat(), lstat(), and symlink
+** expansion for STAT_CACHE_TIME seconds, so a popular URL can be resolved
+** without touching the filesystem.  The cache is per-thread and fixed
+** size; a new entry simply replaces whatever was in its slot.
+**
+** Wherever you have the current time, pass it in, otherwise pass 0.
+*/
+
+/* Like stat() and lstat(), including setting errno on failures, except
+** the answers may come from the cache.  Failures get cached too, so
+** probing for files that aren't there is cheap.
+*/
+int stc_stat( char* filename, struct stat* sbP, struct timeval* nowP );
+int stc_lstat( char* filename, struct stat* sbP, struct timeval* nowP );
+
+/* Looks up a remembered symlink expansion of path.  flags is whatever
+** the caller needs to tell apart different ways of expanding the same
+** path.  On a hit, returns 1 and sets *checkedP and *restP to strings
+** that are good until the next call into the package.  Otherwise
+** returns 0.
+*/
+int stc_get_expansion( char* path, int flags, char** checkedP, char** restP, struct timeval* nowP );
+
+/* Remembers a symlink expansion for stc_get_expansion(). */
+void stc_put_expansion( char* path, int flags, char* checked, char* rest, struct timeval* nowP );
+
+/* Starts watching the directories of cached files for changes, on systems
+** with inotify.  Returns a descriptor to wait on for reading, or -1 if
+** watching isn't possible.  When the descriptor is readable, call
+** stc_watch_events(), which drops anything that might be out of date.
+** While watching, stat() results are kept for STAT_CACHE_WATCH_TIME
+** seconds instead of STAT_CACHE_TIME.
+*/
+int stc_watch( void );
+void stc_watch_events( void );
+
+/* Frees the storage of stale entries.  Call this periodically. */
+void stc_cleanup( struct timeval* nowP );
+
+/* Free all storage, usually in preparation for exitting. */
+void stc_term( void );
+
+/* Generate debugging statistics syslog message. */
+void stc_logstats( long secs );
+
+#endif /* _STC_H_ */
@@ -29,6 +29,8 @@
 ** http://www.acme.com/software/date_parse/
 */
 
+#include "config.h"
+
 #include <sys/types.h>
 
 #include <ctype.h>
@@ -98,7 +100,7 @@ strlong_search( char* str, struct strlong* tab, int n, long* lP )
 static int
 scan_wday( char* str_wday, long* tm_wdayP )
     {
-    static struct strlong wday_tab[] = {
+    static THREAD_LOCAL struct strlong wday_tab[] = {
 	{ "sun", 0 }, { "sunday", 0 },
 	{ "mon", 1 }, { "monday", 1 },
 	{ "tue", 2 }, { "tuesday", 2 },
@@ -107,7 +109,7 @@ scan_wday( char* str_wday, long* tm_wdayP )
 	{ "fri", 5 }, { "friday", 5 },
 	{ "sat", 6 }, { "saturday", 6 },
 	};
-    static int sorted = 0;
+    static THREAD_LOCAL int sorted = 0;
 
     if ( ! sorted )
 	{
@@ -125,7 +127,7 @@ scan_wday( char* str_wday, long* tm_wdayP )
 static int
 scan_mon( char* str_mon, long* tm_monP )
     {
-    static struct strlong mon_tab[] = {
+    static THREAD_LOCAL struct strlong mon_tab[] = {
 	{ "jan", 0 }, { "january", 0 },
 	{ "feb", 1 }, { "february", 1 },
 	{ "mar", 2 }, { "march", 2 },
@@ -139,7 +141,7 @@ scan_mon( char* str_mon, long* tm_monP )
 	{ "nov", 10 }, { "november", 10 },
 	{ "dec", 11 }, { "december", 11 },
 	};
-    static int sorted = 0;
+    static THREAD_LOCAL int sorted = 0;
 
     if ( ! sorted )
 	{
@@ -35,6 +35,10 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif /* HAVE_SYS_SENDFILE_H */
 
 #include <errno.h>
 #ifdef HAVE_FCNTL_H
@@ -53,10 +57,14 @@
 #include <time.h>
 #endif
 #include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
 
 #include "fdwatch.h"
 #include "libhttpd.h"
 #include "mmc.h"
+#include "stc.h"
 #include "timers.h"
 #include "match.h"
 
@@ -68,6 +76,13 @@
 typedef long long int64_t;
 #endif
 
+/* Extra flags for watching connection sockets. */
+#ifdef USE_EDGE_TRIGGERED
+#define CONN_FDW_FLAGS FDW_EDGE
+#else /* USE_EDGE_TRIGGERED */
+#define CONN_FDW_FLAGS 0
+#endif /* USE_EDGE_TRIGGERED */
+
 
 static char* argv0;
 static int debug;
@@ -88,6 +103,12 @@ static char* user;
 static char* charset;
 static char* p3p;
 static int max_age;
+static int keepalive_timeout, keepalive_max;
+static int workers;
+static pid_t* worker_pids;
+static time_t* worker_started;
+static int threads;
+static int use_sendfile;
 
 
 typedef struct {
@@ -97,30 +118,65 @@ typedef struct {
     off_t bytes_since_avg;
     int num_sending;
     } throttletab;
-static throttletab* throttles;
-static int numthrottles, maxthrottles;
+static THREAD_LOCAL throttletab* throttles;
+static THREAD_LOCAL int numthrottles, maxthrottles;
+#ifdef HAVE_LIBPTHREAD
+static throttletab* throttle_defs;	/* copied by each extra thread */
+static int num_throttle_defs;
+static pthread_t* tids;		/* thread 0 is the main thread */
+#endif /* HAVE_LIBPTHREAD */
 
 #define THROTTLE_NOLIMIT -1
 
 
-typedef struct {
+/* The connection table is split in two.  connecttab holds just the
+** fields the main loop and an unthrottled handle_send() use on every
+** pass, 64 bytes on LP64 systems, and the table is allocated on a
+** CONNECT_ALIGN boundary so each entry is one cache line.  Timers,
+** throttle indexes, list links and so on only matter when a connection
+** starts, pauses or ends, and live in a parallel table of connectcold.
+** The httpd_conns get the same alignment, so the fields handle_send()
+** uses at their front share a line too.  contrib/bench/connscan.c
+** measures the layouts.
+*/
+#define CONNECT_ALIGN 64
+#ifdef __GNUC__
+#define CONNECT_ALIGNED __attribute__((aligned(CONNECT_ALIGN)))
+#else /* __GNUC__ */
+#define CONNECT_ALIGNED
+#endif /* __GNUC__ */
+
+typedef struct ConnectStruct {
     int conn_state;
-    int next_free_connect;
+    int numtnums;
     httpd_conn* hc;
+    off_t next_byte_index;
+    off_t end_byte_index;
+    long max_limit;
+    long wouldblock_delay;
+    time_t active_at;
+    struct ConnectColdStruct* cold;
+    } CONNECT_ALIGNED connecttab;
+
+typedef struct ConnectColdStruct {
+    connecttab* state_prev;	/* links for the per-state lists */
+    connecttab* state_next;
     int tnums[MAXTHROTTLENUMS];         /* throttle indexes */
-    int numtnums;
-    long max_limit, min_limit;
-    time_t started_at, active_at;
+    time_t started_at;
+    long min_limit;
+    off_t bytes;
     Timer* wakeup_timer;
     Timer* linger_timer;
-    long wouldblock_delay;
-    off_t bytes;
-    off_t end_byte_index;
-    off_t next_byte_index;
-    } connecttab;
-static connecttab* connects;
-static int num_connects, max_connects, first_free_connect;
-static int httpd_conn_count;
+    int num_requests;
+    int held_only;	/* just sending held responses, request already reset */
+    int next_free_connect;
+    char* hc_mem;	/* what hc was carved from */
+    } connectcold;
+static THREAD_LOCAL connecttab* connects;
+static THREAD_LOCAL char* connects_mem;	/* what connects was carved from */
+static THREAD_LOCAL connectcold* connects_cold;
+static THREAD_LOCAL int num_connects, max_connects, first_free_connect;
+static THREAD_LOCAL int httpd_conn_count;
 
 /* The connection states. */
 #define CNST_FREE 0
@@ -128,16 +184,32 @@ static int httpd_conn_count;
 #define CNST_SENDING 2
 #define CNST_PAUSING 3
 #define CNST_LINGERING 4
+#define CNST_NUM 5
 
+/* All the connections in each state except free, so the periodic sweeps
+** only have to look at the ones they care about.
+*/
+static THREAD_LOCAL connecttab* state_lists[CNST_NUM];
 
-static httpd_server* hs = (httpd_server*) 0;
-int terminate = 0;
-time_t start_time, stats_time;
-long stats_connections;
-off_t stats_bytes;
-int stats_simultaneous;
 
-static volatile int got_hup, got_usr1, watchdog_flag;
+static httpd_server** servers = (httpd_server**) 0;	/* one per thread */
+static THREAD_LOCAL httpd_server* hs = (httpd_server*) 0;
+THREAD_LOCAL int terminate = 0;
+THREAD_LOCAL time_t start_time, stats_time;
+THREAD_LOCAL long stats_connections;
+THREAD_LOCAL off_t stats_bytes;
+THREAD_LOCAL int stats_simultaneous;
+
+/* got_hup and got_chld count SIGHUPs and SIGCHLDs, so that each thread
+** can tell when it has missed one.
+*/
+static volatile int got_hup, got_chld, got_usr1, got_term, watchdog_flag;
+static THREAD_LOCAL int hups_seen, chlds_seen;
+
+/* Each thread has a pipe that its fdwatch() listens to, so a signal
+** handler can wake them all up: read end at tnum * 2, write end after it.
+*/
+static int* wake_fds = (int*) 0;
 
 
 /* Forwards. */
@@ -149,15 +221,29 @@ static void no_value_required( char* name, char* value );
 static char* e_strdup( char* oldstr );
 static void lookup_hostname( httpd_sockaddr* sa4P, size_t sa4_len, int* gotv4P, httpd_sockaddr* sa6P, size_t sa6_len, int* gotv6P );
 static void read_throttlefile( char* tf );
+static void supervise( void );
+static int start_worker( int wnum );
+#ifdef HAVE_LIBPTHREAD
+static void* thread_main( void* arg );
+#endif /* HAVE_LIBPTHREAD */
+static void serve( int tnum );
 static void shut_down( void );
 static int handle_newconnect( struct timeval* tvP, int listen_fd );
 static void handle_read( connecttab* c, struct timeval* tvP );
+static void handle_request( connecttab* c, struct timeval* tvP );
 static void handle_send( connecttab* c, struct timeval* tvP );
+static int send_parts( connecttab* c, size_t max_bytes, size_t* nbytesP );
+#ifdef HAVE_SYS_SENDFILE_H
+static int send_file( connecttab* c, size_t max_bytes, size_t* nbytesP );
+#endif /* HAVE_SYS_SENDFILE_H */
 static void handle_linger( connecttab* c, struct timeval* tvP );
 static int check_throttles( connecttab* c );
 static void clear_throttles( connecttab* c, struct timeval* tvP );
 static void update_throttles( ClientData client_data, struct timeval* nowP );
+static void set_conn_state( connecttab* c, int state );
 static void finish_connection( connecttab* c, struct timeval* tvP );
+static void send_held( connecttab* c, struct timeval* tvP, int held_only );
+static void keepalive_connection( connecttab* c, struct timeval* tvP );
 static void clear_connection( connecttab* c, struct timeval* tvP );
 static void really_clear_connection( connecttab* c, struct timeval* tvP );
 static void idle( ClientData client_data, struct timeval* nowP );
@@ -169,18 +255,29 @@ static void show_stats( ClientData client_data, struct timeval* nowP );
 #endif /* STATS_TIME */
 static void logstats( struct timeval* nowP );
 static void thttpd_logstats( long secs );
+static void wake_threads( void );
 
 
-/* SIGTERM and SIGINT say to exit immediately. */
+/* SIGTERM and SIGINT say to exit immediately.  Shutting down takes locks
+** and waits for the log writers to finish, none of which is safe in a
+** signal handler, so each main loop does it when it sees the flag, and
+** gets woken up to see it right away.
+*/
 static void
 handle_term( int sig )
     {
-    /* Don't need to set up the handler again, since it's a one-shot. */
+    const int oerrno = errno;
 
-    shut_down();
-    syslog( LOG_NOTICE, "exiting due to signal %d", sig );
-    closelog();
-    exit( 1 );
+#ifndef HAVE_SIGSET
+    /* Set up handler again, since it gets passed between threads. */
+    (void) signal( sig, handle_term );
+#endif /* ! HAVE_SIGSET */
+
+    got_term = sig;
+    wake_threads();
+
+    /* Restore previous errno. */
+    errno = oerrno;
     }
 
 
@@ -189,48 +286,16 @@ static void
 handle_chld( int sig )
     {
     const int oerrno = errno;
-    pid_t pid;
-    int status;
 
 #ifndef HAVE_SIGSET
     /* Set up handler again. */
     (void) signal( SIGCHLD, handle_chld );
 #endif /* ! HAVE_SIGSET */
 
-    /* Reap defunct children until there aren't any more. */
-    for (;;)
-	{
-#ifdef HAVE_WAITPID
-	pid = waitpid( (pid_t) -1, &status, WNOHANG );
-#else /* HAVE_WAITPID */
-	pid = wait3( &status, WNOHANG, (struct rusage*) 0 );
-#endif /* HAVE_WAITPID */
-	if ( (int) pid == 0 )		/* none left */
-	    break;
-	if ( (int) pid < 0 )
-	    {
-	    if ( errno == EINTR || errno == EAGAIN )
-		continue;
-	    /* ECHILD shouldn't happen with the WNOHANG option,
-	    ** but with some kernels it does anyway.  Ignore it.
-	    */
-	    if ( errno != ECHILD )
-		syslog( LOG_ERR, "child wait - %m" );
-	    break;
-	    }
-	/* Decrement the CGI count.  Note that this is not accurate, since
-	** each CGI can involve two or even three child processes.
-	** Decrementing for each child means that when there is heavy CGI
-	** activity, the count will be lower than it should be, and therefore
-	** more CGIs will be allowed than should be.
-	*/
-	if ( hs != (httpd_server*) 0 )
-	    {
-	    --hs->cgi_count;
-	    if ( hs->cgi_count < 0 )
-		hs->cgi_count = 0;
-	    }
-	}
+    /* Just note it.  Each thread's main loop reaps its own children, so
+    ** no thread's CGI count gets touched from under it.
+    */
+    ++got_chld;
 
     /* Restore previous errno. */
     errno = oerrno;
@@ -248,8 +313,10 @@ handle_hup( int sig )
     (void) signal( SIGHUP, handle_hup );
 #endif /* ! HAVE_SIGSET */
 
-    /* Just set a flag that we got the signal. */
-    got_hup = 1;
+    /* Just count the signal.  Each thread re-opens its own log file when
+    ** it sees the count change.
+    */
+    ++got_hup;
 
     /* Restore previous errno. */
     errno = oerrno;
@@ -260,24 +327,32 @@ handle_hup( int sig )
 static void
 handle_usr1( int sig )
     {
-    /* Don't need to set up the handler again, since it's a one-shot. */
+    const int oerrno = errno;
 
-    if ( num_connects == 0 )
-	{
-	/* If there are no active connections we want to exit immediately
-	** here.  Not only is it faster, but without any connections the
-	** main loop won't wake up until the next new connection.
-	*/
-	shut_down();
-	syslog( LOG_NOTICE, "exiting" );
-	closelog();
-	exit( 0 );
-	}
+    /* Don't need to set up the handler again, since it's a one-shot. */
 
-    /* Otherwise, just set a flag that we got the signal. */
+    /* Just set a flag that we got the signal, and wake up the main loops
+    ** to notice it.  Shutting down from in here wouldn't be safe.
+    */
     got_usr1 = 1;
+    wake_threads();
+
+    /* Restore previous errno. */
+    errno = oerrno;
+    }
+
+
+/* Wakes up every thread's main loop.  Safe to call from signal handlers. */
+static void
+wake_threads( void )
+    {
+    int tnum;
 
-    /* Don't need to restore old errno, since we didn't do any syscalls. */
+    if ( wake_fds == (int*) 0 )
+	return;
+    for ( tnum = 0; tnum < threads; ++tnum )
+	if ( write( wake_fds[tnum * 2 + 1], "", 1 ) < 0 )
+	    continue;	/* full already, which wakes it just as well */
     }
 
 
@@ -327,6 +402,39 @@ handle_alrm( int sig )
     }
 
 
+/* In -workers mode, the supervisor passes signals along to the workers.
+** TERM and INT also make it exit right away, while USR1 makes it exit
+** once all the workers have finished.
+*/
+static void
+handle_supervisor_sig( int sig )
+    {
+    const int oerrno = errno;
+    int wnum;
+
+#ifndef HAVE_SIGSET
+    /* Set up handler again. */
+    (void) signal( sig, handle_supervisor_sig );
+#endif /* ! HAVE_SIGSET */
+
+    for ( wnum = 0; wnum < workers; ++wnum )
+	if ( worker_pids[wnum] != 0 )
+	    (void) kill( worker_pids[wnum], sig );
+
+    if ( sig == SIGTERM || sig == SIGINT )
+	{
+	syslog( LOG_NOTICE, "exiting due to signal %d", sig );
+	closelog();
+	exit( 1 );
+	}
+    if ( sig == SIGUSR1 )
+	terminate = 1;
+
+    /* Restore previous errno. */
+    errno = oerrno;
+    }
+
+
 static void
 re_open_logfile( void )
     {
@@ -346,11 +454,137 @@ re_open_logfile( void )
 	    return;
 	    }
 	(void) fcntl( fileno( logfp ), F_SETFD, 1 );
+	if ( workers > 0 || threads > 1 )
+	    (void) setvbuf( logfp, (char*) 0, _IOLBF, 0 );
 	httpd_set_logfp( hs, logfp );
 	}
     }
 
 
+/* Runs the -workers mode supervisor.  This forks off the worker processes,
+** which return from here and carry on with the rest of the startup, each
+** ending up with its own listen sockets, connection table, and caches.
+** The supervisor itself stays in here, restarting workers that die, until
+** it's time to exit.
+*/
+static void
+supervise( void )
+    {
+    int wnum, status;
+    pid_t pid;
+    time_t lifetime;
+
+    worker_pids = NEW( pid_t, workers );
+    worker_started = NEW( time_t, workers );
+    if ( worker_pids == (pid_t*) 0 || worker_started == (time_t*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating worker tables" );
+	exit( 1 );
+	}
+    for ( wnum = 0; wnum < workers; ++wnum )
+	worker_pids[wnum] = 0;
+
+#ifdef HAVE_SIGSET
+    (void) sigset( SIGTERM, handle_supervisor_sig );
+    (void) sigset( SIGINT, handle_supervisor_sig );
+    (void) sigset( SIGHUP, handle_supervisor_sig );
+    (void) sigset( SIGUSR1, handle_supervisor_sig );
+    (void) sigset( SIGUSR2, handle_supervisor_sig );
+    (void) sigset( SIGPIPE, SIG_IGN );
+#else /* HAVE_SIGSET */
+    (void) signal( SIGTERM, handle_supervisor_sig );
+    (void) signal( SIGINT, handle_supervisor_sig );
+    (void) signal( SIGHUP, handle_supervisor_sig );
+    (void) signal( SIGUSR1, handle_supervisor_sig );
+    (void) signal( SIGUSR2, handle_supervisor_sig );
+    (void) signal( SIGPIPE, SIG_IGN );
+#endif /* HAVE_SIGSET */
+
+    for ( wnum = 0; wnum < workers; ++wnum )
+	if ( ! start_worker( wnum ) )
+	    return;
+    syslog( LOG_NOTICE, "started %d workers", workers );
+
+    for (;;)
+	{
+	pid = wait( &status );
+	if ( (int) pid < 0 )
+	    {
+	    if ( errno == EINTR )
+		continue;
+	    syslog( LOG_CRIT, "wait - %m" );
+	    exit( 1 );
+	    }
+	for ( wnum = 0; wnum < workers; ++wnum )
+	    if ( worker_pids[wnum] == pid )
+		break;
+	if ( wnum == workers )
+	    continue;
+	worker_pids[wnum] = 0;
+
+	if ( terminate )
+	    {
+	    /* Shutting down; exit when the last worker is gone. */
+	    for ( wnum = 0; wnum < workers; ++wnum )
+		if ( worker_pids[wnum] != 0 )
+		    break;
+	    if ( wnum == workers )
+		{
+		syslog( LOG_NOTICE, "exiting" );
+		closelog();
+		exit( 0 );
+		}
+	    continue;
+	    }
+
+	if ( WIFSIGNALED( status ) )
+	    syslog(
+		LOG_ERR, "worker %d (pid %d) killed by signal %d, restarting",
+		wnum, (int) pid, WTERMSIG( status ) );
+	else
+	    syslog(
+		LOG_ERR, "worker %d (pid %d) exited with status %d, restarting",
+		wnum, (int) pid, WEXITSTATUS( status ) );
+	lifetime = time( (time_t*) 0 ) - worker_started[wnum];
+	if ( lifetime < WORKER_RESTART_TIME )
+	    (void) sleep( WORKER_RESTART_TIME - lifetime );
+	if ( ! start_worker( wnum ) )
+	    return;
+	}
+    }
+
+
+/* Forks off worker number wnum.  Returns 0 in the new worker and 1 in
+** the supervisor.
+*/
+static int
+start_worker( int wnum )
+    {
+    pid_t pid;
+
+    pid = fork();
+    if ( (int) pid < 0 )
+	{
+	syslog( LOG_CRIT, "fork - %m" );
+	exit( 1 );
+	}
+    if ( (int) pid == 0 )
+	{
+	/* Worker process.  Main sets up its own signal handlers shortly. */
+	(void) signal( SIGTERM, SIG_DFL );
+	(void) signal( SIGINT, SIG_DFL );
+	(void) signal( SIGHUP, SIG_DFL );
+	(void) signal( SIGUSR1, SIG_DFL );
+	(void) signal( SIGUSR2, SIG_DFL );
+	mmc_share_join();
+	return 0;
+	}
+    worker_pids[wnum] = pid;
+    worker_started[wnum] = time( (time_t*) 0 );
+    return 1;
+    }
+
+
 int
 main( int argc, char** argv )
     {
@@ -360,14 +594,15 @@ main( int argc, char** argv )
     gid_t gid = 32767;
     char cwd[MAXPATHLEN+1];
     FILE* logfp;
-    int num_ready;
-    int cnum;
-    connecttab* c;
-    httpd_conn* hc;
+    FILE* tlogfp;
+    int tnum, i;
+    int* fds;
+#ifdef HAVE_LIBPTHREAD
+    int r;
+#endif /* HAVE_LIBPTHREAD */
     httpd_sockaddr sa4;
     httpd_sockaddr sa6;
     int gotv4, gotv6;
-    struct timeval tv;
 
     argv0 = argv[0];
 
@@ -380,6 +615,24 @@ main( int argc, char** argv )
 
     /* Handle command-line arguments. */
     parse_args( argc, argv );
+#ifndef HAVE_LIBPTHREAD
+    if ( threads > 1 )
+	{
+	syslog( LOG_CRIT, "threads are not supported on this system" );
+	(void) fprintf(
+	    stderr, "%s: threads are not supported on this system\n", argv0 );
+	exit( 1 );
+	}
+#endif /* ! HAVE_LIBPTHREAD */
+#ifndef HAVE_SYS_SENDFILE_H
+    if ( use_sendfile )
+	{
+	syslog( LOG_CRIT, "sendfile is not supported on this system" );
+	(void) fprintf(
+	    stderr, "%s: sendfile is not supported on this system\n", argv0 );
+	exit( 1 );
+	}
+#endif /* ! HAVE_SYS_SENDFILE_H */
 
     /* Read zone info now, in case we chroot(). */
     tzset();
@@ -544,6 +797,25 @@ main( int argc, char** argv )
 	(void) fclose( pidfp );
 	}
 
+    /* If several workers or threads will be appending to the same log
+    ** file, make sure each entry goes out in one write.
+    */
+    if ( ( workers > 0 || threads > 1 ) && logfp != (FILE*) 0 )
+	(void) setvbuf( logfp, (char*) 0, _IOLBF, 0 );
+
+    /* Attach to the shared cache for this document root.  That needs
+    ** /dev/shm, so it has to happen before any chroot.
+    */
+    mmc_share( cwd );
+
+    /* Start up the worker processes, if requested.  Only the workers
+    ** come back from this.
+    */
+    if ( workers > 0 )
+	supervise();
+    else
+	mmc_share_join();
+
     /* Initialize the fdwatch package.  Have to do this before chroot,
     ** if /dev/poll is used.
     */
@@ -553,7 +825,10 @@ main( int argc, char** argv )
 	syslog( LOG_CRIT, "fdwatch initialization failure" );
 	exit( 1 );
 	}
-    max_connects -= SPARE_FDS;
+    /* The descriptors get split evenly between the threads, after each
+    ** one's wakeup pipe.
+    */
+    max_connects = ( max_connects - SPARE_FDS ) / threads - 2;
 
     /* Chroot if requested. */
     if ( do_chroot )
@@ -626,59 +901,55 @@ main( int argc, char** argv )
     (void) signal( SIGUSR2, handle_usr2 );
     (void) signal( SIGALRM, handle_alrm );
 #endif /* HAVE_SIGSET */
-    got_hup = 0;
+    got_hup = hups_seen = 0;
+    got_chld = chlds_seen = 0;
     got_usr1 = 0;
+    got_term = 0;
     watchdog_flag = 0;
     (void) alarm( OCCASIONAL_TIME * 3 );
 
     /* Initialize the timer package. */
     tmr_init();
 
+    /* In sendfile mode the map cache just holds files open. */
+    mmc_set_fd_mode( use_sendfile );
+
     /* Initialize the HTTP layer.  Got to do this before giving up root,
-    ** so that we can bind to a privileged port.
+    ** so that we can bind to a privileged port.  Each thread gets its
+    ** own server, with its own listen sockets and log stream.
     */
-    hs = httpd_initialize(
-	hostname,
-	gotv4 ? &sa4 : (httpd_sockaddr*) 0, gotv6 ? &sa6 : (httpd_sockaddr*) 0,
-	port, cgi_pattern, cgi_limit, charset, p3p, max_age, cwd, no_log, logfp,
-	no_symlink_check, do_vhost, do_global_passwd, url_pattern,
-	local_pattern, no_empty_referrers );
-    if ( hs == (httpd_server*) 0 )
-	exit( 1 );
-
-    /* Set up the occasional timer. */
-    if ( tmr_create( (struct timeval*) 0, occasional, JunkClientData, OCCASIONAL_TIME * 1000L, 1 ) == (Timer*) 0 )
-	{
-	syslog( LOG_CRIT, "tmr_create(occasional) failed" );
-	exit( 1 );
-	}
-    /* Set up the idle timer. */
-    if ( tmr_create( (struct timeval*) 0, idle, JunkClientData, 5 * 1000L, 1 ) == (Timer*) 0 )
+    servers = NEW( httpd_server*, threads );
+    if ( servers == (httpd_server**) 0 )
 	{
-	syslog( LOG_CRIT, "tmr_create(idle) failed" );
+	syslog( LOG_CRIT, "out of memory allocating the server table" );
 	exit( 1 );
 	}
-    if ( numthrottles > 0 )
+    for ( tnum = 0; tnum < threads; ++tnum )
+	servers[tnum] = (httpd_server*) 0;
+    for ( tnum = 0; tnum < threads; ++tnum )
 	{
-	/* Set up the throttles timer. */
-	if ( tmr_create( (struct timeval*) 0, update_throttles, JunkClientData, THROTTLE_TIME * 1000L, 1 ) == (Timer*) 0 )
+	tlogfp = logfp;
+	if ( tnum > 0 && logfp != (FILE*) 0 )
 	    {
-	    syslog( LOG_CRIT, "tmr_create(update_throttles) failed" );
+	    tlogfp = fdopen( dup( fileno( logfp ) ), "a" );
+	    if ( tlogfp == (FILE*) 0 )
+		{
+		syslog( LOG_CRIT, "fdopen logfile - %m" );
+		exit( 1 );
+		}
+	    (void) fcntl( fileno( tlogfp ), F_SETFD, 1 );
+	    (void) setvbuf( tlogfp, (char*) 0, _IOLBF, 0 );
+	    }
+	servers[tnum] = httpd_initialize(
+	    hostname,
+	    gotv4 ? &sa4 : (httpd_sockaddr*) 0,
+	    gotv6 ? &sa6 : (httpd_sockaddr*) 0,
+	    port, cgi_pattern, cgi_limit, charset, p3p, max_age, cwd, no_log,
+	    tlogfp, no_symlink_check, do_vhost, do_global_passwd, url_pattern,
+	    local_pattern, no_empty_referrers, workers > 0 || threads > 1 );
+	if ( servers[tnum] == (httpd_server*) 0 )
 	    exit( 1 );
-	    }
-	}
-#ifdef STATS_TIME
-    /* Set up the stats timer. */
-    if ( tmr_create( (struct timeval*) 0, show_stats, JunkClientData, STATS_TIME * 1000L, 1 ) == (Timer*) 0 )
-	{
-	syslog( LOG_CRIT, "tmr_create(show_stats) failed" );
-	exit( 1 );
 	}
-#endif /* STATS_TIME */
-    start_time = stats_time = time( (time_t*) 0 );
-    stats_connections = 0;
-    stats_bytes = 0;
-    stats_simultaneous = 0;
 
     /* If we're root, try to become someone else. */
     if ( getuid() == 0 )
@@ -715,9 +986,191 @@ main( int argc, char** argv )
 		"started as root without requesting chroot(), warning only" );
 	}
 
+    /* Make the wakeup pipes.  They're non-blocking, so a signal handler
+    ** never gets stuck writing to one.
+    */
+    fds = NEW( int, threads * 2 );
+    if ( fds == (int*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating wakeup pipes" );
+	exit( 1 );
+	}
+    for ( tnum = 0; tnum < threads; ++tnum )
+	{
+	if ( pipe( &fds[tnum * 2] ) < 0 )
+	    {
+	    syslog( LOG_CRIT, "pipe - %m" );
+	    exit( 1 );
+	    }
+	for ( i = tnum * 2; i < tnum * 2 + 2; ++i )
+	    {
+	    httpd_set_ndelay( fds[i] );
+	    (void) fcntl( fds[i], F_SETFD, 1 );
+	    }
+	}
+    wake_fds = fds;
+
+#ifdef HAVE_LIBPTHREAD
+    /* Start up the extra threads, if requested.  They copy the throttle
+    ** table, so save a pointer to it before the main thread starts
+    ** changing its own copy.
+    */
+    tids = (pthread_t*) 0;
+    if ( threads > 1 )
+	{
+	throttle_defs = throttles;
+	num_throttle_defs = numthrottles;
+	tids = NEW( pthread_t, threads );
+	if ( tids == (pthread_t*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory allocating thread ids" );
+	    exit( 1 );
+	    }
+	tids[0] = pthread_self();
+	for ( tnum = 1; tnum < threads; ++tnum )
+	    {
+	    r = pthread_create(
+		&tids[tnum], (pthread_attr_t*) 0, thread_main,
+		(void*) (long) tnum );
+	    if ( r != 0 )
+		{
+		syslog( LOG_CRIT, "pthread_create - %s", strerror( r ) );
+		exit( 1 );
+		}
+	    }
+	syslog( LOG_NOTICE, "started %d threads", threads );
+	}
+#endif /* HAVE_LIBPTHREAD */
+
+    /* The main thread runs as thread 0. */
+    serve( 0 );
+
+#ifdef HAVE_LIBPTHREAD
+    /* Wait for the other threads to finish up. */
+    for ( tnum = 1; tnum < threads; ++tnum )
+	(void) pthread_join( tids[tnum], (void**) 0 );
+#endif /* HAVE_LIBPTHREAD */
+
+    /* The main loop terminated. */
+    shut_down();
+    if ( got_term )
+	{
+	syslog( LOG_NOTICE, "exiting due to signal %d", got_term );
+	closelog();
+	exit( 1 );
+	}
+    syslog( LOG_NOTICE, "exiting" );
+    closelog();
+    exit( 0 );
+    }
+
+
+#ifdef HAVE_LIBPTHREAD
+/* The start routine for the extra threads.  These set up their own fdwatch,
+** timers, and throttles, and then run the same main loop as the main thread.
+*/
+static void*
+thread_main( void* arg )
+    {
+    int tnum = (int) (long) arg;
+    int i;
+
+    max_connects = fdwatch_get_nfiles();
+    if ( max_connects < 0 )
+	{
+	syslog( LOG_CRIT, "fdwatch initialization failure" );
+	exit( 1 );
+	}
+    max_connects = ( max_connects - SPARE_FDS ) / threads - 2;
+    tmr_init();
+
+    /* Copy the throttle table, with fresh rates. */
+    numthrottles = maxthrottles = num_throttle_defs;
+    throttles = (throttletab*) 0;
+    if ( num_throttle_defs > 0 )
+	{
+	throttles = NEW( throttletab, num_throttle_defs );
+	if ( throttles == (throttletab*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory allocating a throttletab" );
+	    exit( 1 );
+	    }
+	for ( i = 0; i < num_throttle_defs; ++i )
+	    {
+	    throttles[i] = throttle_defs[i];
+	    throttles[i].rate = 0;
+	    throttles[i].bytes_since_avg = 0;
+	    throttles[i].num_sending = 0;
+	    }
+	}
+
+    serve( tnum );
+    shut_down();
+    return (void*) 0;
+    }
+#endif /* HAVE_LIBPTHREAD */
+
+
+/* Runs the main loop for thread number tnum, until it's time to exit. */
+static void
+serve( int tnum )
+    {
+    int num_ready;
+    int cnum, state;
+    connecttab* c;
+    httpd_conn* hc;
+    struct timeval tv;
+    int watch_fd, wake_fd;
+    char buf[64];
+
+    hs = servers[tnum];
+
+    /* Set up the occasional timer. */
+    if ( tmr_create( (struct timeval*) 0, occasional, JunkClientData, OCCASIONAL_TIME * 1000L, 1 ) == (Timer*) 0 )
+	{
+	syslog( LOG_CRIT, "tmr_create(occasional) failed" );
+	exit( 1 );
+	}
+    /* Set up the idle timer. */
+    if ( tmr_create( (struct timeval*) 0, idle, JunkClientData, 5 * 1000L, 1 ) == (Timer*) 0 )
+	{
+	syslog( LOG_CRIT, "tmr_create(idle) failed" );
+	exit( 1 );
+	}
+    if ( numthrottles > 0 )
+	{
+	/* Set up the throttles timer. */
+	if ( tmr_create( (struct timeval*) 0, update_throttles, JunkClientData, THROTTLE_TIME * 1000L, 1 ) == (Timer*) 0 )
+	    {
+	    syslog( LOG_CRIT, "tmr_create(update_throttles) failed" );
+	    exit( 1 );
+	    }
+	}
+#ifdef STATS_TIME
+    /* Set up the stats timer. */
+    if ( tmr_create( (struct timeval*) 0, show_stats, JunkClientData, STATS_TIME * 1000L, 1 ) == (Timer*) 0 )
+	{
+	syslog( LOG_CRIT, "tmr_create(show_stats) failed" );
+	exit( 1 );
+	}
+#endif /* STATS_TIME */
+    start_time = stats_time = time( (time_t*) 0 );
+    stats_connections = 0;
+    stats_bytes = 0;
+    stats_simultaneous = 0;
+
     /* Initialize our connections table. */
-    connects = NEW( connecttab, max_connects );
-    if ( connects == (connecttab*) 0 )
+    connects_mem = NEW( char, max_connects * sizeof(connecttab) + CONNECT_ALIGN - 1 );
+    if ( connects_mem == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a connecttab" );
+	exit( 1 );
+	}
+    connects = (connecttab*) ( connects_mem +
+	( CONNECT_ALIGN - (unsigned long) connects_mem % CONNECT_ALIGN ) %
+	    CONNECT_ALIGN );
+    connects_cold = NEW( connectcold, max_connects );
+    if ( connects_cold == (connectcold*) 0 )
 	{
 	syslog( LOG_CRIT, "out of memory allocating a connecttab" );
 	exit( 1 );
@@ -725,10 +1178,14 @@ main( int argc, char** argv )
     for ( cnum = 0; cnum < max_connects; ++cnum )
 	{
 	connects[cnum].conn_state = CNST_FREE;
-	connects[cnum].next_free_connect = cnum + 1;
 	connects[cnum].hc = (httpd_conn*) 0;
+	connects[cnum].cold = &connects_cold[cnum];
+	connects_cold[cnum].next_free_connect = cnum + 1;
+	connects_cold[cnum].hc_mem = (char*) 0;
 	}
-    connects[max_connects - 1].next_free_connect = -1;	/* end of link list */
+    connects_cold[max_connects - 1].next_free_connect = -1;	/* end of link list */
+    for ( state = 0; state < CNST_NUM; ++state )
+	state_lists[state] = (connecttab*) 0;
     first_free_connect = 0;
     num_connects = 0;
     httpd_conn_count = 0;
@@ -741,15 +1198,49 @@ main( int argc, char** argv )
 	    fdwatch_add_fd( hs->listen6_fd, (void*) 0, FDW_READ );
 	}
 
+    /* Hear about changes to the files in the stat cache. */
+    watch_fd = stc_watch();
+    if ( watch_fd != -1 )
+	fdwatch_add_fd( watch_fd, (void*) 0, FDW_READ );
+
+    /* And about signals. */
+    wake_fd = wake_fds[tnum * 2];
+    fdwatch_add_fd( wake_fd, (void*) 0, FDW_READ );
+
     /* Main loop. */
     (void) gettimeofday( &tv, (struct timezone*) 0 );
-    while ( ( ! terminate ) || num_connects > 0 )
+    while ( ! got_term && ( ( ! terminate ) || num_connects > 0 ) )
 	{
 	/* Do we need to re-open the log file? */
-	if ( got_hup )
+	if ( got_hup != hups_seen )
 	    {
+	    hups_seen = got_hup;
 	    re_open_logfile();
-	    got_hup = 0;
+	    }
+
+	/* Have any of our CGIs finished? */
+	if ( got_chld != chlds_seen )
+	    {
+	    chlds_seen = got_chld;
+	    if ( hs != (httpd_server*) 0 )
+		httpd_reap_children( hs );
+	    }
+
+	/* Time to stop taking new connections?  This gets checked up here
+	** so that a thread woken only by its timers still notices.
+	*/
+	if ( got_usr1 && ! terminate )
+	    {
+	    terminate = 1;
+	    if ( hs != (httpd_server*) 0 )
+		{
+		if ( hs->listen4_fd != -1 )
+		    fdwatch_del_fd( hs->listen4_fd );
+		if ( hs->listen6_fd != -1 )
+		    fdwatch_del_fd( hs->listen6_fd );
+		httpd_unlisten( hs );
+		}
+	    continue;
 	    }
 
 	/* Do the fd watch. */
@@ -770,6 +1261,18 @@ main( int argc, char** argv )
 	    continue;
 	    }
 
+	/* Woken up by a signal?  The flags get looked at up top. */
+	if ( fdwatch_check_fd( wake_fd ) )
+	    {
+	    while ( read( wake_fd, buf, sizeof(buf) ) > 0 )
+		continue;
+	    continue;
+	    }
+
+	/* Did any cached files change? */
+	if ( watch_fd != -1 && fdwatch_check_fd( watch_fd ) )
+	    stc_watch_events();
+
 	/* Is it a new connection? */
 	if ( hs != (httpd_server*) 0 && hs->listen6_fd != -1 &&
 	     fdwatch_check_fd( hs->listen6_fd ) )
@@ -810,26 +1313,7 @@ main( int argc, char** argv )
 		    }
 	    }
 	tmr_run( &tv );
-
-	if ( got_usr1 && ! terminate )
-	    {
-	    terminate = 1;
-	    if ( hs != (httpd_server*) 0 )
-		{
-		if ( hs->listen4_fd != -1 )
-		    fdwatch_del_fd( hs->listen4_fd );
-		if ( hs->listen6_fd != -1 )
-		    fdwatch_del_fd( hs->listen6_fd );
-		httpd_unlisten( hs );
-		}
-	    }
 	}
-
-    /* The main loop terminated. */
-    shut_down();
-    syslog( LOG_NOTICE, "exiting" );
-    closelog();
-    exit( 0 );
     }
 
 
@@ -880,6 +1364,11 @@ parse_args( int argc, char** argv )
     charset = DEFAULT_CHARSET;
     p3p = "";
     max_age = -1;
+    keepalive_timeout = IDLE_KEEPALIVE_TIMELIMIT;
+    keepalive_max = KEEPALIVE_MAX_REQUESTS;
+    workers = 0;
+    threads = 1;
+    use_sendfile = 0;
     argn = 1;
     while ( argn < argc && argv[argn][0] == '-' )
 	{
@@ -975,6 +1464,18 @@ parse_args( int argc, char** argv )
 	    ++argn;
 	    max_age = atoi( argv[argn] );
 	    }
+	else if ( strcmp( argv[argn], "-workers" ) == 0 && argn + 1 < argc )
+	    {
+	    ++argn;
+	    workers = atoi( argv[argn] );
+	    }
+	else if ( strcmp( argv[argn], "-threads" ) == 0 && argn + 1 < argc )
+	    {
+	    ++argn;
+	    threads = atoi( argv[argn] );
+	    }
+	else if ( strcmp( argv[argn], "-sendfile" ) == 0 )
+	    use_sendfile = 1;
 	else if ( strcmp( argv[argn], "-D" ) == 0 )
 	    debug = 1;
 	else
@@ -983,6 +1484,8 @@ parse_args( int argc, char** argv )
 	}
     if ( argn != argc )
 	usage();
+    if ( threads < 1 )
+	threads = 1;
     }
 
 
@@ -990,7 +1493,7 @@ static void
 usage( void )
     {
     (void) fprintf( stderr,
-"usage:  %s [-C configfile] [-p port] [-d dir] [-r|-nor] [-dd data_dir] [-s|-nos] [-v|-nov] [-g|-nog] [-u user] [-c cgipat] [-t throttles] [-h host] [-l logfile] [-i pidfile] [-T charset] [-P P3P] [-M maxage] [-V] [-D]\n",
+"usage:  %s [-C configfile] [-p port] [-d dir] [-r|-nor] [-dd data_dir] [-s|-nos] [-v|-nov] [-g|-nog] [-u user] [-c cgipat] [-t throttles] [-h host] [-l logfile] [-i pidfile] [-T charset] [-P P3P] [-M maxage] [-workers n] [-threads n] [-sendfile] [-V] [-D]\n",
 	argv0 );
     exit( 1 );
     }
@@ -1165,6 +1668,31 @@ read_config( char* filename )
 		value_required( name, value );
 		max_age = atoi( value );
 		}
+	    else if ( strcasecmp( name, "workers" ) == 0 )
+		{
+		value_required( name, value );
+		workers = atoi( value );
+		}
+	    else if ( strcasecmp( name, "threads" ) == 0 )
+		{
+		value_required( name, value );
+		threads = atoi( value );
+		}
+	    else if ( strcasecmp( name, "sendfile" ) == 0 )
+		{
+		no_value_required( name, value );
+		use_sendfile = 1;
+		}
+	    else if ( strcasecmp( name, "keepalive_timeout" ) == 0 )
+		{
+		value_required( name, value );
+		keepalive_timeout = atoi( value );
+		}
+	    else if ( strcasecmp( name, "keepalive_max" ) == 0 )
+		{
+		value_required( name, value );
+		keepalive_max = atoi( value );
+		}
 	    else
 		{
 		(void) fprintf(
@@ -1457,7 +1985,7 @@ read_throttlefile( char* tf )
 static void
 shut_down( void )
     {
-    int cnum;
+    int cnum, tnum;
     struct timeval tv;
 
     (void) gettimeofday( &tv, (struct timezone*) 0 );
@@ -1469,7 +1997,7 @@ shut_down( void )
 	if ( connects[cnum].hc != (httpd_conn*) 0 )
 	    {
 	    httpd_destroy_conn( connects[cnum].hc );
-	    free( (void*) connects[cnum].hc );
+	    free( (void*) connects_cold[cnum].hc_mem );
 	    --httpd_conn_count;
 	    connects[cnum].hc = (httpd_conn*) 0;
 	    }
@@ -1478,15 +2006,24 @@ shut_down( void )
 	{
 	httpd_server* ths = hs;
 	hs = (httpd_server*) 0;
+	for ( tnum = 0; tnum < threads; ++tnum )
+	    if ( servers[tnum] == ths )
+		servers[tnum] = (httpd_server*) 0;
 	if ( ths->listen4_fd != -1 )
 	    fdwatch_del_fd( ths->listen4_fd );
 	if ( ths->listen6_fd != -1 )
 	    fdwatch_del_fd( ths->listen6_fd );
 	httpd_terminate( ths );
 	}
-    mmc_term();
+    /* The map cache is shared, so leave it alone if other threads might
+    ** still be using it.
+    */
+    if ( threads <= 1 )
+	mmc_term();
+    stc_term();
     tmr_term();
-    free( (void*) connects );
+    free( (void*) connects_mem );
+    free( (void*) connects_cold );
     if ( throttles != (throttletab*) 0 )
 	free( (void*) throttles );
     }
@@ -1525,12 +2062,16 @@ handle_newconnect( struct timeval* tvP, int listen_fd )
 	/* Make the httpd_conn if necessary. */
 	if ( c->hc == (httpd_conn*) 0 )
 	    {
-	    c->hc = NEW( httpd_conn, 1 );
-	    if ( c->hc == (httpd_conn*) 0 )
+	    c->cold->hc_mem =
+		NEW( char, sizeof(httpd_conn) + CONNECT_ALIGN - 1 );
+	    if ( c->cold->hc_mem == (char*) 0 )
 		{
 		syslog( LOG_CRIT, "out of memory allocating an httpd_conn" );
 		exit( 1 );
 		}
+	    c->hc = (httpd_conn*) ( c->cold->hc_mem +
+		( CONNECT_ALIGN - (unsigned long) c->cold->hc_mem % CONNECT_ALIGN ) %
+		    CONNECT_ALIGN );
 	    c->hc->initialized = 0;
 	    ++httpd_conn_count;
 	    }
@@ -1549,22 +2090,24 @@ handle_newconnect( struct timeval* tvP, int listen_fd )
 	    case GC_NO_MORE:
 	    return 1;
 	    }
-	c->conn_state = CNST_READING;
+	set_conn_state( c, CNST_READING );
 	/* Pop it off the free list. */
-	first_free_connect = c->next_free_connect;
-	c->next_free_connect = -1;
+	first_free_connect = c->cold->next_free_connect;
+	c->cold->next_free_connect = -1;
 	++num_connects;
 	client_data.p = c;
 	c->active_at = tvP->tv_sec;
-	c->wakeup_timer = (Timer*) 0;
-	c->linger_timer = (Timer*) 0;
+	c->cold->wakeup_timer = (Timer*) 0;
+	c->cold->linger_timer = (Timer*) 0;
 	c->next_byte_index = 0;
 	c->numtnums = 0;
+	c->cold->num_requests = 0;
+	c->cold->held_only = 0;
 
 	/* Set the connection file descriptor to no-delay mode. */
 	httpd_set_ndelay( c->hc->conn_fd );
 
-	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
+	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ | CONN_FDW_FLAGS );
 
 	++stats_connections;
 	if ( num_connects > stats_simultaneous )
@@ -1576,147 +2119,251 @@ handle_newconnect( struct timeval* tvP, int listen_fd )
 static void
 handle_read( connecttab* c, struct timeval* tvP )
     {
-    int sz;
-    ClientData client_data;
+    int sz, want, full;
     httpd_conn* hc = c->hc;
 
-    /* Is there room in our buffer to read more bytes? */
-    if ( hc->read_idx >= hc->read_size )
+    do
 	{
-	if ( hc->read_size > 5000 )
+	/* One read() per wakeup is normally enough, since fdwatch will tell
+	** us about any leftover bytes next time around.  In edge-triggered
+	** mode it won't, so we keep reading until a read comes up short.
+	*/
+	full = 0;
+	for (;;)
 	    {
-	    httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
-	    finish_connection( c, tvP );
-	    return;
+	    /* Is there room in our buffer to read more bytes? */
+	    if ( hc->read_idx >= hc->read_size )
+		{
+		/* If a pipelining client has filled the buffer with whole
+		** requests, answer those before reading any more.
+		*/
+		if ( httpd_got_request( hc ) != GR_NO_REQUEST )
+		    {
+		    full = 1;
+		    break;
+		    }
+		/* The limit goes by what has been read, not by the size
+		** of the buffer, which may have come from the pool.
+		*/
+		if ( hc->read_idx > 5000 )
+		    {
+		    httpd_send_err(
+			hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		    finish_connection( c, tvP );
+		    return;
+		    }
+		httpd_borrow_read_buf( hc, hc->read_size + 1000 );
+		}
+
+	    /* Read some more bytes. */
+	    want = hc->read_size - hc->read_idx;
+	    sz = read( hc->conn_fd, &(hc->read_buf[hc->read_idx]), want );
+	    /* Ignore EINTR and EAGAIN.  Also ignore EWOULDBLOCK.  At first
+	    ** glance you would think that connections returned by fdwatch
+	    ** as readable should never give an EWOULDBLOCK; however, this
+	    ** apparently can happen if a packet gets garbled.
+	    */
+	    if ( sz < 0 &&
+		 ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+		break;
+	    if ( sz <= 0 )
+		{
+		/* EOF or error.  On a persistent connection that's between
+		** requests, this is just the client going away.
+		*/
+		if ( c->cold->num_requests == 0 || hc->read_idx > 0 )
+		    httpd_send_err(
+			hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		finish_connection( c, tvP );
+		return;
+		}
+	    hc->read_idx += sz;
+	    c->active_at = tvP->tv_sec;
+	    if ( ! ( CONN_FDW_FLAGS & FDW_EDGE ) || sz < want )
+		break;
 	    }
-	httpd_realloc_str(
-	    &hc->read_buf, &hc->read_size, hc->read_size + 1000 );
-	}
 
-    /* Read some more bytes. */
-    sz = read(
-	hc->conn_fd, &(hc->read_buf[hc->read_idx]),
-	hc->read_size - hc->read_idx );
-    if ( sz == 0 )
-	{
-	httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
-	finish_connection( c, tvP );
-	return;
+	handle_request( c, tvP );
 	}
-    if ( sz < 0 )
+    while ( full && c->conn_state == CNST_READING );
+    }
+
+
+/* Answers the complete requests in a connection's read buffer, in order.
+** Responses with no body are held in hc->response, so that a run of them
+** goes out in a single write, or rides along in front of the next file.
+*/
+static void
+handle_request( connecttab* c, struct timeval* tvP )
+    {
+    ClientData client_data;
+    httpd_conn* hc = c->hc;
+
+    while ( c->conn_state == CNST_READING )
 	{
-	/* Ignore EINTR and EAGAIN.  Also ignore EWOULDBLOCK.  At first glance
-	** you would think that connections returned by fdwatch as readable
-	** should never give an EWOULDBLOCK; however, this apparently can
-	** happen if a packet gets garbled.
+	/* If the held responses are piling up, send them before answering
+	** any more requests.
 	*/
-	if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK )
+	if ( hc->responselen >= MAX_HELD_RESPONSE )
+	    {
+	    send_held( c, tvP, 1 );
 	    return;
-	httpd_send_err(
-	    hc, 400, httpd_err400title, "", httpd_err400form, "" );
-	finish_connection( c, tvP );
-	return;
-	}
-    hc->read_idx += sz;
-    c->active_at = tvP->tv_sec;
+	    }
 
-    /* Do we have a complete request yet? */
-    switch ( httpd_got_request( hc ) )
-	{
-	case GR_NO_REQUEST:
-	return;
-	case GR_BAD_REQUEST:
-	httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
-	finish_connection( c, tvP );
-	return;
-	}
+	/* Do we have a complete request yet? */
+	switch ( httpd_got_request( hc ) )
+	    {
+	    case GR_NO_REQUEST:
+	    /* Nope.  Send whatever responses we've been holding.  If there
+	    ** aren't any, the buffers can go back to the pool while we wait
+	    ** for a new request.
+	    */
+	    if ( hc->responselen > 0 )
+		send_held( c, tvP, 1 );
+	    else
+		httpd_idle_conn( hc );
+	    return;
+	    case GR_BAD_REQUEST:
+	    httpd_send_err(
+		hc, 400, httpd_err400title, "", httpd_err400form, "" );
+	    finish_connection( c, tvP );
+	    return;
+	    }
 
-    /* Yes.  Try parsing and resolving it. */
-    if ( httpd_parse_request( hc ) < 0 )
-	{
-	finish_connection( c, tvP );
-	return;
-	}
+	/* Yes.  Try parsing and resolving it. */
+	if ( httpd_parse_request( hc ) < 0 )
+	    {
+	    finish_connection( c, tvP );
+	    return;
+	    }
 
-    /* Check the throttle table */
-    if ( ! check_throttles( c ) )
-	{
-	httpd_send_err(
-	    hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
-	finish_connection( c, tvP );
-	return;
-	}
+	/* Decide now whether the connection can stay open after this
+	** request, since the response headers have to say so.
+	*/
+	++c->cold->num_requests;
+	if ( keepalive_timeout <= 0 || terminate ||
+	     ( keepalive_max > 0 && c->cold->num_requests >= keepalive_max ) )
+	    hc->keep_alive = 0;
 
-    /* Start the connection going. */
-    if ( httpd_start_request( hc, tvP ) < 0 )
-	{
-	/* Something went wrong.  Close down the connection. */
-	finish_connection( c, tvP );
-	return;
-	}
+	/* Check the throttle table */
+	if ( ! check_throttles( c ) )
+	    {
+	    httpd_send_err(
+		hc, 503, httpd_err503title, "", httpd_err503form,
+		hc->encodedurl );
+	    finish_connection( c, tvP );
+	    return;
+	    }
 
-    /* Fill in end_byte_index. */
-    if ( hc->got_range )
-	{
-	c->next_byte_index = hc->first_byte_index;
-	c->end_byte_index = hc->last_byte_index + 1;
-	}
-    else if ( hc->bytes_to_send < 0 )
-	c->end_byte_index = 0;
-    else
-	c->end_byte_index = hc->bytes_to_send;
+	/* Start the connection going. */
+	if ( httpd_start_request( hc, tvP ) < 0 )
+	    {
+	    /* Something went wrong.  Close down the connection. */
+	    finish_connection( c, tvP );
+	    return;
+	    }
 
-    /* Check if it's already handled. */
-    if ( hc->file_address == (char*) 0 )
-	{
-	/* No file address means someone else is handling it. */
-	int tind;
-	for ( tind = 0; tind < c->numtnums; ++tind )
-	    throttles[c->tnums[tind]].bytes_since_avg += hc->bytes_sent;
-	c->next_byte_index = hc->bytes_sent;
-	finish_connection( c, tvP );
-	return;
-	}
-    if ( c->next_byte_index >= c->end_byte_index )
-	{
-	/* There's nothing to send. */
-	finish_connection( c, tvP );
-	return;
-	}
+	/* Fill in end_byte_index.  A multipart range response counts
+	** through its whole body, boundaries included.
+	*/
+	if ( hc->got_range && hc->nranges > 1 )
+	    c->end_byte_index = hc->bytes_to_send;
+	else if ( hc->got_range )
+	    {
+	    c->next_byte_index = hc->first_byte_index;
+	    c->end_byte_index = hc->last_byte_index + 1;
+	    }
+	else if ( hc->bytes_to_send < 0 )
+	    c->end_byte_index = 0;
+	else
+	    c->end_byte_index = hc->bytes_to_send;
 
-    /* Cool, we have a valid connection and a file to send to it. */
-    c->conn_state = CNST_SENDING;
-    c->started_at = tvP->tv_sec;
-    c->wouldblock_delay = 0;
-    client_data.p = c;
+	/* Check if it's already handled. */
+	if ( hc->file_address == (char*) 0 )
+	    {
+	    /* No file address means someone else is handling it. */
+	    int tind;
+	    for ( tind = 0; tind < c->numtnums; ++tind )
+		throttles[c->cold->tnums[tind]].bytes_since_avg += hc->bytes_sent;
+	    c->next_byte_index = hc->bytes_sent;
+	    finish_connection( c, tvP );
+	    continue;
+	    }
+	if ( c->next_byte_index >= c->end_byte_index )
+	    {
+	    /* There's nothing to send. */
+	    finish_connection( c, tvP );
+	    continue;
+	    }
+
+	/* Cool, we have a valid connection and a file to send to it. */
+	set_conn_state( c, CNST_SENDING );
+	c->cold->started_at = tvP->tv_sec;
+	c->wouldblock_delay = 0;
+	client_data.p = c;
 
-    fdwatch_del_fd( hc->conn_fd );
-    fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE );
+	fdwatch_del_fd( hc->conn_fd );
+	fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE | CONN_FDW_FLAGS );
+	}
     }
 
 
 static void
 handle_send( connecttab* c, struct timeval* tvP )
     {
-    size_t max_bytes;
+    size_t max_bytes, nbytes, avail;
     int sz, coast;
     ClientData client_data;
     time_t elapsed;
     httpd_conn* hc = c->hc;
     int tind;
+    char* src = (char*) 0;
 
     if ( c->max_limit == THROTTLE_NOLIMIT )
 	max_bytes = 1000000000L;
     else
 	max_bytes = c->max_limit / 4;	/* send at most 1/4 seconds worth */
 
+    /* Find the rest of the file in memory.  Big files only have a
+    ** window mapped at a time, and sendfile() doesn't need them mapped.
+    */
+    avail = c->end_byte_index - c->next_byte_index;
+    if ( avail == 0 )
+	src = (char*) 0;	/* only held responses to send */
+    else if ( hc->nranges > 1 )
+	src = (char*) 0;	/* send_parts() finds its own pieces */
+    else if ( hc->file_fd == -1 )
+	src = &(hc->file_address[c->next_byte_index]);
+    else if ( ! use_sendfile )
+	{
+	src = httpd_file_window( hc, c->next_byte_index, &nbytes );
+	if ( src == (char*) 0 )
+	    {
+	    clear_connection( c, tvP );
+	    return;
+	    }
+	avail = MIN( avail, nbytes );
+	}
+
+    if ( avail == 0 )
+	{
+	nbytes = hc->responselen;
+	sz = write( hc->conn_fd, hc->response, nbytes );
+	}
+    else if ( hc->nranges > 1 )
+	sz = send_parts( c, max_bytes, &nbytes );
+    else
+#ifdef HAVE_SYS_SENDFILE_H
+    if ( use_sendfile && hc->file_fd != -1 )
+	sz = send_file( c, max_bytes, &nbytes );
+    else
+#endif /* HAVE_SYS_SENDFILE_H */
     /* Do we need to write the headers first? */
     if ( hc->responselen == 0 )
 	{
 	/* No, just write the file. */
-	sz = write(
-	    hc->conn_fd, &(hc->file_address[c->next_byte_index]),
-	    MIN( c->end_byte_index - c->next_byte_index, max_bytes ) );
+	nbytes = MIN( avail, max_bytes );
+	sz = write( hc->conn_fd, src, nbytes );
 	}
     else
 	{
@@ -1727,14 +2374,22 @@ handle_send( connecttab* c, struct timeval* tvP )
 
 	iv[0].iov_base = hc->response;
 	iv[0].iov_len = hc->responselen;
-	iv[1].iov_base = &(hc->file_address[c->next_byte_index]);
-	iv[1].iov_len = MIN( c->end_byte_index - c->next_byte_index, max_bytes );
+	iv[1].iov_base = src;
+	iv[1].iov_len = MIN( avail, max_bytes );
+	nbytes = iv[0].iov_len + iv[1].iov_len;
 	sz = writev( hc->conn_fd, iv, 2 );
 	}
 
     if ( sz < 0 && errno == EINTR )
 	return;
 
+    if ( ( CONN_FDW_FLAGS & FDW_EDGE ) &&
+	 sz < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) )
+	/* In edge-triggered mode a full socket is normal, we'll get
+	** another event when there's room.
+	*/
+	return;
+
     if ( sz == 0 ||
 	 ( sz < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) ) )
 	{
@@ -1749,14 +2404,14 @@ handle_send( connecttab* c, struct timeval* tvP )
 	** blocking code, for use with throttling.
 	*/
 	c->wouldblock_delay += MIN_WOULDBLOCK_DELAY;
-	c->conn_state = CNST_PAUSING;
+	set_conn_state( c, CNST_PAUSING );
 	fdwatch_del_fd( hc->conn_fd );
 	client_data.p = c;
-	if ( c->wakeup_timer != (Timer*) 0 )
+	if ( c->cold->wakeup_timer != (Timer*) 0 )
 	    syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
-	c->wakeup_timer = tmr_create(
+	c->cold->wakeup_timer = tmr_create(
 	    tvP, wakeup_connection, client_data, c->wouldblock_delay, 0 );
-	if ( c->wakeup_timer == (Timer*) 0 )
+	if ( c->cold->wakeup_timer == (Timer*) 0 )
 	    {
 	    syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
 	    exit( 1 );
@@ -1785,6 +2440,8 @@ handle_send( connecttab* c, struct timeval* tvP )
 
     /* Ok, we wrote something. */
     c->active_at = tvP->tv_sec;
+    if ( (size_t) sz < nbytes )
+	nbytes = 0;	/* short write, the socket is full */
     /* Was this a headers + file writev()? */
     if ( hc->responselen > 0 )
 	{
@@ -1808,13 +2465,29 @@ handle_send( connecttab* c, struct timeval* tvP )
     c->next_byte_index += sz;
     c->hc->bytes_sent += sz;
     for ( tind = 0; tind < c->numtnums; ++tind )
-	throttles[c->tnums[tind]].bytes_since_avg += sz;
+	throttles[c->cold->tnums[tind]].bytes_since_avg += sz;
 
     /* Are we done? */
-    if ( c->next_byte_index >= c->end_byte_index )
+    if ( c->next_byte_index >= c->end_byte_index && hc->responselen == 0 )
 	{
-	/* This connection is finished! */
+	if ( c->cold->held_only )
+	    {
+	    /* The held responses are out.  Go back to the requests
+	    ** behind them; this one was already logged and reset.
+	    */
+	    c->cold->held_only = 0;
+	    fdwatch_del_fd( hc->conn_fd );
+	    fdwatch_add_fd( hc->conn_fd, c, FDW_READ | CONN_FDW_FLAGS );
+	    set_conn_state( c, CNST_READING );
+	    handle_request( c, tvP );
+	    return;
+	    }
+	/* This connection is finished!  If it's staying open, answer
+	** any pipelined requests that came in behind this one.
+	*/
 	finish_connection( c, tvP );
+	if ( c->conn_state == CNST_READING )
+	    handle_request( c, tvP );
 	return;
 	}
 
@@ -1825,24 +2498,24 @@ handle_send( connecttab* c, struct timeval* tvP )
     /* If we're throttling, check if we're sending too fast. */
     if ( c->max_limit != THROTTLE_NOLIMIT )
 	{
-	elapsed = tvP->tv_sec - c->started_at;
+	elapsed = tvP->tv_sec - c->cold->started_at;
 	if ( elapsed == 0 )
 	    elapsed = 1;	/* count at least one second */
 	if ( c->hc->bytes_sent / elapsed > c->max_limit )
 	    {
-	    c->conn_state = CNST_PAUSING;
+	    set_conn_state( c, CNST_PAUSING );
 	    fdwatch_del_fd( hc->conn_fd );
 	    /* How long should we wait to get back on schedule?  If less
 	    ** than a second (integer math rounding), use 1/2 second.
 	    */
 	    coast = c->hc->bytes_sent / c->max_limit - elapsed;
 	    client_data.p = c;
-	    if ( c->wakeup_timer != (Timer*) 0 )
+	    if ( c->cold->wakeup_timer != (Timer*) 0 )
 		syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
-	    c->wakeup_timer = tmr_create(
+	    c->cold->wakeup_timer = tmr_create(
 		tvP, wakeup_connection, client_data,
 		coast > 0 ? ( coast * 1000L ) : 500L, 0 );
-	    if ( c->wakeup_timer == (Timer*) 0 )
+	    if ( c->cold->wakeup_timer == (Timer*) 0 )
 		{
 		syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
 		exit( 1 );
@@ -1850,7 +2523,90 @@ handle_send( connecttab* c, struct timeval* tvP )
 	    }
 	}
     /* (No check on min_limit here, that only controls connection startups.) */
+
+    /* In edge-triggered mode we won't hear about this socket again until
+    ** it drains, so if it took everything we gave it, keep going.
+    */
+    if ( ( CONN_FDW_FLAGS & FDW_EDGE ) && nbytes != 0 &&
+	 c->conn_state == CNST_SENDING )
+	handle_send( c, tvP );
+    }
+
+
+/* The multipart/byteranges version of handle_send's writev().  The
+** headers, boundaries and file slices all go out in one writev().  The
+** return value and *nbytesP work like writev()'s.
+*/
+static int
+send_parts( connecttab* c, size_t max_bytes, size_t* nbytesP )
+    {
+    httpd_conn* hc = c->hc;
+    struct iovec iv[2 * MAX_BYTE_RANGES + 2];
+    int n, r, i;
+
+    n = 0;
+    if ( hc->responselen > 0 )
+	{
+	iv[0].iov_base = hc->response;
+	iv[0].iov_len = hc->responselen;
+	n = 1;
+	}
+    r = httpd_parts_iovec(
+	hc, c->next_byte_index,
+	MIN( c->end_byte_index - c->next_byte_index, max_bytes ),
+	&iv[n], sizeof(iv) / sizeof(*iv) - n );
+    if ( r < 0 )
+	{
+	/* The mapping failure has been logged already. */
+	errno = EINVAL;
+	return -1;
+	}
+    n += r;
+    *nbytesP = 0;
+    for ( i = 0; i < n; ++i )
+	*nbytesP += iv[i].iov_len;
+    return writev( hc->conn_fd, iv, n );
+    }
+
+
+#ifdef HAVE_SYS_SENDFILE_H
+/* The sendfile() version of handle_send's writev().  Any headers go out
+** first with MSG_MORE, so the kernel can pack them into the same packet
+** as the start of the file, then the kernel copies the file directly from
+** the page cache.  The return value and *nbytesP work like writev()'s.
+*/
+static int
+send_file( connecttab* c, size_t max_bytes, size_t* nbytesP )
+    {
+    httpd_conn* hc = c->hc;
+    size_t hbytes, fbytes;
+    off_t offset;
+    int hsz, fsz;
+
+    hbytes = hc->responselen;
+    fbytes = MIN( c->end_byte_index - c->next_byte_index, max_bytes );
+    *nbytesP = hbytes + fbytes;
+
+    hsz = 0;
+    if ( hbytes > 0 )
+	{
+#ifdef MSG_MORE
+	hsz = send( hc->conn_fd, hc->response, hbytes, MSG_MORE );
+#else /* MSG_MORE */
+	hsz = send( hc->conn_fd, hc->response, hbytes, 0 );
+#endif /* MSG_MORE */
+	if ( hsz < 0 || (size_t) hsz < hbytes )
+	    return hsz;
+	}
+
+    offset = c->next_byte_index;
+    fsz = sendfile( hc->conn_fd, hc->file_fd, &offset, fbytes );
+    if ( fsz < 0 )
+	/* If the headers went out, report that much as a short write. */
+	return hsz > 0 ? hsz : fsz;
+    return hsz + fsz;
     }
+#endif /* HAVE_SYS_SENDFILE_H */
 
 
 static void
@@ -1877,7 +2633,7 @@ check_throttles( connecttab* c )
     long l;
 
     c->numtnums = 0;
-    c->max_limit = c->min_limit = THROTTLE_NOLIMIT;
+    c->max_limit = c->cold->min_limit = THROTTLE_NOLIMIT;
     for ( tnum = 0; tnum < numthrottles && c->numtnums < MAXTHROTTLENUMS;
 	  ++tnum )
 	if ( match( throttles[tnum].pattern, c->hc->expnfilename ) )
@@ -1893,7 +2649,7 @@ check_throttles( connecttab* c )
 		syslog( LOG_ERR, "throttle sending count was negative - shouldn't happen!" );
 		throttles[tnum].num_sending = 0;
 		}
-	    c->tnums[c->numtnums++] = tnum;
+	    c->cold->tnums[c->numtnums++] = tnum;
 	    ++throttles[tnum].num_sending;
 	    l = throttles[tnum].max_limit / throttles[tnum].num_sending;
 	    if ( c->max_limit == THROTTLE_NOLIMIT )
@@ -1901,10 +2657,10 @@ check_throttles( connecttab* c )
 	    else
 		c->max_limit = MIN( c->max_limit, l );
 	    l = throttles[tnum].min_limit;
-	    if ( c->min_limit == THROTTLE_NOLIMIT )
-		c->min_limit = l;
+	    if ( c->cold->min_limit == THROTTLE_NOLIMIT )
+		c->cold->min_limit = l;
 	    else
-		c->min_limit = MAX( c->min_limit, l );
+		c->cold->min_limit = MAX( c->cold->min_limit, l );
 	    }
     return 1;
     }
@@ -1916,7 +2672,7 @@ clear_throttles( connecttab* c, struct timeval* tvP )
     int tind;
 
     for ( tind = 0; tind < c->numtnums; ++tind )
-	--throttles[c->tnums[tind]].num_sending;
+	--throttles[c->cold->tnums[tind]].num_sending;
     }
 
 
@@ -1924,7 +2680,7 @@ static void
 update_throttles( ClientData client_data, struct timeval* nowP )
     {
     int tnum, tind;
-    int cnum;
+    int state;
     connecttab* c;
     long l;
 
@@ -1952,15 +2708,13 @@ update_throttles( ClientData client_data, struct timeval* nowP )
     /* Now update the sending rate on all the currently-sending connections,
     ** redistributing it evenly.
     */
-    for ( cnum = 0; cnum < max_connects; ++cnum )
-	{
-	c = &connects[cnum];
-	if ( c->conn_state == CNST_SENDING || c->conn_state == CNST_PAUSING )
+    for ( state = CNST_SENDING; state <= CNST_PAUSING; ++state )
+	for ( c = state_lists[state]; c != (connecttab*) 0; c = c->cold->state_next )
 	    {
 	    c->max_limit = THROTTLE_NOLIMIT;
 	    for ( tind = 0; tind < c->numtnums; ++tind )
 		{
-		tnum = c->tnums[tind];
+		tnum = c->cold->tnums[tind];
 		l = throttles[tnum].max_limit / throttles[tnum].num_sending;
 		if ( c->max_limit == THROTTLE_NOLIMIT )
 		    c->max_limit = l;
@@ -1968,6 +2722,32 @@ update_throttles( ClientData client_data, struct timeval* nowP )
 		    c->max_limit = MIN( c->max_limit, l );
 		}
 	    }
+    }
+
+
+/* Moves a connection to a new state, and from one per-state list to
+** another.
+*/
+static void
+set_conn_state( connecttab* c, int state )
+    {
+    if ( c->conn_state != CNST_FREE )
+	{
+	if ( c->cold->state_prev == (connecttab*) 0 )
+	    state_lists[c->conn_state] = c->cold->state_next;
+	else
+	    c->cold->state_prev->cold->state_next = c->cold->state_next;
+	if ( c->cold->state_next != (connecttab*) 0 )
+	    c->cold->state_next->cold->state_prev = c->cold->state_prev;
+	}
+    c->conn_state = state;
+    if ( state != CNST_FREE )
+	{
+	c->cold->state_prev = (connecttab*) 0;
+	c->cold->state_next = state_lists[state];
+	if ( c->cold->state_next != (connecttab*) 0 )
+	    c->cold->state_next->cold->state_prev = c;
+	state_lists[state] = c;
 	}
     }
 
@@ -1975,23 +2755,83 @@ update_throttles( ClientData client_data, struct timeval* nowP )
 static void
 finish_connection( connecttab* c, struct timeval* tvP )
     {
-    /* If we haven't actually sent the buffered response yet, do so now. */
-    httpd_write_response( c->hc );
+    /* On a persistent connection a buffered response can wait, in case
+    ** responses to pipelined requests can go out with it.
+    */
+    if ( c->hc->keep_alive )
+	{
+	keepalive_connection( c, tvP );
+	return;
+	}
+
+    /* If we haven't actually sent the buffered response yet, send it
+    ** the same way as a file, and come back here when it's gone.
+    */
+    if ( c->hc->responselen > 0 )
+	{
+	send_held( c, tvP, 0 );
+	return;
+	}
 
     /* And clear. */
     clear_connection( c, tvP );
     }
 
 
+/* Starts sending hc->response without a file behind it.  With held_only
+** set the request has already been reset, and handle_send() goes back to
+** reading afterwards instead of finishing the connection.
+*/
+static void
+send_held( connecttab* c, struct timeval* tvP, int held_only )
+    {
+    c->cold->held_only = held_only;
+    c->next_byte_index = c->end_byte_index = 0;
+    if ( c->conn_state != CNST_PAUSING )
+	fdwatch_del_fd( c->hc->conn_fd );
+    set_conn_state( c, CNST_SENDING );
+    c->cold->started_at = tvP->tv_sec;
+    c->wouldblock_delay = 0;
+    fdwatch_add_fd( c->hc->conn_fd, c, FDW_WRITE | CONN_FDW_FLAGS );
+    }
+
+
+static void
+keepalive_connection( connecttab* c, struct timeval* tvP )
+    {
+    if ( c->cold->wakeup_timer != (Timer*) 0 )
+	{
+	tmr_cancel( c->cold->wakeup_timer );
+	c->cold->wakeup_timer = 0;
+	}
+
+    stats_bytes += c->hc->bytes_sent;
+    clear_throttles( c, tvP );
+    c->numtnums = 0;
+
+    /* Go back to watching for input, keeping the socket open. */
+    if ( c->conn_state != CNST_READING )
+	{
+	if ( c->conn_state != CNST_PAUSING )
+	    fdwatch_del_fd( c->hc->conn_fd );
+	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ | CONN_FDW_FLAGS );
+	}
+    httpd_reset_conn( c->hc, tvP );
+    set_conn_state( c, CNST_READING );
+    c->active_at = tvP->tv_sec;
+    c->next_byte_index = 0;
+    }
+
+
 static void
 clear_connection( connecttab* c, struct timeval* tvP )
     {
     ClientData client_data;
 
-    if ( c->wakeup_timer != (Timer*) 0 )
+    if ( c->cold->wakeup_timer != (Timer*) 0 )
 	{
-	tmr_cancel( c->wakeup_timer );
-	c->wakeup_timer = 0;
+	tmr_cancel( c->cold->wakeup_timer );
+	c->cold->wakeup_timer = 0;
 	}
 
     /* This is our version of Apache's lingering_close() routine, which is
@@ -2008,23 +2848,23 @@ clear_connection( connecttab* c, struct timeval* tvP )
     if ( c->conn_state == CNST_LINGERING )
 	{
 	/* If we were already lingering, shut down for real. */
-	tmr_cancel( c->linger_timer );
-	c->linger_timer = (Timer*) 0;
+	tmr_cancel( c->cold->linger_timer );
+	c->cold->linger_timer = (Timer*) 0;
 	c->hc->should_linger = 0;
 	}
     if ( c->hc->should_linger )
 	{
 	if ( c->conn_state != CNST_PAUSING )
 	    fdwatch_del_fd( c->hc->conn_fd );
-	c->conn_state = CNST_LINGERING;
+	set_conn_state( c, CNST_LINGERING );
 	shutdown( c->hc->conn_fd, SHUT_WR );
 	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
 	client_data.p = c;
-	if ( c->linger_timer != (Timer*) 0 )
+	if ( c->cold->linger_timer != (Timer*) 0 )
 	    syslog( LOG_ERR, "replacing non-null linger_timer!" );
-	c->linger_timer = tmr_create(
+	c->cold->linger_timer = tmr_create(
 	    tvP, linger_clear_connection, client_data, LINGER_TIME, 0 );
-	if ( c->linger_timer == (Timer*) 0 )
+	if ( c->cold->linger_timer == (Timer*) 0 )
 	    {
 	    syslog( LOG_CRIT, "tmr_create(linger_clear_connection) failed" );
 	    exit( 1 );
@@ -2043,13 +2883,13 @@ really_clear_connection( connecttab* c, struct timeval* tvP )
 	fdwatch_del_fd( c->hc->conn_fd );
     httpd_close_conn( c->hc, tvP );
     clear_throttles( c, tvP );
-    if ( c->linger_timer != (Timer*) 0 )
+    if ( c->cold->linger_timer != (Timer*) 0 )
 	{
-	tmr_cancel( c->linger_timer );
-	c->linger_timer = 0;
+	tmr_cancel( c->cold->linger_timer );
+	c->cold->linger_timer = 0;
 	}
-    c->conn_state = CNST_FREE;
-    c->next_free_connect = first_free_connect;
+    set_conn_state( c, CNST_FREE );
+    c->cold->next_free_connect = first_free_connect;
     first_free_connect = c - connects;	/* division by sizeof is implied */
     --num_connects;
     }
@@ -2058,27 +2898,17 @@ really_clear_connection( connecttab* c, struct timeval* tvP )
 static void
 idle( ClientData client_data, struct timeval* nowP )
     {
-    int cnum;
+    int state;
     connecttab* c;
+    connecttab* next;
 
-    for ( cnum = 0; cnum < max_connects; ++cnum )
-	{
-	c = &connects[cnum];
-	switch ( c->conn_state )
+    /* The senders go first, since timing out a reader can start it
+    ** sending its error response.
+    */
+    for ( state = CNST_SENDING; state <= CNST_PAUSING; ++state )
+	for ( c = state_lists[state]; c != (connecttab*) 0; c = next )
 	    {
-	    case CNST_READING:
-	    if ( nowP->tv_sec - c->active_at >= IDLE_READ_TIMELIMIT )
-		{
-		syslog( LOG_INFO,
-		    "%.80s connection timed out reading",
-		    httpd_ntoa( &c->hc->client_addr ) );
-		httpd_send_err(
-		    c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
-		finish_connection( c, nowP );
-		}
-	    break;
-	    case CNST_SENDING:
-	    case CNST_PAUSING:
+	    next = c->cold->state_next;
 	    if ( nowP->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT )
 		{
 		syslog( LOG_INFO,
@@ -2086,7 +2916,28 @@ idle( ClientData client_data, struct timeval* nowP )
 		    httpd_ntoa( &c->hc->client_addr ) );
 		clear_connection( c, nowP );
 		}
-	    break;
+	    }
+
+    for ( c = state_lists[CNST_READING]; c != (connecttab*) 0; c = next )
+	{
+	next = c->cold->state_next;
+	if ( c->cold->num_requests > 0 && c->hc->read_idx == 0 )
+	    {
+	    /* A persistent connection waiting for its next request.
+	    ** These just get closed quietly.
+	    */
+	    if ( terminate ||
+		 nowP->tv_sec - c->active_at >= keepalive_timeout )
+		clear_connection( c, nowP );
+	    }
+	else if ( nowP->tv_sec - c->active_at >= IDLE_READ_TIMELIMIT )
+	    {
+	    syslog( LOG_INFO,
+		"%.80s connection timed out reading",
+		httpd_ntoa( &c->hc->client_addr ) );
+	    httpd_send_err(
+		c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
+	    finish_connection( c, nowP );
 	    }
 	}
     }
@@ -2098,11 +2949,11 @@ wakeup_connection( ClientData client_data, struct timeval* nowP )
     connecttab* c;
 
     c = (connecttab*) client_data.p;
-    c->wakeup_timer = (Timer*) 0;
+    c->cold->wakeup_timer = (Timer*) 0;
     if ( c->conn_state == CNST_PAUSING )
 	{
-	c->conn_state = CNST_SENDING;
-	fdwatch_add_fd( c->hc->conn_fd, c, FDW_WRITE );
+	set_conn_state( c, CNST_SENDING );
+	fdwatch_add_fd( c->hc->conn_fd, c, FDW_WRITE | CONN_FDW_FLAGS );
 	}
     }
 
@@ -2112,7 +2963,7 @@ linger_clear_connection( ClientData client_data, struct timeval* nowP )
     connecttab* c;
 
     c = (connecttab*) client_data.p;
-    c->linger_timer = (Timer*) 0;
+    c->cold->linger_timer = (Timer*) 0;
     really_clear_connection( c, nowP );
     }
 
@@ -2121,6 +2972,7 @@ static void
 occasional( ClientData client_data, struct timeval* nowP )
     {
     mmc_cleanup( nowP );
+    stc_cleanup( nowP );
     tmr_cleanup();
     watchdog_flag = 1;		/* let the watchdog know that we are alive */
     }
@@ -2160,6 +3012,7 @@ logstats( struct timeval* nowP )
     thttpd_logstats( stats_secs );
     httpd_logstats( stats_secs );
     mmc_logstats( stats_secs );
+    stc_logstats( stats_secs );
     fdwatch_logstats( stats_secs );
     tmr_logstats( stats_secs );
     }
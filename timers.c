@@ -25,6 +25,8 @@
 ** SUCH DAMAGE.
 */
 
+#include "config.h"
+
 #include <sys/types.h>
 
 #include <stdlib.h>
@@ -34,93 +36,121 @@
 #include "timers.h"
 
 
-#define HASH_SIZE 67
-static Timer* timers[HASH_SIZE];
-static Timer* free_timers;
-static int alloc_count, active_count, free_count;
+/* The timers live in a hierarchical timing wheel.  Time is counted in
+** millisecond ticks since tmr_init().  Level 0 has a slot for each of the
+** next WHEEL_SIZE ticks; each higher level has slots WHEEL_SIZE times as
+** wide.  A timer goes in the lowest level whose range covers it, and
+** gets moved down ("cascaded") when its slot on the higher level comes
+** up.  The slot lists aren't sorted, so adding and removing timers are
+** constant time.
+*/
+#define WHEEL_BITS 6
+#define WHEEL_SIZE ( 1 << WHEEL_BITS )
+#define WHEEL_MASK ( WHEEL_SIZE - 1 )
+#define WHEEL_LEVELS 5
+#define MAX_DELTA ( 1L << ( WHEEL_BITS * WHEEL_LEVELS ) )	/* 12 days */
+#define RUN_BUCKET -1	/* the list of timers being run right now */
+
+static THREAD_LOCAL Timer* wheel[WHEEL_LEVELS * WHEEL_SIZE];
+static THREAD_LOCAL int level_count[WHEEL_LEVELS];
+static THREAD_LOCAL Timer* run_list;
+static THREAD_LOCAL unsigned long wheel_now;	/* next tick to be run */
+static THREAD_LOCAL struct timeval base_time;
+static THREAD_LOCAL Timer* free_timers;
+static THREAD_LOCAL int alloc_count, active_count, free_count;
 
 ClientData JunkClientData;
 
 
 
-static unsigned int
-hash( Timer* t )
+/* Converts a time into ticks, rounding either up or down.  The tick
+** counter is unsigned and allowed to wrap, so compare ticks by looking
+** at the sign of their difference.
+*/
+static unsigned long
+to_ticks( struct timeval* tvP, int round_up )
     {
-    /* We can hash on the trigger time, even though it can change over
-    ** the life of a timer via either the periodic bit or the tmr_reset()
-    ** call.  This is because both of those guys call l_resort(), which
-    ** recomputes the hash and moves the timer to the appropriate list.
-    */
-    return (
-	(unsigned int) t->time.tv_sec ^
-	(unsigned int) t->time.tv_usec ) % HASH_SIZE;
+    long secs, usecs;
+
+    secs = tvP->tv_sec - base_time.tv_sec;
+    usecs = tvP->tv_usec - base_time.tv_usec;
+    if ( usecs < 0 )
+	{
+	--secs;
+	usecs += 1000000L;
+	}
+    if ( secs < 0 )
+	return 0;
+    if ( round_up )
+	usecs += 999L;
+    return (unsigned long) secs * 1000L + usecs / 1000L;
+    }
+
+
+static void
+set_expires( Timer* t )
+    {
+    t->expires = to_ticks( &t->time, 1 );
+    }
+
+
+static Timer**
+l_head( int bucket )
+    {
+    if ( bucket == RUN_BUCKET )
+	return &run_list;
+    return &wheel[bucket];
     }
 
 
 static void
 l_add( Timer* t )
     {
-    int h = t->hash;
-    Timer* t2;
-    Timer* t2prev;
+    long delta;
+    unsigned long when;
+    int level;
+    Timer** headP;
 
-    t2 = timers[h];
-    if ( t2 == (Timer*) 0 )
-	{
-	/* The list is empty. */
-	timers[h] = t;
-	t->prev = t->next = (Timer*) 0;
-	}
-    else
-	{
-	if ( t->time.tv_sec < t2->time.tv_sec ||
-	     ( t->time.tv_sec == t2->time.tv_sec &&
-	       t->time.tv_usec <= t2->time.tv_usec ) )
-	    {
-	    /* The new timer goes at the head of the list. */
-	    timers[h] = t;
-	    t->prev = (Timer*) 0;
-	    t->next = t2;
-	    t2->prev = t;
-	    }
-	else
-	    {
-	    /* Walk the list to find the insertion point. */
-	    for ( t2prev = t2, t2 = t2->next; t2 != (Timer*) 0;
-		  t2prev = t2, t2 = t2->next )
-		{
-		if ( t->time.tv_sec < t2->time.tv_sec ||
-		     ( t->time.tv_sec == t2->time.tv_sec &&
-		       t->time.tv_usec <= t2->time.tv_usec ) )
-		    {
-		    /* Found it. */
-		    t2prev->next = t;
-		    t->prev = t2prev;
-		    t->next = t2;
-		    t2->prev = t;
-		    return;
-		    }
-		}
-	    /* Oops, got to the end of the list.  Add to tail. */
-	    t2prev->next = t;
-	    t->prev = t2prev;
-	    t->next = (Timer*) 0;
-	    }
-	}
+    /* Overdue timers go in the very next slot, and timers that are too
+    ** far off for the wheel go in the last one, to get re-filed later.
+    */
+    delta = (long) ( t->expires - wheel_now );
+    if ( delta < 0 )
+	delta = 0;
+    else if ( delta >= MAX_DELTA )
+	delta = MAX_DELTA - 1;
+    when = wheel_now + delta;
+
+    for ( level = 0;
+	  level < WHEEL_LEVELS - 1 &&
+	      delta >= ( 1L << ( ( level + 1 ) * WHEEL_BITS ) );
+	  ++level )
+	continue;
+    t->bucket =
+	level * WHEEL_SIZE +
+	(int) ( ( when >> ( level * WHEEL_BITS ) ) & WHEEL_MASK );
+    ++level_count[level];
+
+    headP = l_head( t->bucket );
+    t->prev = (Timer*) 0;
+    t->next = *headP;
+    if ( *headP != (Timer*) 0 )
+	(*headP)->prev = t;
+    *headP = t;
     }
 
 
 static void
 l_remove( Timer* t )
     {
-    int h = t->hash;
-
     if ( t->prev == (Timer*) 0 )
-	timers[h] = t->next;
+	*l_head( t->bucket ) = t->next;
     else
 	t->prev->next = t->next;
     if ( t->next != (Timer*) 0 )
 	t->next->prev = t->prev;
+    if ( t->bucket != RUN_BUCKET )
+	--level_count[t->bucket / WHEEL_SIZE];
     }
 
 
@@ -129,20 +159,44 @@ l_resort( Timer* t )
     {
     /* Remove the timer from its old list. */
     l_remove( t );
-    /* Recompute the hash. */
-    t->hash = hash( t );
-    /* And add it back in to its new list, sorted correctly. */
+    /* Recompute the expiration tick. */
+    set_expires( t );
+    /* And add it back in to its new slot. */
     l_add( t );
     }
 
 
+/* Re-files all the timers in one slot of a higher level. */
+static void
+cascade( int level, int slot )
+    {
+    Timer* t;
+    Timer* next;
+    int bucket = level * WHEEL_SIZE + slot;
+
+    t = wheel[bucket];
+    wheel[bucket] = (Timer*) 0;
+    for ( ; t != (Timer*) 0; t = next )
+	{
+	next = t->next;
+	--level_count[level];
+	l_add( t );
+	}
+    }
+
+
 void
 tmr_init( void )
     {
-    int h;
-
-    for ( h = 0; h < HASH_SIZE; ++h )
-	timers[h] = (Timer*) 0;
+    int b, level;
+
+    for ( b = 0; b < WHEEL_LEVELS * WHEEL_SIZE; ++b )
+	wheel[b] = (Timer*) 0;
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
+	level_count[level] = 0;
+    run_list = (Timer*) 0;
+    (void) gettimeofday( &base_time, (struct timezone*) 0 );
+    wheel_now = 0;
     free_timers = (Timer*) 0;
     alloc_count = active_count = free_count = 0;
     }
@@ -184,8 +238,8 @@ tmr_create(
 	t->time.tv_sec += t->time.tv_usec / 1000000L;
 	t->time.tv_usec %= 1000000L;
 	}
-    t->hash = hash( t );
-    /* Add the new timer to the proper active list. */
+    set_expires( t );
+    /* Add the new timer to the proper slot. */
     l_add( t );
     ++active_count;
 
@@ -197,7 +251,7 @@ struct timeval*
 tmr_timeout( struct timeval* nowP )
     {
     long msecs;
-    static struct timeval timeout;
+    static THREAD_LOCAL struct timeval timeout;
 
     msecs = tmr_mstimeout( nowP );
     if ( msecs == INFTIM )
@@ -211,34 +265,55 @@ tmr_timeout( struct timeval* nowP )
 long
 tmr_mstimeout( struct timeval* nowP )
     {
-    int h;
+    int level, i, first, cur;
     int gotone;
-    long msecs, m;
+    unsigned long soonest, when;
+    long msecs;
     Timer* t;
 
     gotone = 0;
-    msecs = 0;          /* make lint happy */
-    /* Since the lists are sorted, we only need to look at the
-    ** first timer on each one.
+    soonest = 0;        /* make lint happy */
+    /* Within a level the slots come up in order, so only the first
+    ** non-empty one needs looking at.  That's the current slot onward,
+    ** except on higher levels where the current slot has already been
+    ** cascaded, which is when wheel_now isn't sitting right on its
+    ** boundary.
     */
-    for ( h = 0; h < HASH_SIZE; ++h )
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
 	{
-	t = timers[h];
-	if ( t != (Timer*) 0 )
+	if ( level_count[level] == 0 )
+	    continue;
+	cur = (int) ( ( wheel_now >> ( level * WHEEL_BITS ) ) & WHEEL_MASK );
+	if ( ( wheel_now & ( ( 1UL << ( level * WHEEL_BITS ) ) - 1 ) ) == 0 )
+	    first = 0;
+	else
+	    first = 1;
+	for ( i = first; i < first + WHEEL_SIZE; ++i )
 	    {
-	    m = ( t->time.tv_sec - nowP->tv_sec ) * 1000L +
-		( t->time.tv_usec - nowP->tv_usec ) / 1000L;
-	    if ( ! gotone )
+	    t = wheel[level * WHEEL_SIZE + ( ( cur + i ) & WHEEL_MASK )];
+	    if ( t == (Timer*) 0 )
+		continue;
+	    for ( ; t != (Timer*) 0; t = t->next )
 		{
-		msecs = m;
-		gotone = 1;
+		when = t->expires;
+		if ( (long) ( when - wheel_now ) < 0 )
+		    when = wheel_now;
+		if ( ! gotone || (long) ( when - soonest ) < 0 )
+		    {
+		    soonest = when;
+		    gotone = 1;
+		    }
 		}
-	    else if ( m < msecs )
-		msecs = m;
+	    break;
 	    }
 	}
     if ( ! gotone )
 	return INFTIM;
+    /* Round now down, the same as tmr_run() does.  Rounding it up could
+    ** give zero while tmr_run() still sees the timer a tick away, and the
+    ** loop would spin until the clock caught up.
+    */
+    msecs = (long) ( soonest - to_ticks( nowP, 0 ) );
     if ( msecs <= 0 )
 	msecs = 0;
     return msecs;
@@ -248,21 +323,62 @@ tmr_mstimeout( struct timeval* nowP )
 void
 tmr_run( struct timeval* nowP )
     {
-    int h;
+    unsigned long target, tick, boundary;
+    int level, slot;
     Timer* t;
-    Timer* next;
 
-    for ( h = 0; h < HASH_SIZE; ++h )
-	for ( t = timers[h]; t != (Timer*) 0; t = next )
+    target = to_ticks( nowP, 0 );
+    while ( (long) ( target - wheel_now ) >= 0 )
+	{
+	tick = wheel_now;
+	slot = (int) ( tick & WHEEL_MASK );
+	if ( slot == 0 )
 	    {
-	    next = t->next;
-	    /* Since the lists are sorted, as soon as we find a timer
-	    ** that isn't ready yet, we can go on to the next list.
+	    /* Level 0 wrapped around, so cascade the next slot of level 1
+	    ** down, and so on up as the higher levels wrap too.
 	    */
-	    if ( t->time.tv_sec > nowP->tv_sec ||
-		 ( t->time.tv_sec == nowP->tv_sec &&
-		   t->time.tv_usec > nowP->tv_usec ) )
+	    for ( level = 1; level < WHEEL_LEVELS; ++level )
+		{
+		slot = (int) ( ( tick >> ( level * WHEEL_BITS ) ) & WHEEL_MASK );
+		cascade( level, slot );
+		if ( slot != 0 )
+		    break;
+		}
+	    slot = 0;
+	    }
+	else if ( level_count[0] == 0 )
+	    {
+	    /* Nothing on level 0, skip ahead to the next cascade. */
+	    boundary = ( tick | WHEEL_MASK ) + 1;
+	    if ( (long) ( boundary - target ) > 0 )
+		{
+		wheel_now = target + 1;
 		break;
+		}
+	    wheel_now = boundary;
+	    continue;
+	    }
+
+	/* Move this slot's timers to the run list, so that timers added
+	** by the callbacks can't land in it.
+	*/
+	run_list = wheel[slot];
+	wheel[slot] = (Timer*) 0;
+	for ( t = run_list; t != (Timer*) 0; t = t->next )
+	    {
+	    t->bucket = RUN_BUCKET;
+	    --level_count[0];
+	    }
+	wheel_now = tick + 1;
+
+	while ( ( t = run_list ) != (Timer*) 0 )
+	    {
+	    if ( (long) ( t->expires - tick ) > 0 )
+		{
+		/* Parked in the last slot because it was too far off. */
+		l_resort( t );
+		continue;
+		}
 	    (t->timer_proc)( t->client_data, nowP );
 	    if ( t->periodic )
 		{
@@ -279,6 +395,7 @@ tmr_run( struct timeval* nowP )
 	    else
 		tmr_cancel( t );
 	    }
+	}
     }
 
 
@@ -300,7 +417,7 @@ tmr_reset( struct timeval* nowP, Timer* t )
 void
 tmr_cancel( Timer* t )
     {
-    /* Remove it from its active list. */
+    /* Remove it from its slot. */
     l_remove( t );
     --active_count;
     /* And put it on the free list. */
@@ -330,11 +447,11 @@ tmr_cleanup( void )
 void
 tmr_term( void )
     {
-    int h;
+    int b;
 
-    for ( h = 0; h < HASH_SIZE; ++h )
-	while ( timers[h] != (Timer*) 0 )
-	    tmr_cancel( timers[h] );
+    for ( b = 0; b < WHEEL_LEVELS * WHEEL_SIZE; ++b )
+	while ( wheel[b] != (Timer*) 0 )
+	    tmr_cancel( wheel[b] );
     tmr_cleanup();
     }
 
@@ -61,7 +61,8 @@ typedef struct TimerStruct {
     struct timeval time;
     struct TimerStruct* prev;
     struct TimerStruct* next;
-    int hash;
+    unsigned long expires;	/* time in timer-wheel ticks */
+    int bucket;			/* which wheel slot it's in */
     } Timer;
 
 /* Initialize the timer package. */